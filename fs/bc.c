@@ -1,13 +1,49 @@
 
 #include "fs.h"
 
+// The block cache holds at most BCMAXSIZE blocks besides the pinned
+// ones, each in a slot of bc_slot.  Victims are chosen by CLOCK: the
+// hand sweeps the slots, giving blocks whose PTE_A bit is set a second
+// chance by clearing the bit.
+static uint32_t bc_slot[BCMAXSIZE];	// block in each slot, 0 if none
+static uint32_t bc_free[BCMAXSIZE];	// stack of free slots below bc_top
+static uint32_t bc_nfree;
+static uint32_t bc_top;			// slots ever used
+static uint32_t bc_hand;
+
+// Clean blocks are mapped read-only, so the first write to one faults
+// and bc_dirty adds it to bc_dirtyset.  Every writable block, and every
+// PTE_BCDIRTY one, is in the set; entries for blocks since written back
+// or evicted are harmless.
+// The set is written back when it fills up, when its oldest entry is
+// BCDIRTYAGE requests old, or on sync.
+static uint32_t bc_dirtyset[BCDIRTYMAX];
+static uint32_t bc_dirty_since;		// bc_nrequests at the oldest entry
+static uint32_t bc_nrequests;
+
+// Blocks allocated since the last time they were written back.  Their
+// zeroes, or whatever has been written to them since, must be on disk
+// before any pointer to them is, or a crash could leave a file showing
+// the blocks' old contents.  flush_block writes them back before any
+// other block, newest first: a block is always allocated after the
+// block that points to it.
+static uint32_t bc_newset[BCDIRTYMAX];
+static uint32_t bc_nnew;
+
+static void bc_flush_new(void);
+
 // Return the virtual address of this disk block.
 void*
 diskaddr(uint32_t blockno)
 {
+	char *va;
+
 	if (blockno == 0 || (super && blockno >= super->s_nblocks))
 		panic("bad block number %08x in diskaddr", blockno);
-	return (char*) (DISKMAP + blockno * BLKSIZE);
+	va = (char*) (DISKMAP + blockno * BLKSIZE);
+	if (va_is_mapped(va))
+		bc_stat.bc_hits++;
+	return va;
 }
 
 // Is this virtual address mapped?
@@ -21,7 +57,89 @@ va_is_mapped(void *va)
 bool
 va_is_dirty(void *va)
 {
-	return (uvpt[PGNUM(va)] & PTE_D) != 0;
+	return (uvpt[PGNUM(va)] & (PTE_D | PTE_BCDIRTY)) != 0;
+}
+
+// The superblock and the bitmap blocks are never evicted.
+static bool
+bc_pinned(uint32_t blockno)
+{
+	if (blockno == 1)
+		return true;
+	return super && blockno >= 2 &&
+		blockno < 2 + (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
+}
+
+// Drop the cached block in 'slot', writing it back first if it is dirty.
+static void
+bc_drop(uint32_t slot)
+{
+	void *va = (void *) (DISKMAP + bc_slot[slot] * BLKSIZE);
+	int r;
+
+	if (va_is_mapped(va)) {
+		flush_block(va);
+		if ((r = sys_page_unmap(0, va)) < 0)
+			panic("in bc_drop, sys_page_unmap: %e", r);
+		bc_stat.bc_evictions++;
+	}
+	bc_slot[slot] = 0;
+	bc_free[bc_nfree++] = slot;
+	bc_stat.bc_nblocks--;
+}
+
+// Evict one block, chosen by CLOCK.  A block still referenced since
+// the hand last passed is written back if dirty and has its PTE_A bit
+// cleared (remapping clears both bits), and the hand moves on.  The
+// sweep ends within two turns, since the first clears every PTE_A.
+static void
+bc_evict(void)
+{
+	uint32_t slot;
+	void *va;
+	int r;
+
+	while (1) {
+		slot = bc_hand;
+		bc_hand = (bc_hand + 1) % bc_top;
+		if (!bc_slot[slot])
+			continue;
+		va = (void *) (DISKMAP + bc_slot[slot] * BLKSIZE);
+		if (va_is_mapped(va) && (uvpt[PGNUM(va)] & PTE_A)) {
+			flush_block(va);
+			if ((uvpt[PGNUM(va)] & PTE_A) &&
+			    (r = sys_page_map(0, va, 0, va, uvpt[PGNUM(va)] & PTE_SYSCALL)) < 0)
+				panic("in bc_evict, sys_page_map: %e", r);
+			continue;
+		}
+		bc_drop(slot);
+		return;
+	}
+}
+
+// Evict blocks until at most nblocks unpinned ones are cached.  Called
+// between requests with BCSIZE, so that no block a request is using
+// disappears under it.
+void
+bc_shrink(size_t nblocks)
+{
+	while (bc_stat.bc_nblocks > nblocks)
+		bc_evict();
+}
+
+// Give a block just read in a slot, evicting one if none is free.
+static void
+bc_insert(uint32_t blockno)
+{
+	uint32_t slot;
+
+	if (bc_pinned(blockno))
+		return;
+	if (bc_nfree == 0 && bc_top == BCMAXSIZE)
+		bc_evict();
+	slot = bc_nfree ? bc_free[--bc_nfree] : bc_top++;
+	bc_slot[slot] = blockno;
+	bc_stat.bc_nblocks++;
 }
 
 // Fault any disk block that is read in to memory by
@@ -38,6 +156,15 @@ bc_pgfault(struct UTrapframe *utf)
 		panic("page fault in FS: eip %08x, va %08x, err %04x",
 		      utf->utf_eip, addr, utf->utf_err);
 
+	// A write to a clean cached block makes it dirty.
+	if (va_is_mapped(addr)) {
+		if (!(utf->utf_err & FEC_WR) || (uvpt[PGNUM(addr)] & PTE_W))
+			panic("page fault in FS: eip %08x, va %08x, err %04x",
+			      utf->utf_eip, addr, utf->utf_err);
+		bc_dirty(addr);
+		return;
+	}
+
 	// Sanity check the block number.
 	if (super && blockno >= super->s_nblocks)
 		panic("reading non-existent block %08x\n", blockno);
@@ -54,10 +181,11 @@ bc_pgfault(struct UTrapframe *utf)
 	
 	if ((r = ide_read(blockno * BLKSECTS, addr, BLKSECTS)) < 0)
 		panic("in bc_pgfault, ide_read: %e\n", r);
+	bc_stat.bc_misses++;
 	
-	// Clear the dirty bit for the disk block page since we just read the
-	// block from disk
-	if ((r = sys_page_map(0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
+	// Map it read-only, which clears the dirty bit ide_read set, so
+	// that the first write to it faults and marks it dirty
+	if ((r = sys_page_map(0, addr, 0, addr, PTE_P | PTE_U)) < 0)
 		panic("in bc_pgfault, sys_page_map: %e", r);
 
 	// Check that the block we read was allocated. (exercise for
@@ -65,15 +193,140 @@ bc_pgfault(struct UTrapframe *utf)
 	// in?)
 	if (bitmap && block_is_free(blockno))
 		panic("reading free block %08x\n", blockno);
+
+	bc_insert(blockno);
+	if (utf->utf_err & FEC_WR)
+		bc_dirty(addr);
+}
+
+// Add a block just made writable to the dirty set.  The caller has
+// made room.
+static void
+bc_dirtyset_add(uint32_t blockno)
+{
+	if (bc_stat.bc_ndirty == 0)
+		bc_dirty_since = bc_nrequests;
+	bc_dirtyset[bc_stat.bc_ndirty++] = blockno;
+}
+
+// Make the cached block containing VA writable and add it to the dirty
+// set, reading it in first if need be.  A block that clients still map
+// (see share_blocks) gets a private copy to write to.  file_write calls
+// this before writing, rather than taking a fault per block.
+void
+bc_dirty(void *addr)
+{
+	uint32_t blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
+	int perm, r;
+
+	addr = (void *)ROUNDDOWN(addr, PGSIZE);
+	if (!va_is_mapped(addr))
+		(void) *(volatile char *) addr;
+	if (uvpt[PGNUM(addr)] & PTE_W)
+		return;
+	if (bc_stat.bc_ndirty == BCDIRTYMAX)
+		bc_sync();
+
+	// A PTE_BCDIRTY block keeps the bit, and its place in the set.
+	perm = PTE_P | PTE_U | PTE_W | (uvpt[PGNUM(addr)] & PTE_BCDIRTY);
+	if ((uvpt[PGNUM(addr)] & PTE_COW) && pageref(addr) > 1) {
+		if ((r = sys_page_alloc(0, PFTEMP, PTE_P | PTE_U | PTE_W)) < 0)
+			panic("in bc_dirty, sys_page_alloc: %e\n", r);
+		memmove(PFTEMP, addr, PGSIZE);
+		if ((r = sys_page_map(0, PFTEMP, 0, addr, perm)) < 0)
+			panic("in bc_dirty, sys_page_map: %e", r);
+		if ((r = sys_page_unmap(0, PFTEMP)) < 0)
+			panic("in bc_dirty, sys_page_unmap: %e", r);
+	} else if ((r = sys_page_map(0, addr, 0, addr, perm)) < 0)
+		panic("in bc_dirty, sys_page_map: %e", r);
+	if (!(perm & PTE_BCDIRTY))
+		bc_dirtyset_add(blockno);
+}
+
+// Put a zeroed page in the cache for a newly allocated block, dirty,
+// instead of reading in the block's old contents to clear them.
+// PTE_BCDIRTY sees that the zeroes are written back even if nothing
+// else is, and bc_newset that they are written back in time.
+void
+bc_new_block(uint32_t blockno)
+{
+	void *addr = diskaddr(blockno);
+	bool cached = va_is_mapped(addr);
+	int r;
+
+	if (bc_nnew == BCDIRTYMAX)
+		bc_flush_new();
+	bc_newset[bc_nnew++] = blockno;
+	if (cached && (uvpt[PGNUM(addr)] & PTE_W)) {
+		memset(addr, 0, BLKSIZE);
+		return;
+	}
+	if (bc_stat.bc_ndirty == BCDIRTYMAX)
+		bc_sync();
+	if (!cached)
+		bc_insert(blockno);
+	if ((r = sys_page_alloc(0, addr, PTE_P | PTE_U | PTE_W | PTE_BCDIRTY)) < 0)
+		panic("in bc_new_block, sys_page_alloc: %e", r);
+	bc_dirtyset_add(blockno);
+}
+
+// Write back every dirty block.  The cost is in the number of dirty
+// blocks, not the size of the disk.
+void
+bc_sync(void)
+{
+	uint32_t i;
+
+	for (i = 0; i < bc_stat.bc_ndirty; i++)
+		flush_block((void *) (DISKMAP + bc_dirtyset[i] * BLKSIZE));
+	bc_stat.bc_ndirty = 0;
+}
+
+// Called by the server between requests, when no block is in use:
+// write back the dirty set if its oldest entry is BCDIRTYAGE requests
+// old, and bring the cache back down to BCSIZE blocks.
+void
+bc_maintain(void)
+{
+	bc_nrequests++;
+	if (bc_stat.bc_ndirty > 0 && bc_nrequests - bc_dirty_since >= BCDIRTYAGE)
+		bc_sync();
+	bc_shrink(BCSIZE);
+}
+
+// Write back the blocks in bc_newset, newest first.
+static void
+bc_flush_new(void)
+{
+	uint32_t n = bc_nnew;
+
+	// flush_block calls us again, and must find the set empty.
+	bc_nnew = 0;
+	while (n > 0)
+		flush_block((void *) (DISKMAP + bc_newset[--n] * BLKSIZE));
+}
+
+// Write back the dirty bitmap blocks.
+static void
+bc_flush_bitmap(void)
+{
+	uint32_t i;
+
+	if (!bitmap)
+		return;
+	for (i = 0; i * BLKBITSIZE < super->s_nblocks; i++)
+		flush_block((void *) (DISKMAP + (2 + i) * BLKSIZE));
 }
 
 // Flush the contents of the block containing VA out to disk if
-// necessary, then clear the PTE_D bit using sys_page_map.
-// If the block is not in the block cache or is not dirty, does
-// nothing.
-// Hint: Use va_is_mapped, va_is_dirty, and ide_write.
-// Hint: Use the PTE_SYSCALL constant when calling sys_page_map.
-// Hint: Don't forget to round addr down.
+// necessary, then map it read-only again using sys_page_map, which
+// also clears the PTE_D and PTE_BCDIRTY bits, so that the next write
+// marks it dirty.  A block shared copy-on-write stays so.
+// If the block is not in the block cache or is clean (read-only and
+// not PTE_BCDIRTY), does nothing.  The bitmap goes out first, so that
+// the disk never has a pointer to a block it doesn't show as allocated,
+// and then newly allocated blocks (see bc_newset), so that it never
+// has a pointer to a block still holding stale data.
 void
 flush_block(void *addr)
 {
@@ -84,20 +337,70 @@ flush_block(void *addr)
 		panic("flush_block of bad va %08x", addr);
 
 	// LAB 5: Your code here.
-	if (!va_is_mapped(addr) || !va_is_dirty(addr)) {
+	if (!va_is_mapped(addr) ||
+	    !(uvpt[PGNUM(addr)] & (PTE_W | PTE_BCDIRTY))) {
 		//the block is not in the cache or hasn't been modified
 		//so nothing to do
 		return;
 	}
 	
 	addr = (void *)ROUNDDOWN(addr, PGSIZE);
-	if ((r = ide_write(blockno * BLKSECTS, addr, BLKSECTS)) < 0)
-		panic("in flush_block, ide_write: %e\n", r);
+	// The superblock points to the root directory's blocks.
+	if (blockno == 1 || !bc_pinned(blockno)) {
+		bc_flush_bitmap();
+		bc_flush_new();
+	}
+	if (va_is_dirty(addr)) {
+		if ((r = ide_write(blockno * BLKSECTS, addr, BLKSECTS)) < 0)
+			panic("in flush_block, ide_write: %e\n", r);
+		bc_stat.bc_writebacks++;
+	}
 		
-	if ((r = sys_page_map(0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
+	if ((r = sys_page_map(0, addr, 0, addr,
+			      PTE_P | PTE_U | (uvpt[PGNUM(addr)] & PTE_COW))) < 0)
 		panic("in flush_block, sys_page_map: %e\n", r);
 }
 
+// Get the nblocks blocks starting with the one containing VA ready to
+// be mapped into a client: read them in and make our own mappings of
+// them copy-on-write, all in one system call.  Dirty blocks are not
+// written back for this; they keep their place in the dirty set and
+// are marked PTE_BCDIRTY instead.  From then on the client's pages are
+// a snapshot, and bc_dirty gives us a fresh copy of a block when we
+// next write it.  At most FSMAXPAGES blocks are shared at once.
+void
+share_blocks(void *addr, size_t nblocks)
+{
+	static struct PageMapRange pm[FSMAXPAGES];
+	int i, n = 0, perm, r;
+	char *va;
+
+	assert(nblocks <= FSMAXPAGES);
+	addr = (void *)ROUNDDOWN(addr, PGSIZE);
+	for (i = 0; i < nblocks; i++) {
+		va = (char *) addr + i * BLKSIZE;
+		// fault it in
+		(void) *(volatile char *) va;
+		if (uvpt[PGNUM(va)] & PTE_COW)
+			continue;
+		perm = PTE_P | PTE_U | PTE_COW;
+		if (va_is_dirty(va) && (uvpt[PGNUM(va)] & (PTE_W | PTE_BCDIRTY)))
+			perm |= PTE_BCDIRTY;
+		// extend the last range if this block continues it
+		if (n > 0 && pm[n - 1].pm_perm == perm &&
+		    pm[n - 1].pm_srcva + pm[n - 1].pm_npages * PGSIZE == (uintptr_t) va) {
+			pm[n - 1].pm_npages++;
+			continue;
+		}
+		pm[n].pm_srcva = pm[n].pm_dstva = (uintptr_t) va;
+		pm[n].pm_npages = 1;
+		pm[n].pm_perm = perm;
+		n++;
+	}
+	if (n > 0 && (r = sys_page_map_batch(0, 0, pm, n)) < 0)
+		panic("in share_blocks, sys_page_map_batch: %e\n", r);
+}
+
 // Test that the block cache works, by smashing the superblock and
 // reading it back.
 static void
@@ -132,6 +435,7 @@ void
 bc_init(void)
 {
 	struct Super super;
+	bc_stat.bc_size = BCSIZE;
 	set_pgfault_handler(bc_pgfault);
 	check_bc();
 
@@ -11,8 +11,26 @@
 /* Maximum disk size we can handle (3GB) */
 #define DISKSIZE	0xC0000000
 
+/* Blocks the block cache keeps between requests, not counting the
+ * superblock and bitmap blocks, which stay cached.  A single request
+ * may go over, up to BCMAXSIZE. */
+#define BCSIZE		512
+#define BCMAXSIZE	(BCSIZE + 2 * FSMAXPAGES)
+
+/* Dirty blocks are written back once this many have been dirtied, or
+ * once the oldest has been dirty for BCDIRTYAGE requests. */
+#define BCDIRTYMAX	128
+#define BCDIRTYAGE	64
+
+/* A cached block written since it was last written back, but mapped
+ * read-only to be shared with clients, carries this PTE_AVAIL bit
+ * until it is written back. */
+#define PTE_BCDIRTY	0x200
+
 struct Super *super;		// superblock
 uint32_t *bitmap;		// bitmap blocks mapped in memory
+struct BcStat bc_stat;		// block cache counters
+bool dcache_bypass;		// path lookups skip the path cache
 
 /* ide.c */
 bool	ide_probe_disk1(void);
@@ -26,12 +44,19 @@ void*	diskaddr(uint32_t blockno);
 bool	va_is_mapped(void *va);
 bool	va_is_dirty(void *va);
 void	flush_block(void *addr);
+void	share_blocks(void *addr, size_t nblocks);
+void	bc_shrink(size_t nblocks);
+void	bc_dirty(void *addr);
+void	bc_new_block(uint32_t blockno);
+void	bc_sync(void);
+void	bc_maintain(void);
 void	bc_init(void);
 
 /* fs.c */
 void fs_init(void);
 int	file_get_block(struct File *f, uint32_t file_blockno, char **pblk);
 int	file_create(const char *path, struct File **f);
+int	dir_create(const char *path, struct File **f);
 int	file_open(const char *path, struct File **f);
 ssize_t	file_read(struct File *f, void *buf, size_t count, off_t offset);
 int	file_write(struct File *f, const void *buf, size_t count, off_t offset);
@@ -42,7 +67,9 @@ void fs_sync(void);
 
 /* int	map_block(uint32_t); */
 bool block_is_free(uint32_t blockno);
+void free_block(uint32_t blockno);
 int	alloc_block(void);
+int	alloc_blocks(uint32_t want, uint32_t *nalloc);
 
 /* test.c */
 void fs_test(void);
@@ -113,6 +113,7 @@ opendisk(const char *name)
 	super->s_nblocks = nblocks;
 	super->s_root.f_type = FTYPE_DIR;
 	strcpy(super->s_root.f_name, "/");
+	super->s_features = FS_DIRHASH;
 
 	nbitblocks = (nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
 	bitmap = alloc(nbitblocks * BLKSIZE);
@@ -151,7 +152,7 @@ void
 startdir(struct File *f, struct Dir *dout)
 {
 	dout->f = f;
-	dout->ents = malloc(MAX_DIR_ENTS * sizeof *dout->ents);
+	dout->ents = calloc(MAX_DIR_ENTS, sizeof *dout->ents);
 	dout->n = 0;
 }
 
@@ -166,6 +167,31 @@ diradd(struct Dir *d, uint32_t type, const char *name)
 	return out;
 }
 
+// Build the hashed index of the n entries of dir at ents
+// (see DIRHASH_SLOTS).
+void
+buildindex(struct File *dir, struct File *ents, int n)
+{
+	uint32_t nblocks, mask, h, i, *slots;
+	int e;
+
+	for (nblocks = 1; n * 4 > nblocks * DIRHASH_SLOTS * 3; nblocks *= 2)
+		if (nblocks == DIRHASH_NBLOCKS)
+			return;
+	slots = alloc(nblocks * BLKSIZE);
+	mask = nblocks * DIRHASH_SLOTS - 1;
+	for (e = 0; e < n; e++) {
+		h = dirhash(ents[e].f_name);
+		for (i = h & mask; slots[i] != 0; i = (i + 1) & mask)
+			;
+		slots[i] = DIRHASH_SLOT(h, e);
+	}
+	dir->f_dirhash_nblocks = nblocks;
+	dir->f_dirhash_count = n;
+	for (i = 0; i < nblocks; i++)
+		dir->f_dirhash[i] = blockof(slots) + i;
+}
+
 void
 finishdir(struct Dir *d)
 {
@@ -173,6 +199,7 @@ finishdir(struct Dir *d)
 	struct File *start = alloc(size);
 	memmove(start, d->ents, size);
 	finishfile(d->f, blockof(start), ROUNDUP(size, BLKSIZE));
+	buildindex(d->f, start, d->n);
 	free(d->ents);
 	d->ents = NULL;
 }
@@ -45,8 +45,15 @@ struct OpenFile opentab[MAXOPEN] = {
 	{ 0, 0, 1, 0 }
 };
 
-// Virtual address at which to receive page mappings containing client requests.
-union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
+// Virtual address at which to receive page mappings containing client
+// requests, followed by room for FSMAXPAGES pages of write data.
+union Fsipc *fsreq = (union Fsipc *)0x0f000000;
+
+// Pages received with the current request, counting the request page
+size_t fsreq_npages;
+
+// Body of the current request if it came in registers (see fsreq_words)
+union Fsipc fsreq_small;
 
 void
 serve_init(void)
@@ -127,7 +134,11 @@ serve_open(envid_t envid, struct Fsreq_open *req,
 
 	// Open the file
 	if (req->req_omode & O_CREAT) {
-		if ((r = file_create(path, &f)) < 0) {
+		if (req->req_omode & O_MKDIR)
+			r = dir_create(path, &f);
+		else
+			r = file_create(path, &f);
+		if (r < 0) {
 			if (!(req->req_omode & O_EXCL) && r == -E_FILE_EXISTS)
 				goto try_open;
 			if (debug)
@@ -201,52 +212,156 @@ serve_set_size(envid_t envid, struct Fsreq_set_size *req)
 	return file_set_size(o->o_file, req->req_size);
 }
 
-// Read at most ipc->read.req_n bytes from the current seek position
-// in ipc->read.req_fileid.  Return the bytes read from the file to
-// the caller in ipc->readRet, then update the seek position.  Returns
-// the number of bytes successfully read, or < 0 on error.
+// Describe the cached blocks holding at most n bytes of f from offset
+// in *sg, as runs of consecutive blocks, and get them ready to be
+// mapped into a client copy-on-write.  Stops short at FSMAXPAGES
+// blocks, or when the blocks don't fit in IPC_MAXRANGES runs.  Returns
+// the number of bytes the runs hold from offset on, or < 0 on error.
+static ssize_t
+file_runs(struct File *f, off_t offset, size_t n, struct IpcSg *sg)
+{
+	struct IpcRange *run;
+	size_t count, bn;
+	char *blk;
+	int i, r;
+
+	if (offset >= f->f_size)
+		return 0;
+	n = MIN(n, f->f_size - offset);
+
+	count = 0;
+	run = NULL;
+	for (bn = offset / BLKSIZE; count < n && bn < offset / BLKSIZE + FSMAXPAGES; bn++) {
+		if ((r = file_get_block(f, bn, &blk)) < 0) {
+			if (count == 0)
+				return r;
+			break;
+		}
+		if (run && (char *) run->ir_va + run->ir_npages * BLKSIZE == blk)
+			run->ir_npages++;
+		else if (sg->sg_nsend < IPC_MAXRANGES) {
+			run = &sg->sg_send[sg->sg_nsend++];
+			run->ir_va = (uintptr_t) blk;
+			run->ir_npages = 1;
+		} else
+			break;
+		count += MIN(BLKSIZE - (offset + count) % BLKSIZE, n - count);
+	}
+
+	for (i = 0; i < sg->sg_nsend; i++)
+		share_blocks((void *) sg->sg_send[i].ir_va, sg->sg_send[i].ir_npages);
+	return count;
+}
+
+// Read at most req->req_n bytes from the current seek position in
+// req->req_fileid.  Up to FSREADINLINE bytes are copied to
+// ipc->readRet.  Instead of copying more bytes out, describe the
+// cached blocks holding them in *sg for the caller to map
+// copy-on-write (see file_runs); the data starts at the seek
+// position's offset into the first block.  Then update the seek
+// position.  Returns the number of bytes successfully read, or < 0 on
+// error.
 int
-serve_read(envid_t envid, union Fsipc *ipc)
+serve_read(envid_t envid, union Fsipc *ipc, struct IpcSg *sg)
 {
 	struct Fsreq_read *req = &ipc->read;
 	struct Fsret_read *ret = &ipc->readRet;
 	struct OpenFile *o;
+	ssize_t count;
+	size_t req_n;
 	int r;
 	
 	if (debug)
 		cprintf("serve_read %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
 
-	// Lab 5: Your code here:
-	
-	// First, use openfile_lookup to find the relevant open file.
-	// On failure, return the error code to the client with ipc_send.
 	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0) {
 		if (debug)
 			cprintf("[%08x] in serve_read, openfile_lookup %e\n", sys_getenvid(), r);
 		return r;
 	}
-	
-	// Second, call the relevant file system function (from fs/fs.c).
-	// On failure, return the error code to the client.
-	
-	//ret->ret_buf's size is only PGSIZE
-	size_t req_n = (req->req_n > sizeof(ret->ret_buf)) ? sizeof(ret->ret_buf) : req->req_n;
-	ssize_t count;
-	if ((count = file_read(o->o_file, ret->ret_buf, req_n, o->o_fd->fd_offset)) < 0) {
-		if (debug)
-			cprintf("[%08x] in serve_read, file_read %e\n", sys_getenvid(), count);
-		return count;
+
+	// ret overlaps req
+	req_n = req->req_n;
+	if (req_n <= FSREADINLINE)
+		count = file_read(o->o_file, ret->ret_buf, req_n, o->o_fd->fd_offset);
+	else {
+		count = file_runs(o->o_file, o->o_fd->fd_offset, req_n, sg);
+		sg->sg_perm = PTE_P|PTE_U|PTE_COW;
 	}
-	
+	if (count < 0)
+		return count;
+
 	o->o_fd->fd_offset += count;
 	return count;
 }
 
+// Map the cached blocks holding at most req->req_n bytes of
+// req->req_fileid from the block-aligned req->req_offset into the
+// caller, as for serve_read, but read-only unless req->req_perm asks
+// for PTE_COW.  The seek position is left alone.  Returns the number
+// of bytes mapped, or < 0 on error.
+int
+serve_map(envid_t envid, struct Fsreq_map *req, struct IpcSg *sg)
+{
+	struct OpenFile *o;
+	ssize_t count;
+	int r;
+
+	if (debug)
+		cprintf("serve_map %08x %08x %08x %08x\n", envid, req->req_fileid,
+			req->req_offset, req->req_n);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if (req->req_offset < 0 || req->req_offset % BLKSIZE)
+		return -E_INVAL;
+	if ((count = file_runs(o->o_file, req->req_offset, req->req_n, sg)) < 0)
+		return count;
+	sg->sg_perm = PTE_P|PTE_U|(req->req_perm & PTE_COW);
+	return count;
+}
+
+// Like serve_read, but instead of copying the data out, map the block
+// at the current seek position into the caller copy-on-write by setting
+// *pg_store and *perm_store.  The seek position must be block-aligned.
+// Returns the number of bytes of the block that belong to the file, at
+// most req->req_n, and advances the seek position by that much.
+int
+serve_read_page(envid_t envid, struct Fsreq_read *req,
+		void **pg_store, int *perm_store)
+{
+	struct OpenFile *o;
+	char *blk;
+	off_t offset;
+	int r;
+
+	if (debug)
+		cprintf("serve_read_page %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	offset = o->o_fd->fd_offset;
+	if (offset % BLKSIZE)
+		return -E_INVAL;
+	if (offset >= o->o_file->f_size || req->req_n == 0)
+		return 0;
+	if ((r = file_get_block(o->o_file, offset / BLKSIZE, &blk)) < 0)
+		return r;
+
+	share_blocks(blk, 1);
+	*pg_store = blk;
+	*perm_store = PTE_P|PTE_U|PTE_COW;
+
+	r = MIN(req->req_n, MIN(BLKSIZE, o->o_file->f_size - offset));
+	o->o_fd->fd_offset += r;
+	return r;
+}
 
 // Write req->req_n bytes from req->req_buf to req_fileid, starting at
 // the current seek position, and update the seek position
-// accordingly.  Extend the file if necessary.  Returns the number of
-// bytes written, or < 0 on error.
+// accordingly.  If the client sent pages after the request page, the
+// bytes are at req->req_pgoff in those instead.  Extend the file if
+// necessary.  Returns the number of bytes written, or < 0 on error.
 int
 serve_write(envid_t envid, struct Fsreq_write *req)
 {	
@@ -264,9 +379,17 @@ serve_write(envid_t envid, struct Fsreq_write *req)
 		return r;
 	}
 
-	size_t req_n = (req->req_n > sizeof(req->req_buf)) ? sizeof(req->req_buf) : req->req_n;
+	const char *buf = req->req_buf;
+	size_t max = sizeof(req->req_buf);
+	if (fsreq_npages > 1) {
+		if (req->req_pgoff >= PGSIZE)
+			return -E_INVAL;
+		buf = (const char *) fsreq + PGSIZE + req->req_pgoff;
+		max = (fsreq_npages - 1) * PGSIZE - req->req_pgoff;
+	}
+	size_t req_n = MIN(req->req_n, max);
 	ssize_t count;
-	if ((count = file_write(o->o_file, req->req_buf, req_n, o->o_fd->fd_offset)) < 0) {
+	if ((count = file_write(o->o_file, buf, req_n, o->o_fd->fd_offset)) < 0) {
 		if (debug)
 			cprintf("[%08x] in serve_write, file_write %e\n", sys_getenvid(), count);
 		return count;
@@ -322,53 +445,131 @@ serve_sync(envid_t envid, union Fsipc *req)
 	return 0;
 }
 
+// Return the block cache counters.
+int
+serve_bcstat(envid_t envid, union Fsipc *ipc)
+{
+	if (debug)
+		cprintf("serve_bcstat %08x\n", envid);
+
+	ipc->bcstatRet = bc_stat;
+	return 0;
+}
+
 typedef int (*fshandler)(envid_t envid, union Fsipc *req);
 
 fshandler handlers[] = {
 	// Open is handled specially because it passes pages
 	/* [FSREQ_OPEN] =	(fshandler)serve_open, */
-	[FSREQ_READ] =		serve_read,
 	[FSREQ_STAT] =		serve_stat,
 	[FSREQ_FLUSH] =		(fshandler)serve_flush,
 	[FSREQ_WRITE] =		(fshandler)serve_write,
 	[FSREQ_SET_SIZE] =	(fshandler)serve_set_size,
-	[FSREQ_SYNC] =		serve_sync
+	[FSREQ_SYNC] =		serve_sync,
+	[FSREQ_BCSTAT] =	serve_bcstat
 };
 #define NHANDLERS (sizeof(handlers)/sizeof(handlers[0]))
 
+// Return true if requests of type 'req' may send their body in the
+// IPC_NWORDS words of the message instead of on a page.
+static bool
+fsreq_words(uint32_t req)
+{
+	static_assert(sizeof(struct Fsreq_flush) <= IPC_NWORDS * 4);
+	static_assert(sizeof(struct Fsreq_set_size) <= IPC_NWORDS * 4);
+	return req == FSREQ_FLUSH || req == FSREQ_SET_SIZE ||
+		req == FSREQ_SYNC;
+}
+
 void
 serve(void)
 {
 	uint32_t req, whom;
-	int perm, r;
+	int perm, r, i;
 	void *pg;
+	union Fsipc *body;
+	struct IpcSg sg;
 
+	if ((r = sys_ipc_recv_pages(fsreq, 1 + FSMAXPAGES)) < 0)
+		panic("serve: sys_ipc_recv_pages: %e", r);
 	while (1) {
-		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+		req = thisenv->env_ipc_value;
+		whom = thisenv->env_ipc_from;
+		perm = thisenv->env_ipc_perm;
+		fsreq_npages = thisenv->env_ipc_npages;
+		// Between requests no block is in use, so this is where
+		// the block cache writes back and evicts.
+		bc_maintain();
 		if (debug) {
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
 				req, whom, uvpt[PGNUM(fsreq)], fsreq);
 		}
 
-		// All requests must contain an argument page
-		if (!(perm & PTE_P)) {
+		// All requests must contain an argument page, except small
+		// ones that pass their body in the words of the message.
+		body = fsreq;
+		if (!(perm & PTE_P) && fsreq_words(req)) {
+			memcpy(&fsreq_small, (void *) thisenv->env_ipc_words,
+			       sizeof(thisenv->env_ipc_words));
+			body = &fsreq_small;
+		} else if (!(perm & PTE_P)) {
 			cprintf("Invalid request from %08x: no argument page\n",
 				whom);
-			continue; // just leave it hanging...
+			// just leave it hanging...
+			if ((r = sys_ipc_recv_pages(fsreq, 1 + FSMAXPAGES)) < 0)
+				panic("serve: sys_ipc_recv_pages: %e", r);
+			continue;
 		}
 
 		pg = NULL;
+		sg.sg_nsend = 0;
+		sg.sg_perm = 0;
 		if (req == FSREQ_OPEN) {
+			// O_NOCACHE opens look each name up in its directory
+			dcache_bypass = (((struct Fsreq_open*)fsreq)->req_omode & O_NOCACHE) != 0;
 			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
+			dcache_bypass = 0;
+		} else if (req == FSREQ_READ_PAGE) {
+			r = serve_read_page(whom, (struct Fsreq_read*)fsreq, &pg, &perm);
+		} else if (req == FSREQ_READ) {
+			r = serve_read(whom, fsreq, &sg);
+		} else if (req == FSREQ_MAP) {
+			r = serve_map(whom, (struct Fsreq_map*)fsreq, &sg);
 		} else if (req < NHANDLERS && handlers[req]) {
-			r = handlers[req](whom, fsreq);
+			r = handlers[req](whom, body);
 		} else {
 			cprintf("Invalid request code %d from %08x\n", req, whom);
 			r = -E_INVAL;
 		}
-		ipc_send(whom, r, pg, perm);
-		sys_page_unmap(0, fsreq);
+		if (pg) {
+			sg.sg_send[0].ir_va = (uintptr_t) pg;
+			sg.sg_send[0].ir_npages = 1;
+			sg.sg_nsend = 1;
+			sg.sg_perm = perm;
+		}
+		// Let go of the client's write data.
+		for (i = 1; i < fsreq_npages; i++)
+			sys_page_unmap(0, (char *) fsreq + i * PGSIZE);
+
+		// Reply and wait for the next request in one system call.
+		// The client is waiting for the reply, so it runs right away.
+		// The next request's pages replace the old ones at fsreq.
+		sg.sg_dstva = (uintptr_t) fsreq;
+		sg.sg_dstnpages = 1 + FSMAXPAGES;
+		r = sys_ipc_send_recv_sg(whom, r, &sg);
+		if (r < 0 && r != -E_BAD_ENV && sg.sg_nsend > 0) {
+			// The reply's pages don't fit the client's receive
+			// window, so tell it the error instead.
+			sg.sg_nsend = 0;
+			r = sys_ipc_send_recv_sg(whom, r, &sg);
+		}
+		if (r < 0) {
+			// The client is gone or can't take any reply: drop it.
+			if (debug)
+				cprintf("reply to %08x dropped: %e\n", whom, r);
+			if ((r = sys_ipc_recv_pages(fsreq, 1 + FSMAXPAGES)) < 0)
+				panic("serve: sys_ipc_recv_pages: %e", r);
+		}
 	}
 }
 
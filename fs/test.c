@@ -10,6 +10,7 @@ fs_test(void)
 {
 	struct File *f;
 	int r;
+	uint32_t i, n;
 	char *blk;
 	uint32_t *bits;
 
@@ -27,6 +28,23 @@ fs_test(void)
 	assert(!(bitmap[r/32] & (1 << (r%32))));
 	cprintf("alloc_block is good\n");
 
+	// a run of blocks, free before and taken after; the search goes
+	// on from the end of the run
+	if ((r = alloc_blocks(4, &n)) < 0)
+		panic("alloc_blocks: %e", r);
+	assert(n >= 1 && n <= 4);
+	for (i = 0; i < n; i++) {
+		assert(bits[(r+i)/32] & (1 << ((r+i)%32)));
+		assert(!block_is_free(r + i));
+	}
+	if (block_is_free(r + n)) {
+		assert(alloc_block() == r + n);
+		free_block(r + n);
+	}
+	for (i = 0; i < n; i++)
+		free_block(r + i);
+	cprintf("alloc_blocks is good\n");
+
 	if ((r = file_open("/not-found", &f)) < 0 && r != -E_NOT_FOUND)
 		panic("file_open /not-found: %e", r);
 	else if (r == 0)
@@ -64,4 +82,79 @@ fs_test(void)
 	assert(!(uvpt[PGNUM(blk)] & PTE_D));
 	assert(!(uvpt[PGNUM(f)] & PTE_D));
 	cprintf("file rewrite is good\n");
+
+	// clean blocks are read-only; a write puts the block in the
+	// dirty set, and sync writes back just that.  file_flush only
+	// wrote back f's blocks, so start from an empty set.
+	fs_sync();
+	assert(bc_stat.bc_ndirty == 0 && !(uvpt[PGNUM(blk)] & PTE_W));
+	r = bc_stat.bc_writebacks;
+	blk[0] = msg[0];
+	assert(bc_stat.bc_ndirty == 1 && (uvpt[PGNUM(blk)] & PTE_W));
+	fs_sync();
+	assert(bc_stat.bc_ndirty == 0 && !(uvpt[PGNUM(blk)] & PTE_W));
+	assert(bc_stat.bc_writebacks == r + 1);
+	file_flush(f);
+	assert(bc_stat.bc_writebacks == r + 1);
+	// a newly allocated block goes out before any other block
+	if ((r = alloc_block()) < 0)
+		panic("alloc_block: %e", r);
+	bc_new_block(r);
+	blk[0] = msg[0];
+	flush_block(blk);
+	assert(!(uvpt[PGNUM(diskaddr(r))] & (PTE_W | PTE_BCDIRTY)));
+	free_block(r);
+	cprintf("dirty set is good\n");
+
+	// dirty the block, then empty the cache: the block is written
+	// back on the way out, and the superblock and bitmap stay
+	blk[0] = 'T';
+	bc_shrink(0);
+	assert(bc_stat.bc_nblocks == 0);
+	assert(!va_is_mapped(blk));
+	assert(va_is_mapped(super) && va_is_mapped(bitmap));
+	r = bc_stat.bc_misses;
+	assert(blk[0] == 'T' && strcmp(blk + 1, msg + 1) == 0);
+	assert(bc_stat.bc_misses == r + 1);
+	blk[0] = msg[0];
+	file_flush(f);
+	cprintf("block cache eviction is good\n");
+
+	// the image's root directory has an index, and new files go in it
+	assert((super->s_features & FS_DIRHASH) && super->s_root.f_dirhash_nblocks > 0);
+	n = super->s_root.f_dirhash_count;
+	if ((r = file_create("/dirindex", &f)) < 0 && r != -E_FILE_EXISTS)
+		panic("file_create /dirindex: %e", r);
+	assert(r < 0 || super->s_root.f_dirhash_count == n + 1);
+	if ((r = file_open("/dirindex", &f)) < 0)
+		panic("file_open /dirindex: %e", r);
+	assert(strcmp(f->f_name, "dirindex") == 0);
+	if ((r = file_open("/newmotd", &f)) < 0)
+		panic("file_open /newmotd: %e", r);
+	cprintf("directory index is good\n");
+
+	// a cached miss doesn't hide a file created later, and a deep
+	// path resolves the same twice
+	if ((r = file_open("/dcache/f", &f)) == -E_NOT_FOUND) {
+		if ((r = dir_create("/dcache", &f)) < 0)
+			panic("dir_create /dcache: %e", r);
+		if ((r = file_create("/dcache/f", &f)) < 0)
+			panic("file_create /dcache/f: %e", r);
+	} else if (r < 0)
+		panic("file_open /dcache/f: %e", r);
+	if ((r = file_open("/dcache/f", &f)) < 0 || strcmp(f->f_name, "f") != 0)
+		panic("file_open /dcache/f: %e", r);
+	blk = (char *) f;
+	if ((r = file_open("/dcache/f", &f)) < 0 || (char *) f != blk)
+		panic("file_open /dcache/f again: %e", r);
+	if ((r = file_open("/dcache/g", &f)) != -E_NOT_FOUND)
+		panic("file_open /dcache/g: %e", r);
+	// bypassing the cache finds the same
+	dcache_bypass = 1;
+	if ((r = file_open("/dcache/f", &f)) < 0 || (char *) f != blk)
+		panic("file_open /dcache/f uncached: %e", r);
+	if ((r = file_open("/dcache/g", &f)) != -E_NOT_FOUND)
+		panic("file_open /dcache/g uncached: %e", r);
+	dcache_bypass = 0;
+	cprintf("path cache is good\n");
 }
@@ -29,6 +29,29 @@ typedef int32_t envid_t;
 #define NENV			(1 << LOG2NENV)
 #define ENVX(envid)		((envid) & (NENV - 1))
 
+// Number of extra words an IPC message carries in registers
+#define IPC_NWORDS		3
+// Number of runs of pages a scatter-gather IPC message can send
+#define IPC_MAXRANGES		8
+
+// A run of ir_npages pages at ir_va sent in one IPC message
+struct IpcRange {
+	uintptr_t ir_va;
+	size_t ir_npages;
+};
+
+// The pages of a sys_ipc_send_recv_sg: the pages of sg_nsend runs are
+// sent with permission sg_perm, and mapped one after the other at the
+// receiver's window.  The reply's pages are received in the window of
+// sg_dstnpages pages at sg_dstva.
+struct IpcSg {
+	struct IpcRange sg_send[IPC_MAXRANGES];
+	int sg_nsend;
+	int sg_perm;
+	uintptr_t sg_dstva;
+	size_t sg_dstnpages;
+};
+
 // Values of env_status in struct Env
 enum {
 	ENV_FREE = 0,
@@ -59,22 +82,54 @@ struct Env {
 	unsigned env_status;		// Status of the environment
 	uint32_t env_runs;		// Number of times environment has run
 	int env_cpunum;			// The CPU that the env is running on
+
+	// Scheduling (see kern/sched.c)
+	struct Env *env_sched_link;	// Next env on the same run queue
+	int env_sched_cpu;		// Run queue holding this env, or -1
+	int env_sched_level;		// Feedback queue level, 0 is highest
+	int env_sched_ticks;		// Timer ticks left at this level
 	
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
 
 	// Exception handling
 	void *env_pgfault_upcall;	// Page fault upcall entry point
+	bool env_kcow;			// Kernel resolves PTE_COW faults
 	
 	//Env priority(Lab 4 challenge)
 	enum EnvPriority env_prio;
 		
 	// Lab 4 IPC
 	bool env_ipc_recving;		// Env is blocked receiving
-	void *env_ipc_dstva;		// VA at which to map received page
+	void *env_ipc_dstva;		// VA at which to map received pages
+	size_t env_ipc_dstnpages;	// Pages of room at env_ipc_dstva
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+	size_t env_ipc_npages;		// Number of pages received
+	uint32_t env_ipc_words[IPC_NWORDS];	// Extra words sent to us
+
+	// Blocking send (see env_ipc_waitq_push)
+	struct Env *env_ipc_waitq;	// First env blocked sending to us
+	struct Env *env_ipc_waitq_tail;	// Last env blocked sending to us
+	struct Env *env_ipc_wait_link;	// Next env blocked on the same queue
+	struct Env *env_ipc_sendto;	// Env we are blocked sending to
+	uint32_t env_ipc_send_value;	// Value we are sending
+	struct IpcRange env_ipc_send_ranges[IPC_MAXRANGES];	// Pages we are sending
+	int env_ipc_send_nranges;	// Runs in env_ipc_send_ranges
+	int env_ipc_send_perm;		// Perm of the pages we are sending
+	uint32_t env_ipc_send_words[IPC_NWORDS];	// Extra words we are sending
+	bool env_ipc_send_recv;		// Receive at env_ipc_dstva once sent
+
+	// Futex (see kern/futex.c)
+	physaddr_t env_futex_key;	// Word we sleep on, or 0
+	struct Env *env_futex_link;	// Next env on the same hash chain
+	unsigned env_futex_deadline;	// Tick to wake up at, or 0
+
+	// Doorbell (see sys_doorbell_wait)
+	bool env_doorbell_waiting;	// Env is blocked on its doorbell
+	bool env_doorbell_pending;	// Doorbell rang while not waiting
+	envid_t env_doorbell_peer;	// Env we take rings from, or 0
 };
 
 #endif // !JOS_INC_ENV_H
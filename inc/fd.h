@@ -21,6 +21,13 @@ struct Dev {
 	int (*dev_close)(struct Fd *fd);
 	int (*dev_stat)(struct Fd *fd, struct Stat *stat);
 	int (*dev_trunc)(struct Fd *fd, off_t length);
+	// Map up to a page of data at the page-aligned seek position
+	// at va without copying it (see read_page).  Optional.
+	ssize_t (*dev_read_page)(struct Fd *fd, void *va, size_t len);
+	// Map the pages holding up to len bytes from the page-aligned
+	// offset at va without copying them (see read_map).  Optional.
+	ssize_t (*dev_read_map)(struct Fd *fd, off_t offset, void *va,
+				size_t len, int perm);
 };
 
 struct FdFile {
@@ -26,6 +26,18 @@
 
 #define MAXFILESIZE	((NDIRECT + NINDIRECT) * BLKSIZE)
 
+// On file systems with FS_DIRHASH set in s_features, a directory may
+// have a hashed index of its entries: an open-addressed table of
+// DIRHASH_SLOTS slots per block, in a power of two number of blocks,
+// at most DIRHASH_NBLOCKS.  A slot is empty if 0, otherwise it holds
+// DIRHASH_SLOT of the entry's name hash and its number in the
+// directory.  Lookups probe linearly from dirhash(name) modulo the
+// number of slots, and the table is kept at most 3/4 full.
+#define DIRHASH_NBLOCKS	16
+#define DIRHASH_SLOTS	(BLKSIZE / 4)
+#define DIRHASH_SLOT(hash, entry)	(((hash) & 0xFFFF0000) | ((entry) + 1))
+#define DIRHASH_ENTRY(slot)		(((slot) & 0xFFFF) - 1)
+
 struct File {
 	char f_name[MAXNAMELEN];	// filename
 	off_t f_size;			// file size in bytes
@@ -36,9 +48,14 @@ struct File {
 	uint32_t f_direct[NDIRECT];	// direct blocks
 	uint32_t f_indirect;		// indirect block
 
+	// Directory index; see DIRHASH_SLOTS.
+	uint32_t f_dirhash_nblocks;	// index blocks, 0 if none
+	uint32_t f_dirhash_count;	// entries in the index
+	uint32_t f_dirhash[DIRHASH_NBLOCKS];	// index blocks
+
 	// Pad out to 256 bytes; must do arithmetic in case we're compiling
 	// fsformat on a 64-bit machine.
-	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 4];
+	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 4 - 8 - 4*DIRHASH_NBLOCKS];
 } __attribute__((packed));	// required only on some 64-bit machines
 
 // An inode block contains exactly BLKFILES 'struct File's
@@ -57,20 +74,71 @@ struct Super {
 	uint32_t s_magic;		// Magic number: FS_MAGIC
 	uint32_t s_nblocks;		// Total number of blocks on disk
 	struct File s_root;		// Root directory node
+	uint32_t s_features;		// FS_DIRHASH or 0
 };
 
+// Directories' f_dirhash fields are valid
+#define FS_DIRHASH	0x1
+
+// Hash of a file name for the directory index (32-bit FNV-1a)
+static inline uint32_t
+dirhash(const char *name)
+{
+	uint32_t h = 2166136261U;
+
+	while (*name) {
+		h ^= (uint8_t) *name++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+// Most pages a read reply or a write request carries besides the
+// request page (see sys_ipc_send_recv_sg)
+#define FSMAXPAGES	256
+
+// Reads of at most this many bytes are copied into the reply page,
+// which is cheaper than mapping the blocks (see FSREQ_READ)
+#define FSREADINLINE	PGSIZE
+
 // Definitions for requests from clients to file system
 enum {
 	FSREQ_OPEN = 1,
 	FSREQ_SET_SIZE,
-	// Read returns a Fsret_read on the request page
+	// Read returns up to FSREADINLINE bytes in a Fsret_read on the
+	// request page; a larger read maps the cached blocks holding the
+	// data copy-on-write as the reply pages instead, and the data
+	// starts at the seek position's offset in the first page
 	FSREQ_READ,
+	// Write takes its data from req_buf, or, if pages follow the
+	// request page, from req_pgoff in those pages
 	FSREQ_WRITE,
 	// Stat returns a Fsret_stat on the request page
 	FSREQ_STAT,
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
-	FSREQ_SYNC
+	FSREQ_SYNC,
+	// Read_page takes a Fsreq_read and maps the block at the
+	// (block-aligned) seek position copy-on-write as the reply page
+	FSREQ_READ_PAGE,
+	// Map takes a Fsreq_map and maps the cached blocks holding the
+	// file range read-only, or copy-on-write, as the reply pages;
+	// the seek position is not used
+	FSREQ_MAP,
+	// Bcstat returns the server's block cache counters, a BcStat,
+	// on the request page
+	FSREQ_BCSTAT
+};
+
+// Block cache counters (see FSREQ_BCSTAT)
+struct BcStat {
+	uint32_t bc_hits;	// block lookups that found the block cached
+	uint32_t bc_misses;	// blocks read in from disk
+	uint32_t bc_evictions;	// blocks dropped to make room
+	uint32_t bc_writebacks;	// dirty blocks written to disk
+	uint32_t bc_ndirty;	// blocks dirtied since the last write-back
+	uint32_t bc_nblocks;	// blocks cached, not counting pinned ones
+	uint32_t bc_size;	// bc_nblocks is brought down to this
 };
 
 union Fsipc {
@@ -89,10 +157,17 @@ union Fsipc {
 	struct Fsret_read {
 		char ret_buf[PGSIZE];
 	} readRet;
+	struct Fsreq_map {
+		int req_fileid;
+		off_t req_offset;
+		size_t req_n;
+		int req_perm;
+	} map;
 	struct Fsreq_write {
 		int req_fileid;
 		size_t req_n;
-		char req_buf[PGSIZE - (sizeof(int) + sizeof(size_t))];
+		size_t req_pgoff;
+		char req_buf[PGSIZE - (sizeof(int) + 2 * sizeof(size_t))];
 	} write;
 	struct Fsreq_stat {
 		int req_fileid;
@@ -108,6 +183,7 @@ union Fsipc {
 	struct Fsreq_remove {
 		char req_path[MAXPATHLEN];
 	} remove;
+	struct BcStat bcstatRet;
 
 	// Ensure Fsipc is one page
 	char _pad[PGSIZE];
@@ -23,6 +23,9 @@
 
 #define USED(x)		(void)(x)
 
+// Each env has its own copy of a PRIVATE variable, even after sfork.
+#define PRIVATE		__attribute__((section(".data.private")))
+
 // main user program
 void	umain(int argc, char **argv);
 
@@ -52,11 +55,28 @@ int	sys_env_set_status(envid_t env, int status);
 int	sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
 int	sys_env_set_pgfault_upcall(envid_t env, void *upcall);
 int	sys_page_alloc(envid_t env, void *pg, int perm);
+int	sys_page_alloc_large(envid_t env, void *va, int perm);
 int	sys_page_map(envid_t src_env, void *src_pg,
 		     envid_t dst_env, void *dst_pg, int perm);
 int	sys_page_unmap(envid_t env, void *pg);
+envid_t	sys_env_fork_cow(void);
+int	sys_page_map_batch(envid_t src_env, envid_t dst_env,
+			   const struct PageMapRange *ranges, int n);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
+int	sys_ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
+int	sys_ipc_call_words(envid_t to_env, uint32_t value, const uint32_t *words);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_recv_pages(void *rcv_pg, size_t npages);
+int	sys_futex_wait(volatile uint32_t *addr, uint32_t expected, unsigned timeout);
+int	sys_futex_wake(volatile uint32_t *addr, int n);
+int	sys_cons_wait(void);
+int	sys_doorbell_ring(envid_t envid);
+int	sys_doorbell_wait(void);
+int	sys_doorbell_peer(envid_t envid);
+int	sys_ipc_send_recv(envid_t to_env, uint32_t value, void *pg, int perm,
+			  void *rcv_pg);
+int	sys_ipc_send_recv_sg(envid_t to_env, uint32_t value,
+			     const struct IpcSg *sg);
 
 //lab 4 challenge
 int sys_set_prio(envid_t envid, unsigned prio);
@@ -76,12 +96,50 @@ sys_exofork(void)
 
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
+int32_t	ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		 envid_t *from_env_store, void *rcv_pg, int *perm_store);
+int32_t	ipc_call_words(envid_t to_env, uint32_t value, uint32_t *words,
+		       envid_t *from_env_store);
+int32_t	ipc_call_sg(envid_t to_env, uint32_t value, const struct IpcSg *sg,
+		    envid_t *from_env_store, size_t *npages_store);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
 envid_t	ipc_find_env(enum EnvType type);
 
+// futex.c
+void	futex_wait(volatile uint32_t *addr, uint32_t val,
+		   volatile uint32_t *flag, unsigned timeout);
+void	futex_wake(volatile uint32_t *addr, volatile uint32_t *flag);
+
+// ring.c
+struct Ring;
+int	ring_create(struct Ring *ring, envid_t peer);
+int	ring_accept(struct Ring *ring);
+void	ring_send(struct Ring *ring, uint32_t value);
+uint32_t ring_recv(struct Ring *ring);
+
+// thread.c
+typedef int thread_t;
+struct mutex {
+	volatile uint32_t m_locked;
+};
+struct cond {
+	volatile uint32_t c_seq;
+	uint32_t c_nwaiters;
+};
+int	thread_create(thread_t *tid, void *(*fn)(void *), void *arg);
+void	thread_exit(void *ret) __attribute__((noreturn));
+int	thread_join(thread_t tid, void **ret_store);
+void	mutex_init(struct mutex *m);
+void	mutex_lock(struct mutex *m);
+void	mutex_unlock(struct mutex *m);
+void	cond_init(struct cond *c);
+void	cond_wait(struct cond *c, struct mutex *m);
+void	cond_signal(struct cond *c);
+void	cond_broadcast(struct cond *c);
+
 // fork.c
-#define	PTE_SHARE	0x400
 envid_t	fork(void);
+envid_t	kfork(void);
 envid_t	sfork(void);	// Challenge!
 
 // fd.c
@@ -91,6 +149,9 @@ ssize_t	write(int fd, const void *buf, size_t nbytes);
 int	seek(int fd, off_t offset);
 void	close_all(void);
 ssize_t	readn(int fd, void *buf, size_t nbytes);
+ssize_t	read_page(int fd, void *va, size_t nbytes);
+ssize_t	read_map(int fd, off_t offset, void *va, size_t nbytes, int perm);
+ssize_t	splice(int fdin, int fdout, size_t nbytes);
 int	dup(int oldfd, int newfd);
 int	fstat(int fd, struct Stat *statbuf);
 int	stat(const char *path, struct Stat *statbuf);
@@ -100,6 +161,7 @@ int	open(const char *path, int mode);
 int	ftruncate(int fd, off_t size);
 int	remove(const char *path);
 int	sync(void);
+int	bcstat(struct BcStat *st);
 
 // pageref.c
 int	pageref(void *addr);
@@ -117,6 +179,7 @@ int	opencons(void);
 
 // pipe.c
 int	pipe(int pipefds[2]);
+int	pipe_sized(int pipefds[2], size_t bufsiz);
 int	pipeisclosed(int pipefd);
 
 // wait.c
@@ -132,5 +195,6 @@ void	wait(envid_t env);
 #define	O_TRUNC		0x0200		/* truncate to zero length */
 #define	O_EXCL		0x0400		/* error if already exists */
 #define O_MKDIR		0x0800		/* create directory, not regular file */
+#define O_NOCACHE	0x1000		/* bypass the file server's path cache */
 
 #endif	// !JOS_INC_LIB_H
@@ -178,6 +178,8 @@ extern volatile pde_t uvpd[];     // VA of current page directory
 struct PageInfo {
 	// Next page on the free list.
 	struct PageInfo *pp_link;
+	// Previous block on the buddy allocator's free list.
+	struct PageInfo *pp_prev;
 
 	// pp_ref is the count of pointers (usually in page table entries)
 	// to this page, for pages allocated using page_alloc.
@@ -185,6 +187,10 @@ struct PageInfo {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// Buddy allocator state, valid while this page heads a free block.
+	uint8_t pp_order;		// The block is 2^pp_order pages
+	uint8_t pp_free;		// Set while on a buddy free list
 };
 
 #endif /* !__ASSEMBLER__ */
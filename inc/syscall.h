@@ -1,6 +1,8 @@
 #ifndef JOS_INC_SYSCALL_H
 #define JOS_INC_SYSCALL_H
 
+#include <inc/types.h>
+
 /* system call numbers */
 enum {
 	SYS_cputs = 0,
@@ -18,7 +20,32 @@ enum {
 	SYS_ipc_try_send,
 	SYS_ipc_recv,
 	SYS_set_prio,
+	SYS_page_alloc_large,
+	SYS_page_map_batch,
+	SYS_env_fork_cow,
+	SYS_ipc_send_recv,
+	SYS_ipc_send,
+	SYS_ipc_call_words,
+	SYS_doorbell_ring,
+	SYS_doorbell_wait,
+	SYS_futex_wait,
+	SYS_futex_wake,
+	SYS_cons_wait,
+	SYS_ipc_send_recv_sg,
+	SYS_doorbell_peer,
 	NSYSCALLS
 };
 
+// One range for sys_page_map_batch: map pm_npages pages starting at
+// pm_srcva in the source env at pm_dstva in the destination env.
+struct PageMapRange {
+	uintptr_t pm_srcva;
+	uintptr_t pm_dstva;
+	size_t pm_npages;
+	int pm_perm;
+};
+
+// Most pages one sys_page_map_batch may map, over all its ranges
+#define PAGEMAP_MAXPAGES	(PTSIZE / PGSIZE)
+
 #endif /* !JOS_INC_SYSCALL_H */
@@ -8,10 +8,43 @@
 
 #include <kern/console.h>
 #include <kern/picirq.h>
+#include <kern/spinlock.h>
+#include <kern/cpu.h>
 
 static void cons_intr(int (*proc)(void));
 static void cons_putc(int c);
 
+// Serializes the console devices and the input buffer, and keeps a
+// cprintf from one CPU from being interleaved with another's.
+// The holding CPU may take it again, so that a panic in the middle of
+// printing still gets its message out.
+static struct spinlock console_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "console_lock"
+#endif
+};
+static struct CpuInfo *console_owner;
+static int console_depth;
+
+void
+lock_console(void)
+{
+	if (console_owner != thiscpu) {
+		spin_lock(&console_lock);
+		console_owner = thiscpu;
+	}
+	console_depth++;
+}
+
+void
+unlock_console(void)
+{
+	if (--console_depth == 0) {
+		console_owner = NULL;
+		spin_unlock(&console_lock);
+	}
+}
+
 // Stupid I/O delay routine necessitated by historical PC design flaws
 static void
 delay(void)
@@ -406,6 +439,7 @@ cons_intr(int (*proc)(void))
 {
 	int c;
 
+	lock_console();
 	while ((c = (*proc)()) != -1) {
 		if (c == 0)
 			continue;
@@ -413,14 +447,16 @@ cons_intr(int (*proc)(void))
 		if (cons.wpos == CONSBUFSIZE)
 			cons.wpos = 0;
 	}
+	unlock_console();
 }
 
 // return the next input character from the console, or 0 if none waiting
 int
 cons_getc(void)
 {
-	int c;
+	int c = 0;
 
+	lock_console();
 	// poll for any pending input characters,
 	// so that this function works even when interrupts are disabled
 	// (e.g., when called from the kernel monitor).
@@ -432,9 +468,23 @@ cons_getc(void)
 		c = cons.buf[cons.rpos++];
 		if (cons.rpos == CONSBUFSIZE)
 			cons.rpos = 0;
-		return c;
 	}
-	return 0;
+	unlock_console();
+	return c;
+}
+
+// return true if a character is waiting for cons_getc
+bool
+cons_ready(void)
+{
+	bool ready;
+
+	lock_console();
+	serial_intr();
+	kbd_intr();
+	ready = (cons.rpos != cons.wpos);
+	unlock_console();
+	return ready;
 }
 
 // output a character to the console
@@ -464,7 +514,9 @@ cons_init(void)
 void
 cputchar(int c)
 {
+	lock_console();
 	cons_putc(c);
+	unlock_console();
 }
 
 int
@@ -19,6 +19,9 @@
 
 void cons_init(void);
 int cons_getc(void);
+bool cons_ready(void);
+void lock_console(void);
+void unlock_console(void);
 void cset_color(int);
 
 void kbd_intr(void); // irq 1
@@ -14,11 +14,25 @@
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/futex.h>
 
 struct Env *envs = NULL;		// All environments
 static struct Env *env_free_list;	// Free environment list
 					// (linked by Env->env_link)
 
+// Protects env_free_list, env status transitions, the IPC fields and
+// each CPU's curenv.  Lock order: env_lock, then address space locks,
+// then the page allocator and run queue locks.
+struct spinlock env_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "env_lock"
+#endif
+};
+
+// Per-env address space locks, indexed like envs[].  Kept out of
+// struct Env because that structure is mapped read-only into user space.
+static struct spinlock env_vm_locks[NENV];
+
 
 #define ENVGENSHIFT	12		// >= LOGNENV
 
@@ -127,8 +141,10 @@ env_init(void)
 	for (i = NENV - 1; i >= 0; i--) {
 		envs[i].env_status = ENV_FREE;
 		envs[i].env_id = 0;
+		envs[i].env_sched_cpu = -1;
 		envs[i].env_link = env_free_list;
 		env_free_list = &envs[i];
+		spin_initlock(&env_vm_locks[i]);
 	}
 	// Per-CPU part of the initialization
 	env_init_percpu();
@@ -155,6 +171,44 @@ env_init_percpu(void)
 	lldt(0);
 }
 
+// Lock e's address space.
+// Anything that changes the page tables of an env that might not be
+// curenv must hold this lock.
+void
+env_vm_lock(struct Env *e)
+{
+	spin_lock(&env_vm_locks[e - envs]);
+}
+
+void
+env_vm_unlock(struct Env *e)
+{
+	spin_unlock(&env_vm_locks[e - envs]);
+}
+
+// Lock the address spaces of a and b, which may be the same env,
+// in a fixed order so two CPUs cannot deadlock.
+void
+env_vm_lock2(struct Env *a, struct Env *b)
+{
+	if (a > b) {
+		struct Env *t = a;
+		a = b;
+		b = t;
+	}
+	env_vm_lock(a);
+	if (a != b)
+		env_vm_lock(b);
+}
+
+void
+env_vm_unlock2(struct Env *a, struct Env *b)
+{
+	env_vm_unlock(a);
+	if (a != b)
+		env_vm_unlock(b);
+}
+
 //
 // Initialize the kernel virtual memory layout for environment e.
 // Allocate a page directory, set e->env_pgdir accordingly,
@@ -221,12 +275,19 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	int r;
 	struct Env *e;
 
-	if (!(e = env_free_list))
+	spin_lock(&env_lock);
+	if (!(e = env_free_list)) {
+		spin_unlock(&env_lock);
 		return -E_NO_FREE_ENV;
+	}
 
 	// Allocate and set up the page directory for this environment.
-	if ((r = env_setup_vm(e)) < 0)
+	env_vm_lock(e);
+	if ((r = env_setup_vm(e)) < 0) {
+		env_vm_unlock(e);
+		spin_unlock(&env_lock);
 		return r;
+	}
 
 	// Generate an env_id for this environment.
 	generation = (e->env_id + (1 << ENVGENSHIFT)) & ~(NENV - 1);
@@ -237,8 +298,12 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
 	e->env_type = ENV_TYPE_USER;
-	e->env_status = ENV_RUNNABLE;
+	// Not runnable until the creator has set it up.  A stale run queue
+	// entry left by the slot's previous owner must not pick it up early.
+	e->env_status = ENV_NOT_RUNNABLE;
 	e->env_runs = 0;
+	e->env_cpunum = cpunum();
+	env_vm_unlock(e);
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -267,9 +332,15 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	
 	// Clear the page fault handler until user installs one.
 	e->env_pgfault_upcall = 0;
+	e->env_kcow = false;
 
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
+	e->env_ipc_waitq = e->env_ipc_waitq_tail = NULL;
+	e->env_ipc_sendto = NULL;
+	e->env_doorbell_waiting = e->env_doorbell_pending = false;
+	e->env_doorbell_peer = 0;
+	e->env_futex_key = 0;
 
 	// commit the allocation
 	env_free_list = e->env_link;
@@ -278,8 +349,10 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	//lab 4 challenge
 	//clear the prio(set to default high)
 	e->env_prio = ENV_PRIO_HIGH;
+	sched_boost(e);
 	
 	cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
+	spin_unlock(&env_lock);
 	return 0;
 }
 
@@ -435,10 +508,93 @@ env_create(uint8_t *binary, enum EnvType type)
 	
 	if (type == ENV_TYPE_FS)
 		e->env_tf.tf_eflags |= 	FL_IOPL_3; //max i/o privilege
+
+	spin_lock(&env_lock);
+	e->env_status = ENV_RUNNABLE;
+	sched_enqueue(e);
+	spin_unlock(&env_lock);
+}
+
+//
+// Block e sending to trgt: append it to trgt's queue of senders, which
+// trgt takes messages from in FIFO order when it next receives.  The
+// message itself must already be in e's env_ipc_send_* fields.
+// Must be called with env_lock held.
+//
+void
+env_ipc_waitq_push(struct Env *trgt, struct Env *e)
+{
+	e->env_ipc_sendto = trgt;
+	e->env_ipc_wait_link = NULL;
+	if (trgt->env_ipc_waitq_tail)
+		trgt->env_ipc_waitq_tail->env_ipc_wait_link = e;
+	else
+		trgt->env_ipc_waitq = e;
+	trgt->env_ipc_waitq_tail = e;
+}
+
+//
+// Remove and return the first env blocked sending to trgt, or NULL.
+// Must be called with env_lock held.
+//
+struct Env *
+env_ipc_waitq_pop(struct Env *trgt)
+{
+	struct Env *e;
+
+	if ((e = trgt->env_ipc_waitq) == NULL)
+		return NULL;
+	trgt->env_ipc_waitq = e->env_ipc_wait_link;
+	if (!trgt->env_ipc_waitq)
+		trgt->env_ipc_waitq_tail = NULL;
+	e->env_ipc_sendto = NULL;
+	return e;
+}
+
+//
+// Take e off the queue it is blocked sending on, if any.
+// Must be called with env_lock held.
+//
+void
+env_ipc_waitq_remove(struct Env *e)
+{
+	struct Env *trgt = e->env_ipc_sendto;
+	struct Env **pp, *prev = NULL;
+
+	if (!trgt)
+		return;
+	for (pp = &trgt->env_ipc_waitq; *pp; prev = *pp, pp = &(*pp)->env_ipc_wait_link)
+		if (*pp == e) {
+			*pp = e->env_ipc_wait_link;
+			if (trgt->env_ipc_waitq_tail == e)
+				trgt->env_ipc_waitq_tail = prev;
+			break;
+		}
+	e->env_ipc_sendto = NULL;
+}
+
+//
+// Fail the sends of every env blocked sending to e, which is going
+// away, and wake them up.  Must be called with env_lock held.
+//
+static void
+env_ipc_waitq_flush(struct Env *e)
+{
+	struct Env *s;
+
+	while ((s = env_ipc_waitq_pop(e)) != NULL) {
+		s->env_tf.tf_regs.reg_eax = -E_BAD_ENV;
+		if (s->env_status == ENV_NOT_RUNNABLE) {
+			s->env_status = ENV_RUNNABLE;
+			sched_enqueue(s);
+		}
+	}
 }
 
 //
 // Frees env e and all memory it uses.
+// Must be called with env_lock held, and e must not be loaded on any
+// CPU other than this one.
 //
 void
 env_free(struct Env *e)
@@ -456,6 +612,8 @@ env_free(struct Env *e)
 	// Note the environment's demise.
 	cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
+	env_vm_lock(e);
+
 	// Flush all mapped pages in the user portion of the address space
 	static_assert(UTOP % PTSIZE == 0);
 	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
@@ -464,14 +622,23 @@ env_free(struct Env *e)
 		if (!(e->env_pgdir[pdeno] & PTE_P))
 			continue;
 
+		// a 4MB page has no page table to walk
+		if (e->env_pgdir[pdeno] & PTE_PS) {
+			page_remove(e->env_pgdir, PGADDR(pdeno, 0, 0));
+			continue;
+		}
+
 		// find the pa and va of the page table
 		pa = PTE_ADDR(e->env_pgdir[pdeno]);
 		pt = (pte_t*) KADDR(pa);
 
-		// unmap all PTEs in this page table
+		// unmap all PTEs in this page table, waking the envs that
+		// sleep on a page we share with them
 		for (pteno = 0; pteno <= PTX(~0); pteno++) {
-			if (pt[pteno] & PTE_P)
+			if (pt[pteno] & PTE_P) {
+				futex_wake_page(PTE_ADDR(pt[pteno]));
 				page_remove(e->env_pgdir, PGADDR(pdeno, pteno, 0));
+			}
 		}
 
 		// free the page table itself
@@ -484,12 +651,50 @@ env_free(struct Env *e)
 	e->env_pgdir = 0;
 	page_decref(pa2page(pa));
 
-	// return the environment to the free list
+	// return the environment to the free list, and wake the envs
+	// in wait() for it
 	e->env_status = ENV_FREE;
+	futex_wake(PADDR(&e->env_status), NENV);
+	env_vm_unlock(e);
 	e->env_link = env_free_list;
 	env_free_list = e;
 }
 
+// Return true if e is loaded on some CPU, i.e. is that CPU's curenv.
+// A CPU keeps its curenv loaded for a while after the env blocks, and
+// the env must not be freed until every CPU has switched away from it.
+static bool
+env_loaded(struct Env *e)
+{
+	int i;
+
+	for (i = 0; i < ncpu; i++)
+		if (cpus[i].cpu_env == e)
+			return true;
+	return false;
+}
+
+//
+// Make e this CPU's current env (e may be NULL) and load its address
+// space.  If the previous env is dying and no other CPU has it loaded,
+// free it now.  Must be called with env_lock held.
+//
+void
+env_switch(struct Env *e)
+{
+	struct Env *prev = curenv;
+
+	physaddr_t cr3 = PADDR(e ? e->env_pgdir : kern_pgdir);
+
+	// curenv must be set before cr3 is loaded (see tlb_shootdown).
+	curenv = e;
+	if (rcr3() != cr3)
+		lcr3(cr3);
+	if (prev && prev != e && prev->env_status == ENV_DYING &&
+	    !env_loaded(prev))
+		env_free(prev);
+}
+
 //
 // Frees environment e.
 // If e was the current env, then runs a new environment (and does not return
@@ -498,20 +703,43 @@ env_free(struct Env *e)
 void
 env_destroy(struct Env *e)
 {
-	// If e is currently running on other CPUs, we change its state to
-	// ENV_DYING. A zombie environment will be freed the next time
-	// it traps to the kernel.
-	if (e->env_status == ENV_RUNNING && curenv != e) {
-		e->env_status = ENV_DYING;
+	spin_lock(&env_lock);
+	env_destroy_locked(e);
+}
+
+//
+// Like env_destroy, but the caller already holds env_lock.
+// Releases env_lock.
+//
+void
+env_destroy_locked(struct Env *e)
+{
+	if (e->env_status == ENV_FREE) {
+		spin_unlock(&env_lock);
 		return;
 	}
 
-	env_free(e);
+	env_ipc_waitq_remove(e);
+	env_ipc_waitq_flush(e);
+	futex_unpark(e);
 
-	if (curenv == e) {
-		curenv = NULL;
-		sched_yield();
+	// If e is running or loaded on a CPU, we change its state to
+	// ENV_DYING.  A zombie environment will be freed the next time
+	// it traps to the kernel or, if it is blocked, once the last CPU
+	// that has it loaded switches away.
+	if (e == curenv || e->env_status == ENV_RUNNING || env_loaded(e)) {
+		e->env_status = ENV_DYING;
+		if (e == curenv) {
+			env_switch(NULL);
+			spin_unlock(&env_lock);
+			sched_yield();
+		}
+		spin_unlock(&env_lock);
+		return;
 	}
+
+	env_free(e);
+	spin_unlock(&env_lock);
 }
 
 
@@ -565,17 +793,20 @@ env_run(struct Env *e)
 
 	// LAB 3: Your code here.
 	
-	if ((curenv) && curenv->env_status == ENV_RUNNING) {
+	// The scheduler has already marked e ENV_RUNNING for this CPU.
+	// Requeue the previous env unless it blocked or got picked up
+	// by another CPU in the meantime.
+	spin_lock(&env_lock);
+	if ((curenv) && curenv != e && curenv->env_status == ENV_RUNNING &&
+	    curenv->env_cpunum == cpunum()) {
 		curenv->env_status = ENV_RUNNABLE;
+		sched_enqueue(curenv);
 	}
 	
-	curenv = e;
-	curenv->env_status = ENV_RUNNING;
-	curenv->env_runs++;
-	
+	e->env_runs++;
+	env_switch(e);
+	spin_unlock(&env_lock);
 	
-	unlock_kernel();
-	lcr3(PADDR(curenv->env_pgdir));
 	//after this line we enter user space and start execute the curenv's code
 	env_pop_tf(&curenv->env_tf);
 	
@@ -5,8 +5,10 @@
 
 #include <inc/env.h>
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
 
 extern struct Env *envs;		// All environments
+extern struct spinlock env_lock;
 #define curenv (thiscpu->cpu_env)		// Current environment
 extern struct Segdesc gdt[];
 
@@ -16,6 +18,17 @@ int	env_alloc(struct Env **e, envid_t parent_id);
 void	env_free(struct Env *e);
 void	env_create(uint8_t *binary, enum EnvType type);
 void	env_destroy(struct Env *e);	// Does not return if e == curenv
+void	env_destroy_locked(struct Env *e);
+void	env_switch(struct Env *e);
+
+void	env_ipc_waitq_push(struct Env *trgt, struct Env *e);
+struct Env *env_ipc_waitq_pop(struct Env *trgt);
+void	env_ipc_waitq_remove(struct Env *e);
+
+void	env_vm_lock(struct Env *e);
+void	env_vm_unlock(struct Env *e);
+void	env_vm_lock2(struct Env *a, struct Env *b);
+void	env_vm_unlock2(struct Env *a, struct Env *b);
 
 int	envid2env(envid_t envid, struct Env **env_store, bool checkperm);
 // The following two functions do not return
@@ -0,0 +1,189 @@
+// Futexes: envs sleeping until another env changes a word of memory.
+//
+// A waiter is keyed by the physical address of the word, so envs that
+// map the same page at different addresses (PTE_SHARE pages, envs[])
+// find each other.  Waiters hang off a hash table indexed by physical
+// page number, linked through env_futex_link, in the order they went to
+// sleep.  Everything here is protected by env_lock.
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/mmu.h>
+#include <inc/memlayout.h>
+
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/sched.h>
+#include <kern/futex.h>
+
+#define NFUTEXHASH	64
+#define FUTEX_HASH(key)	(((key) >> PGSHIFT) % NFUTEXHASH)
+
+static struct Env *futex_hash[NFUTEXHASH];
+
+// Timer ticks seen by CPU 0, and the number of waiters with a timeout.
+static unsigned futex_ticks;
+static unsigned futex_ntimed;
+
+// Number of waiters, read without env_lock as a hint by futex_wake_page.
+static volatile unsigned futex_nwaiters;
+
+//
+// Translate the user address va in e's address space to a futex key.
+// va must be word-aligned and mapped user-readable; it may lie above
+// UTOP, e.g. in envs[].
+// Returns 0 on success, -E_INVAL if va is not a valid futex address.
+//
+int
+futex_key(struct Env *e, const void *va, physaddr_t *key_store)
+{
+	pte_t *pte;
+	int r = -E_INVAL;
+
+	if ((uintptr_t) va % 4 != 0 || (uintptr_t) va >= ULIM)
+		return -E_INVAL;
+
+	env_vm_lock(e);
+	pte = pgdir_walk(e->env_pgdir, va, 0);
+	if (pte && (*pte & (PTE_P | PTE_U)) == (PTE_P | PTE_U)) {
+		if (*pte & PTE_PS)
+			*key_store = PTE_ADDR(*pte) + ((uintptr_t) va & (PTSIZE - 1));
+		else
+			*key_store = PTE_ADDR(*pte) + PGOFF(va);
+		r = 0;
+	}
+	env_vm_unlock(e);
+	return r;
+}
+
+//
+// Put e, which the caller then marks ENV_NOT_RUNNABLE, to sleep on key.
+// If timeout is nonzero, e is woken after that many timer ticks at most.
+//
+void
+futex_park(struct Env *e, physaddr_t key, unsigned timeout)
+{
+	struct Env **pp;
+
+	e->env_futex_key = key;
+	e->env_futex_link = NULL;
+	e->env_futex_deadline = 0;
+	if (timeout) {
+		// 0 means no deadline, so skip it if the clock wraps there.
+		if ((e->env_futex_deadline = futex_ticks + timeout) == 0)
+			e->env_futex_deadline = 1;
+		futex_ntimed++;
+	}
+	for (pp = &futex_hash[FUTEX_HASH(key)]; *pp; pp = &(*pp)->env_futex_link)
+		;
+	*pp = e;
+	futex_nwaiters++;
+}
+
+//
+// Take e off its futex wait queue, if it is on one.
+//
+void
+futex_unpark(struct Env *e)
+{
+	struct Env **pp;
+
+	if (!e->env_futex_key)
+		return;
+	for (pp = &futex_hash[FUTEX_HASH(e->env_futex_key)]; *pp;
+	     pp = &(*pp)->env_futex_link)
+		if (*pp == e) {
+			*pp = e->env_futex_link;
+			break;
+		}
+	if (e->env_futex_deadline)
+		futex_ntimed--;
+	e->env_futex_key = 0;
+	futex_nwaiters--;
+}
+
+// Take the waiter *pp off its queue and make it runnable.
+static void
+futex_wake_one(struct Env **pp)
+{
+	struct Env *e = *pp;
+
+	*pp = e->env_futex_link;
+	if (e->env_futex_deadline)
+		futex_ntimed--;
+	e->env_futex_key = 0;
+	futex_nwaiters--;
+	if (e->env_status == ENV_NOT_RUNNABLE) {
+		e->env_status = ENV_RUNNABLE;
+		sched_enqueue(e);
+	}
+}
+
+//
+// Wake up to n envs sleeping on key, oldest first.
+// Returns the number woken.
+//
+int
+futex_wake(physaddr_t key, int n)
+{
+	struct Env **pp;
+	int woken = 0;
+
+	pp = &futex_hash[FUTEX_HASH(key)];
+	while (*pp && woken < n) {
+		if ((*pp)->env_futex_key == key) {
+			futex_wake_one(pp);
+			woken++;
+		} else
+			pp = &(*pp)->env_futex_link;
+	}
+	return woken;
+}
+
+//
+// Wake every env sleeping on a word in the page at pa, which is being
+// unmapped somewhere.  Waiters that watch a page's reference count
+// through pageref(), like pipe readers, need this to see their peer go.
+//
+void
+futex_wake_page(physaddr_t pa)
+{
+	struct Env **pp;
+
+	if (!futex_nwaiters)
+		return;
+	pp = &futex_hash[FUTEX_HASH(pa)];
+	while (*pp) {
+		if (PTE_ADDR((*pp)->env_futex_key) == PTE_ADDR(pa))
+			futex_wake_one(pp);
+		else
+			pp = &(*pp)->env_futex_link;
+	}
+}
+
+//
+// Called on every timer tick of CPU 0: wake waiters whose timeout
+// has run out.
+//
+void
+futex_tick(void)
+{
+	struct Env **pp;
+	int i;
+
+	// futex_park reads futex_ticks under env_lock too.  Deadlines are
+	// compared modulo 2^32, so one already past still wakes its waiter.
+	spin_lock(&env_lock);
+	futex_ticks++;
+	for (i = 0; i < NFUTEXHASH && futex_ntimed; i++) {
+		pp = &futex_hash[i];
+		while (*pp) {
+			if ((*pp)->env_futex_deadline &&
+			    (int) (futex_ticks - (*pp)->env_futex_deadline) >= 0)
+				futex_wake_one(pp);
+			else
+				pp = &(*pp)->env_futex_link;
+		}
+	}
+	spin_unlock(&env_lock);
+}
@@ -0,0 +1,24 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_FUTEX_H
+#define JOS_KERN_FUTEX_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Env;
+
+// Key of the console input wait queue (see sys_cons_wait).  No user
+// address translates to physical page 0.
+#define FUTEX_KEY_CONS	((physaddr_t) 4)
+
+int	futex_key(struct Env *e, const void *va, physaddr_t *key_store);
+void	futex_park(struct Env *e, physaddr_t key, unsigned timeout);
+void	futex_unpark(struct Env *e);
+int	futex_wake(physaddr_t key, int n);
+void	futex_wake_page(physaddr_t pa);
+void	futex_tick(void);
+
+#endif	// !JOS_KERN_FUTEX_H
@@ -17,6 +17,13 @@
 
 static void boot_aps(void);
 
+// Keeps the APs out of the scheduler until i386_init is done.
+static struct spinlock boot_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "boot_lock"
+#endif
+};
+
 
 void
 i386_init(void)
@@ -48,10 +55,12 @@ i386_init(void)
 	// Lab 4 multitasking initialization functions
 	pic_init();
 
-	// Acquire the big kernel lock before waking up APs
-	// Your code here:
-	
-	lock_kernel();
+	sched_init();
+
+	// Hold the APs back until the first environments exist;
+	// otherwise they would find nothing to run and drop into
+	// the monitor.
+	spin_lock(&boot_lock);
 	
 	// Starting non-boot CPUs
 	boot_aps();
@@ -73,6 +82,7 @@ i386_init(void)
 	kbd_intr();
 
 	// Schedule and run the first user environment!
+	spin_unlock(&boot_lock);
 	sched_yield();
 }
 
@@ -113,6 +123,8 @@ void
 mp_main(void)
 {
 	// We are in high EIP now, safe to switch to kern_pgdir 
+	// (which maps KERNBASE with 4MB pages)
+	lcr4(rcr4() | CR4_PSE | CR4_PGE);
 	lcr3(PADDR(kern_pgdir));
 	cprintf("SMP: CPU %d starting\n", cpunum());
 
@@ -122,12 +134,10 @@ mp_main(void)
 	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
 
 	// Now that we have finished some basic setup, call sched_yield()
-	// to start running processes on this CPU.  But make sure that
-	// only one CPU can enter the scheduler at a time!
-	//
-	// Your code here:
-	
-	lock_kernel();
+	// to start running processes on this CPU, once the boot CPU has
+	// created the first environments.
+	spin_lock(&boot_lock);
+	spin_unlock(&boot_lock);
 	sched_yield();
 	
 	// Remove this after you finish Exercise 4
@@ -173,6 +173,16 @@ lapic_startap(uint8_t apicid, uint32_t addr)
 	}
 }
 
+// Send an IPI to the CPU with local APIC ID apicid.
+void
+lapic_ipi_cpu(int apicid, int vector)
+{
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, FIXED | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
+
 void
 lapic_ipi(int vector)
 {
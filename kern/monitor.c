@@ -13,6 +13,7 @@
 #include <kern/trap.h>
 #include <kern/env.h>
 #include <kern/pmap.h>
+#include <kern/cpu.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -35,6 +36,7 @@ static struct Command commands[] = {
 	{ "c", "Continue execution", mon_continue },
 	{ "step", "Single step program", mon_step },
 	{ "s", "Single step program", mon_step },
+	{ "pgcache", "Show free page cache and zeroed pool statistics", mon_pgcache },
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
 
@@ -206,6 +208,13 @@ int mon_showmappings(int argc, char **argv, struct Trapframe *tf)
 		int perms = PGOFF(*pte);
 		char str_perms[] = "----------";
 		int2str_perms(str_perms, perms);
+		//pte is the PDE of a 4MB page
+		if (perms & PTE_PS) {
+			pa += PTX(va) * PGSIZE;
+			cprintf("VA 0x%x PA 0x%x perms %s (4MB page at PA 0x%x)\n",
+				va, pa, str_perms, PTE_ADDR(*pte));
+			continue;
+		}
 		cprintf("VA 0x%x PA 0x%x perms %s\n", va, pa, str_perms);
 	}
 	return 0;
@@ -361,3 +370,28 @@ monitor(struct Trapframe *tf)
 				break;
 	}
 }
+
+int mon_pgcache(int argc, char **argv, struct Trapframe *tf)
+{
+	int i;
+	uint32_t allocs;
+
+	cprintf("CPU  cached      hits    misses   refills    drains  hit%%\n");
+	for (i = 0; i < ncpu; i++) {
+		struct PageCache *pc = &page_caches[i];
+		allocs = pc->pc_hits + pc->pc_misses;
+		cprintf("%3d %7d %9u %9u %9u %9u  %3u\n", i, pc->pc_count,
+			pc->pc_hits, pc->pc_misses, pc->pc_refills,
+			pc->pc_drains, allocs ? (uint32_t) ((uint64_t) pc->pc_hits * 100 / allocs) : 0);
+	}
+
+	cprintf("Zeroed pool: %d pages\n", page_zero_count);
+	cprintf("CPU zero-hits zero-misses  hit%%\n");
+	for (i = 0; i < ncpu; i++) {
+		struct PageCache *pc = &page_caches[i];
+		allocs = pc->pc_zero_hits + pc->pc_zero_misses;
+		cprintf("%3d %9u %11u  %3u\n", i, pc->pc_zero_hits,
+			pc->pc_zero_misses, allocs ? (uint32_t) ((uint64_t) pc->pc_zero_hits * 100 / allocs) : 0);
+	}
+	return 0;
+}
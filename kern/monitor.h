@@ -19,5 +19,6 @@ int mon_showmappings(int argc, char **argv, struct Trapframe *tf);
 int mon_modify_permissions(int argc, char **argv, struct Trapframe *tf);
 int mon_continue(int argc, char **argv, struct Trapframe *tf);
 int mon_step(int argc, char **argv, struct Trapframe *tf);
+int mon_pgcache(int argc, char **argv, struct Trapframe *tf);
 
 #endif	// !JOS_KERN_MONITOR_H
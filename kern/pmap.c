@@ -10,6 +10,7 @@
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;			// Amount of physical memory (in pages)
@@ -18,7 +19,45 @@ static size_t npages_basemem;	// Amount of base memory (in pages)
 // These variables are set in mem_init()
 pde_t *kern_pgdir;		// Kernel's initial page directory
 struct PageInfo *pages;		// Physical page state array
-static struct PageInfo *page_free_list;	// Free list of physical pages
+
+// Buddy allocator.  Free memory is kept as naturally aligned blocks of
+// 2^order pages, one doubly linked list per order (linked through
+// pp_link and pp_prev of the block's first page).  A freed block is
+// merged with its buddy whenever the buddy is free too.
+static struct PageInfo *buddy_free[PAGE_MAX_ORDER + 1];
+static size_t buddy_nfree[PAGE_MAX_ORDER + 1];
+
+// Protects the buddy free lists.
+static struct spinlock page_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "page_lock"
+#endif
+};
+
+// Per-CPU caches of free pages in front of the buddy allocator.
+// A CPU only touches its own cache, and the kernel runs with interrupts
+// disabled, so the caches need no lock.  They move pages to and from
+// the buddy lists PAGE_CACHE_BATCH at a time.  Caching starts once
+// mem_init's checks, which inspect the buddy lists directly, are done.
+#define PAGE_CACHE_BATCH	16
+#define PAGE_CACHE_HIGH		(4 * PAGE_CACHE_BATCH)
+
+struct PageCache page_caches[NCPU];
+static bool page_cache_on;
+
+// Pool of free pages that are known to be zero, so page_alloc(ALLOC_ZERO)
+// need not memset on the syscall or fault path.  Idle CPUs refill it
+// from the buddy lists in page_zero_idle.  Every other free page is dirty.
+#define PAGE_ZERO_TARGET	256	// Pool size idle CPUs aim for
+#define PAGE_ZERO_BATCH		8	// Pages zeroed per page_zero_idle call
+
+static struct spinlock page_zero_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "page_zero_lock"
+#endif
+};
+static struct PageInfo *page_zero_list;
+int page_zero_count;
 
 
 // --------------------------------------------------------------
@@ -63,10 +102,18 @@ static void mem_init_mp(void);
 static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
 static void check_page_free_list(bool only_low_memory);
 static void check_page_alloc(void);
+static void check_buddy_alloc(void);
 static void check_kern_pgdir(void);
 static physaddr_t check_va2pa(pde_t *pgdir, uintptr_t va);
 static void check_page(void);
 static void check_page_installed_pgdir(void);
+static void buddy_free_block(struct PageInfo *pp, int order);
+static void page_init_high(void);
+static void page_cache_refill(struct PageCache *pc);
+static struct PageInfo *page_zero_get(void);
+static void page_cache_drain(struct PageCache *pc);
+static void tlb_page_release(pde_t *pgdir, struct PageInfo *pp);
+static bool tlb_batch_join(pde_t *pgdir);
 
 // This simple physical memory allocator is used only while JOS is setting
 // up its virtual memory system.  page_alloc() is the real allocator.
@@ -79,7 +126,7 @@ static void check_page_installed_pgdir(void);
 //
 // If we're out of memory, boot_alloc should panic.
 // This function may ONLY be used during initialization,
-// before the page_free_list list has been set up.
+// before the page allocator has been set up.
 static void *
 boot_alloc(uint32_t n)
 {
@@ -177,6 +224,7 @@ mem_init(void)
 
 	check_page_free_list(1);
 	check_page_alloc();
+	check_buddy_alloc();
 	check_page();
 	
 	//////////////////////////////////////////////////////////////////////
@@ -190,7 +238,7 @@ mem_init(void)
 	//    - pages itself -- kernel RW, user NONE
 	// Your code goes here:
 	size_t pages_size = ROUNDUP(npages*sizeof(struct PageInfo), PGSIZE);
-	boot_map_region(kern_pgdir, UPAGES, pages_size, PADDR(pages), PTE_U | PTE_P);
+	boot_map_region(kern_pgdir, UPAGES, pages_size, PADDR(pages), PTE_U | PTE_P | PTE_G);
 	
 	//////////////////////////////////////////////////////////////////////
 	// Map the 'envs' array read-only by the user at linear address UENVS
@@ -200,7 +248,7 @@ mem_init(void)
 	//    - envs itself -- kernel RW, user NONE
 	// LAB 3: Your code here.
 	size_t env_size = ROUNDUP(NENV*sizeof(struct Env), PGSIZE);
-	boot_map_region(kern_pgdir, UENVS, env_size, PADDR(envs), PTE_U | PTE_P);
+	boot_map_region(kern_pgdir, UENVS, env_size, PADDR(envs), PTE_U | PTE_P | PTE_G);
 	
 	//////////////////////////////////////////////////////////////////////
 	// Use the physical memory that 'bootstack' refers to as the kernel
@@ -214,7 +262,7 @@ mem_init(void)
 	//     Permissions: kernel RW, user NONE
 	// Your code goes here:
 	boot_map_region(kern_pgdir, KSTACKTOP - KSTKSIZE, 
-						KSTKSIZE, PADDR(bootstack), PTE_W | PTE_P);
+						KSTKSIZE, PADDR(bootstack), PTE_W | PTE_P | PTE_G);
 	
 	//////////////////////////////////////////////////////////////////////
 	// Map all of physical memory at KERNBASE.
@@ -225,8 +273,9 @@ mem_init(void)
 	// Permissions: kernel RW, user NONE
 	// Your code goes here:
 	
-	uint32_t size = (~0) - KERNBASE; 
-	boot_map_region(kern_pgdir, KERNBASE, size, 0x0, PTE_W | PTE_P);
+	// boot_map_region uses 4MB pages here, so round up to whole ones.
+	uint32_t size = ROUNDUP((~0) - KERNBASE, PTSIZE);
+	boot_map_region(kern_pgdir, KERNBASE, size, 0x0, PTE_W | PTE_P | PTE_G);
 	
 	// Initialize the SMP-related parts of the memory map
 	mem_init_mp();
@@ -241,8 +290,16 @@ mem_init(void)
 	//
 	// If the machine reboots at this point, you've probably set up your
 	// kern_pgdir wrong.
+	//
+	// Everything above UTOP except UVPT is the same in every address
+	// space and marked PTE_G, so with CR4_PGE those TLB entries
+	// survive the lcr3 on every env switch.
+	lcr4(rcr4() | CR4_PSE | CR4_PGE);
 	lcr3(PADDR(kern_pgdir));
 
+	// All of physical memory is mapped now.
+	page_init_high();
+
 	check_page_free_list(0);
 
 	// entry.S set the really important flags in cr0 (including enabling
@@ -254,6 +311,8 @@ mem_init(void)
 
 	// Some more checks, only possible after kern_pgdir is installed.
 	check_page_installed_pgdir();
+
+	page_cache_on = true;
 }
 
 // Modify mappings in kern_pgdir to support SMP
@@ -286,21 +345,21 @@ mem_init_mp(void)
 						kstacktop_i - KSTKSIZE, 
 						KSTKSIZE, 
 						PADDR(percpu_kstacks[i]), 
-						PTE_W | PTE_P);
+						PTE_W | PTE_P | PTE_G);
 	}
 }
 
 // --------------------------------------------------------------
 // Tracking of physical pages.
 // The 'pages' array has one 'struct PageInfo' entry per physical page.
-// Pages are reference counted, and free pages are kept on a linked list.
+// Pages are reference counted, and free pages are kept by a buddy allocator.
 // --------------------------------------------------------------
 
 //
 // Initialize page structure and memory free list.
 // After this is done, NEVER use boot_alloc again.  ONLY use the page
 // allocator functions below to allocate and deallocate physical
-// memory via the page_free_list.
+// memory via the buddy free lists.
 //
 void
 page_init(void)
@@ -344,8 +403,7 @@ page_init(void)
 			continue;	
 		}
 		pages[i].pp_ref = 0;
-		pages[i].pp_link = page_free_list;
-		page_free_list = &pages[i];
+		pages[i].pp_link = NULL;
 	}
 
 	//io hole and data structures pages are in use
@@ -359,9 +417,149 @@ page_init(void)
 	//all the rest of the extended memory is free
 	for (i = free_pa_pg_idx; i < npages; i++) {
 		pages[i].pp_ref = 0;
-		pages[i].pp_link = page_free_list;
-		page_free_list = &pages[i];
+		pages[i].pp_link = NULL;
 	}
+
+	// Hand the free pages below 4MB to the buddy allocator, which
+	// merges them into blocks.  Only this memory is mapped by
+	// entry_pgdir; page_init_high adds the rest once kern_pgdir is
+	// loaded.  Going from the top down leaves the lowest block of each
+	// order at the head of its list.
+	for (i = MIN(npages, NPTENTRIES) - 1; i > 0; i--)
+		if (pages[i].pp_ref == 0)
+			buddy_free_block(&pages[i], 0);
+}
+
+//
+// Give the free pages above 4MB to the buddy allocator.
+//
+static void
+page_init_high(void)
+{
+	size_t i;
+
+	for (i = npages - 1; i >= NPTENTRIES; i--)
+		if (pages[i].pp_ref == 0)
+			buddy_free_block(&pages[i], 0);
+}
+
+//
+// Buddy free list helpers.  The caller holds page_lock.
+//
+static void
+buddy_push(struct PageInfo *pp, int order)
+{
+	pp->pp_order = order;
+	pp->pp_free = 1;
+	pp->pp_prev = NULL;
+	pp->pp_link = buddy_free[order];
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp;
+	buddy_free[order] = pp;
+	buddy_nfree[order]++;
+}
+
+static void
+buddy_remove(struct PageInfo *pp, int order)
+{
+	if (pp->pp_prev)
+		pp->pp_prev->pp_link = pp->pp_link;
+	else
+		buddy_free[order] = pp->pp_link;
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp->pp_prev;
+	pp->pp_link = pp->pp_prev = NULL;
+	pp->pp_free = 0;
+	buddy_nfree[order]--;
+}
+
+// Take a block of 2^order pages, splitting a larger block if needed.
+// Returns NULL if no block is large enough.
+static struct PageInfo *
+buddy_alloc_block(int order)
+{
+	struct PageInfo *pp;
+	int o;
+
+	for (o = order; o <= PAGE_MAX_ORDER; o++)
+		if (buddy_free[o])
+			break;
+	if (o > PAGE_MAX_ORDER)
+		return NULL;
+
+	pp = buddy_free[o];
+	buddy_remove(pp, o);
+	// Give back the upper halves we don't need.
+	while (o > order) {
+		o--;
+		buddy_push(pp + (1 << o), o);
+	}
+	// page_decref frees the block with its order.
+	pp->pp_order = order;
+	return pp;
+}
+
+// Return a block of 2^order pages, merging it with its buddy
+// for as long as the buddy is a free block of the same order.
+static void
+buddy_free_block(struct PageInfo *pp, int order)
+{
+	size_t idx = pp - pages, bidx;
+	struct PageInfo *buddy;
+
+	while (order < PAGE_MAX_ORDER) {
+		bidx = idx ^ (1 << order);
+		if (bidx >= npages)
+			break;
+		buddy = &pages[bidx];
+		if (!buddy->pp_free || buddy->pp_order != order)
+			break;
+		buddy_remove(buddy, order);
+		idx &= ~(1 << order);
+		order++;
+	}
+	buddy_push(&pages[idx], order);
+}
+
+//
+// Allocates 2^order physically contiguous pages, aligned to their size,
+// and returns the PageInfo of the first one.  If (alloc_flags &
+// ALLOC_ZERO), zeroes the whole block.  As with page_alloc, the caller
+// manages the reference count (of the first page).
+//
+// Returns NULL if there is no free block that large.
+//
+struct PageInfo *
+page_alloc_order(int order, int alloc_flags)
+{
+	struct PageInfo *pp;
+
+	if (order < 0 || order > PAGE_MAX_ORDER)
+		return NULL;
+
+	spin_lock(&page_lock);
+	pp = buddy_alloc_block(order);
+	spin_unlock(&page_lock);
+
+	if (pp && (alloc_flags & ALLOC_ZERO))
+		memset(page2kva(pp), 0, PGSIZE << order);
+	return pp;
+}
+
+//
+// Return a block allocated with page_alloc_order.
+//
+void
+page_free_order(struct PageInfo *pp, int order)
+{
+	if (pp->pp_ref)
+		panic("page_free_order: block is still in use\n");
+	if (pp->pp_link || pp->pp_free)
+		panic("page_free_order: block %p has already been freed\n", page2pa(pp));
+
+	spin_lock(&page_lock);
+	buddy_free_block(pp, order);
+	spin_unlock(&page_lock);
 }
 
 //
@@ -380,12 +578,37 @@ struct PageInfo *
 page_alloc(int alloc_flags)
 {
 	// Fill this function in
-	//Out of memory
-	if(!page_free_list)
-		return NULL;
-		
-	struct PageInfo * new_page = page_free_list;
-	page_free_list = new_page->pp_link;
+	struct PageInfo *new_page;
+
+	if (page_cache_on) {
+		struct PageCache *pc = &page_caches[cpunum()];
+		if (alloc_flags & ALLOC_ZERO) {
+			if ((new_page = page_zero_get()) != NULL) {
+				pc->pc_zero_hits++;
+				return new_page;
+			}
+			pc->pc_zero_misses++;
+		}
+		if (pc->pc_free)
+			pc->pc_hits++;
+		else {
+			pc->pc_misses++;
+			page_cache_refill(pc);
+		}
+		if (!(new_page = pc->pc_free)) {
+			// Out of dirty pages; the zeroed pool is all that's left.
+			return page_zero_get();
+		}
+		pc->pc_free = new_page->pp_link;
+		pc->pc_count--;
+	} else {
+		spin_lock(&page_lock);
+		new_page = buddy_alloc_block(0);
+		spin_unlock(&page_lock);
+		//Out of memory
+		if (!new_page)
+			return NULL;
+	}
 	new_page->pp_link = NULL;
 	
 	if (alloc_flags & ALLOC_ZERO) {
@@ -396,6 +619,96 @@ page_alloc(int alloc_flags)
 	return new_page;
 }
 
+//
+// Take a page from the zeroed pool, or return NULL if it is empty.
+//
+static struct PageInfo *
+page_zero_get(void)
+{
+	struct PageInfo *pp;
+
+	if (!page_zero_list)
+		return NULL;
+	spin_lock(&page_zero_lock);
+	if ((pp = page_zero_list) != NULL) {
+		page_zero_list = pp->pp_link;
+		page_zero_count--;
+		pp->pp_link = NULL;
+	}
+	spin_unlock(&page_zero_lock);
+	return pp;
+}
+
+//
+// Called by idle CPUs from sched_halt.  Takes a few dirty pages from
+// the buddy allocator, zeroes them and adds them to the zeroed pool,
+// until the pool holds PAGE_ZERO_TARGET pages.
+//
+void
+page_zero_idle(void)
+{
+	struct PageInfo *pp;
+	int n;
+
+	if (!page_cache_on)
+		return;
+	for (n = 0; n < PAGE_ZERO_BATCH && page_zero_count < PAGE_ZERO_TARGET; n++) {
+		spin_lock(&page_lock);
+		pp = buddy_alloc_block(0);
+		spin_unlock(&page_lock);
+		if (!pp)
+			break;
+
+		memset(page2kva(pp), 0, PGSIZE);
+
+		spin_lock(&page_zero_lock);
+		pp->pp_link = page_zero_list;
+		page_zero_list = pp;
+		page_zero_count++;
+		spin_unlock(&page_zero_lock);
+	}
+}
+
+//
+// Move up to PAGE_CACHE_BATCH pages from the buddy allocator into pc.
+//
+static void
+page_cache_refill(struct PageCache *pc)
+{
+	struct PageInfo *pp;
+	int n;
+
+	spin_lock(&page_lock);
+	for (n = 0; n < PAGE_CACHE_BATCH && (pp = buddy_alloc_block(0)); n++) {
+		pp->pp_link = pc->pc_free;
+		pc->pc_free = pp;
+	}
+	spin_unlock(&page_lock);
+	pc->pc_count += n;
+	pc->pc_refills++;
+}
+
+//
+// Move PAGE_CACHE_BATCH pages from pc back to the buddy allocator.
+//
+static void
+page_cache_drain(struct PageCache *pc)
+{
+	struct PageInfo *pp;
+	int n;
+
+	spin_lock(&page_lock);
+	for (n = 0; n < PAGE_CACHE_BATCH; n++) {
+		pp = pc->pc_free;
+		pc->pc_free = pp->pp_link;
+		pp->pp_link = NULL;
+		buddy_free_block(pp, 0);
+	}
+	spin_unlock(&page_lock);
+	pc->pc_count -= PAGE_CACHE_BATCH;
+	pc->pc_drains++;
+}
+
 //
 // Return a page to the free list.
 // (This function should only be called when pp->pp_ref reaches 0.)
@@ -410,12 +723,33 @@ page_free(struct PageInfo *pp)
 	if(pp->pp_ref)
 		panic("page_free: this page is still in use by some process\n");
 	
-	if(pp->pp_link) {
+	if(pp->pp_link || pp->pp_free) {
 		panic("page_free: page %p has already been freed\n", page2pa(pp));
 	}
+	
+	if (page_cache_on) {
+		struct PageCache *pc = &page_caches[cpunum()];
+		pp->pp_link = pc->pc_free;
+		pc->pc_free = pp;
+		if (++pc->pc_count > PAGE_CACHE_HIGH)
+			page_cache_drain(pc);
+		return;
+	}
 		
-	pp->pp_link = page_free_list;
-	page_free_list = pp;
+	spin_lock(&page_lock);
+	buddy_free_block(pp, 0);
+	spin_unlock(&page_lock);
+}
+
+//
+// Take another reference to a page.  Pages may be shared between
+// address spaces that are being changed on different CPUs, so
+// reference counts are updated atomically.
+//
+void
+page_incref(struct PageInfo* pp)
+{
+	__sync_add_and_fetch(&pp->pp_ref, 1);
 }
 
 //
@@ -425,8 +759,12 @@ page_free(struct PageInfo *pp)
 void
 page_decref(struct PageInfo* pp)
 {
-	if (--pp->pp_ref == 0)
-		page_free(pp);
+	if (__sync_sub_and_fetch(&pp->pp_ref, 1) == 0) {
+		if (pp->pp_order)
+			page_free_order(pp, pp->pp_order);
+		else
+			page_free(pp);
+	}
 }
 
 // Given 'pgdir', a pointer to a page directory, pgdir_walk returns
@@ -457,6 +795,10 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 	// Fill this function in
 	pde_t *pde = &pgdir[PDX(va)];
 	
+	//va is covered by a 4MB page: the PDE is its only entry
+	if (*pde & PTE_PS)
+		return pde;
+
 	//the relevant page table page doesn't exist yet
 	if (!(*pde & PTE_P)) {
 		if(!create)
@@ -492,24 +834,38 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 // above UTOP. As such, it should *not* change the pp_ref field on the
 // mapped pages.
 //
+// Wherever va and pa are both 4MB-aligned and at least 4MB is left,
+// a single 4MB (PTE_PS) PDE is used instead of a page table.
+//
 // Hint: the TA solution uses pgdir_walk
 static void
 boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm)
 {
 	// Fill this function in
-	//number of pages to map
-	int n = size / PGSIZE;
-	int i;
-	for(i = 0; i < n; i++) {
-		pte_t * pte_p = pgdir_walk(pgdir, (void*)(va + i * PGSIZE), true);
+	//to make sure perms take only 12 lower bits
+	int perms = (perm | PTE_P) & 0xFFF;
+
+	while (size > 0) {
+		if (va % PTSIZE == 0 && pa % PTSIZE == 0 && size >= PTSIZE &&
+		    !(pgdir[PDX(va)] & PTE_P)) {
+			pgdir[PDX(va)] = pa | perms | PTE_PS;
+			va += PTSIZE;
+			pa += PTSIZE;
+			size -= PTSIZE;
+			continue;
+		}
+
+		pte_t * pte_p = pgdir_walk(pgdir, (void*)va, true);
 		if (!pte_p)
 			panic("boot_map_region: allocation failed\n");
-			
-		//to make sure perms take only 12 lower bits
-		int perms = (perm | PTE_P) & 0xFFF;
-		*pte_p  = (pa + i * PGSIZE) | perms;
+		if (*pte_p & PTE_PS)
+			panic("boot_map_region: va %08x is inside a 4MB page\n", va);
+
+		*pte_p  = pa | perms;
+		va += PGSIZE;
+		pa += PGSIZE;
+		size -= PGSIZE;
 	}
-	
 }
 
 //
@@ -542,6 +898,11 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 {
 	// Fill this function in
 	pte_t * pte_p = pgdir_walk(pgdir, va, true);
+	if (pte_p && (*pte_p & PTE_PS)) {
+		//a 4MB page can't be split: drop all of it first
+		page_remove(pgdir, va);
+		pte_p = pgdir_walk(pgdir, va, true);
+	}
 	if (!pte_p)
 		return -E_NO_MEM;
 	
@@ -549,7 +910,7 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 	//solves the re-inserting the same pp at the same va problem
 	//because this way it prevents the page 
 	//from going back to page_free_list if it's still in use
-	pp->pp_ref++;
+	page_incref(pp);
 	
 	//If there is already a page mapped at 'va', remove it
 	if(*pte_p & PTE_P)
@@ -562,6 +923,153 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 	return 0;
 }
 
+//
+// Map the 2^PAGE_LARGE_ORDER block starting at 'pp' as one 4MB page
+// at the 4MB-aligned virtual address 'va', with permissions
+// 'perm|PTE_P|PTE_PS' in the page directory entry.
+//
+// Whatever was mapped in [va, va+PTSIZE) before is unmapped, and its
+// page table freed.  The block's reference count lives in pp->pp_ref.
+//
+void
+page_insert_large(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
+{
+	pde_t *pde = &pgdir[PDX(va)];
+	struct PageInfo *ptpp;
+	pte_t *pt;
+	bool batched;
+	int i;
+
+	assert((uintptr_t)va % PTSIZE == 0);
+	assert(pp->pp_order == PAGE_LARGE_ORDER);
+
+	page_incref(pp);
+	if (*pde & PTE_PS)
+		page_remove(pgdir, va);
+	else if (*pde & PTE_P) {
+		ptpp = pa2page(PTE_ADDR(*pde));
+		pt = page2kva(ptpp);
+		batched = tlb_batch_join(pgdir);
+		for (i = 0; i < NPTENTRIES; i++)
+			if (pt[i] & PTE_P)
+				page_remove(pgdir, (char *) va + i * PGSIZE);
+		// Other CPUs may still walk the page table until the
+		// shootdown, so it is released after it like a page.
+		*pde = 0;
+		tlb_invalidate(pgdir, va);
+		tlb_page_release(pgdir, ptpp);
+		if (batched)
+			tlb_batch_end();
+	}
+	*pde = page2pa(pp) | ((perm | PTE_P | PTE_PS) & 0xFFF);
+}
+
+//
+// Copy the user part of srcpgdir into the empty dstpgdir copy-on-write:
+// writable and copy-on-write pages, 4MB ones included, become PTE_COW
+// and read-only in both, PTE_SHARE pages are shared as they are, and
+// read-only pages are shared read-only.  The page at skipva is left out.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if a page table couldn't be allocated
+//
+int
+page_dir_cow(pde_t *dstpgdir, pde_t *srcpgdir, uintptr_t skipva)
+{
+	uintptr_t va;
+	pte_t *pte;
+	int perm, r = 0;
+
+	// Our own read-only entries must be flushed everywhere.
+	tlb_batch_begin(srcpgdir);
+	for (va = 0; va < UTOP && r == 0; va += PGSIZE) {
+		if (!(srcpgdir[PDX(va)] & PTE_P)) {
+			va += PTSIZE - PGSIZE;
+			continue;
+		}
+		pte = pgdir_walk(srcpgdir, (void *) va, false);
+		if (*pte & PTE_PS)
+			va = ROUNDDOWN(va, PTSIZE);
+		else if (va == skipva || !(*pte & PTE_P) || !(*pte & PTE_U))
+			continue;
+
+		perm = PGOFF(*pte) & PTE_SYSCALL;
+		if (!(perm & PTE_SHARE) && (perm & (PTE_W | PTE_COW))) {
+			perm = (perm & ~PTE_W) | PTE_COW;
+			*pte = PTE_ADDR(*pte) | perm | (*pte & PTE_PS);
+			tlb_invalidate(srcpgdir, (void *) va);
+		}
+		if (*pte & PTE_PS) {
+			page_insert_large(dstpgdir, pa2page(PTE_ADDR(*pte)),
+					  (void *) va, perm);
+			va += PTSIZE - PGSIZE;
+			continue;
+		}
+		r = page_insert(dstpgdir, pa2page(PTE_ADDR(*pte)), (void *) va, perm);
+	}
+	tlb_batch_end();
+	return r;
+}
+
+//
+// Resolve a write fault on the copy-on-write page at va: map a private
+// writable copy of it, or, if pgdir holds the only reference, simply
+// make it writable again.  A 4MB page is copied whole.
+// The caller holds pgdir's env VM lock.
+//
+// RETURNS:
+//   0 on success, or if another CPU already resolved the fault
+//   -E_INVAL, if va is not a copy-on-write page
+//   -E_NO_MEM, if there is no memory for the copy
+//
+int
+page_cow(pde_t *pgdir, void *va)
+{
+	struct PageInfo *pp, *np;
+	pte_t *pte;
+	int perm, r;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	if ((uintptr_t) va >= UTOP)
+		return -E_INVAL;
+	pte = pgdir_walk(pgdir, va, false);
+	if (!pte || !(*pte & PTE_P))
+		return -E_INVAL;
+	if (*pte & PTE_PS)
+		va = ROUNDDOWN(va, PTSIZE);
+	// Our TLB entry was stale.
+	if (*pte & PTE_W) {
+		invlpg(va);
+		return 0;
+	}
+	if (!(*pte & PTE_COW))
+		return -E_INVAL;
+
+	pp = pa2page(PTE_ADDR(*pte));
+	perm = ((PGOFF(*pte) & PTE_SYSCALL) & ~PTE_COW) | PTE_W;
+	if (pp->pp_ref == 1) {
+		*pte = page2pa(pp) | perm | (*pte & PTE_PS);
+		invlpg(va);
+		return 0;
+	}
+
+	if (*pte & PTE_PS) {
+		if (!(np = page_alloc_order(PAGE_LARGE_ORDER, 0)))
+			return -E_NO_MEM;
+		memmove(page2kva(np), page2kva(pp), PTSIZE);
+		page_insert_large(pgdir, np, va, perm);
+		return 0;
+	}
+
+	if (!(np = page_alloc(0)))
+		return -E_NO_MEM;
+	memmove(page2kva(np), page2kva(pp), PGSIZE);
+	if ((r = page_insert(pgdir, np, va, perm)) < 0)
+		page_free(np);
+	return r;
+}
+
 //
 // Return the page mapped at virtual address 'va'.
 // If pte_store is not zero, then we store in it the address
@@ -571,6 +1079,9 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 //
 // Return NULL if there is no page mapped at va.
 //
+// If va is inside a 4MB page, the first page of that page's block
+// is returned and *pte_store is the page directory entry.
+//
 // Hint: the TA solution uses pgdir_walk and pa2page.
 //
 struct PageInfo *
@@ -602,6 +1113,7 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 //     (if such a PTE exists)
 //   - The TLB must be invalidated if you remove an entry from
 //     the page table.
+//   - If va is inside a 4MB page, the whole 4MB page is unmapped.
 //
 // Hint: The TA solution is implemented using page_lookup,
 // 	tlb_invalidate, and page_decref.
@@ -617,24 +1129,208 @@ page_remove(pde_t *pgdir, void *va)
 		return;
 	}
 	
-	page_decref(pp);
-	tlb_invalidate(pgdir, va);
-	
-	//set the corresponding pte to 0
+	//clear the pte first, so no CPU can load it again once flushed
 	if (pte_p)
 		*pte_p = 0;
+	tlb_invalidate(pgdir, va);
+	
+	//other CPUs may use the page until the shootdown is done
+	tlb_page_release(pgdir, pp);
+}
+
+// --------------------------------------------------------------
+// TLB shootdown.
+//
+// A CPU keeps an env's TLB entries for as long as its cpu_env uses
+// that env's page directory, so a mapping removed or downgraded in
+// pgdir must be flushed on every such CPU, not just this one.
+//
+// The initiator posts the addresses in its own TlbShootdown, sets a
+// bit per target CPU in ts_wait, sends each target a T_TLBFLUSH IPI and
+// spins until they have all cleared their bit.  The kernel runs with
+// interrupts off, so a target that is itself in the kernel will only
+// see the IPI once it leaves; to keep an initiator that holds a lock
+// from deadlocking with a target spinning on it (or with another
+// initiator), CPUs also answer requests while spinning on a lock.
+//
+// Between tlb_batch_begin and tlb_batch_end, invalidations of one
+// pgdir are collected and sent as a single shootdown, and the pages
+// unmapped in the meantime are released only after it.
+// --------------------------------------------------------------
+
+struct TlbShootdown {
+	volatile uint32_t ts_wait;	// CPUs that have yet to flush
+	int ts_nva;			// > TLB_BATCH means flush everything
+	uintptr_t ts_va[TLB_BATCH];
+};
+
+struct TlbBatch {
+	pde_t *tb_pgdir;		// Address space being batched, or NULL
+	int tb_nva;			// > TLB_BATCH means flush everything
+	uintptr_t tb_va[TLB_BATCH];
+	int tb_npp;
+	struct PageInfo *tb_pp[TLB_BATCH];	// Released after the flush
+};
+
+static struct TlbShootdown tlb_shootdowns[NCPU];
+static struct TlbBatch tlb_batches[NCPU];
+
+//
+// Flush nva addresses of pgdir (everything if nva > TLB_BATCH) on the
+// other CPUs that have it loaded, and wait until they have done so.
+//
+static void
+tlb_shootdown(pde_t *pgdir, uintptr_t *va, int nva)
+{
+	struct TlbShootdown *ts = &tlb_shootdowns[cpunum()];
+	struct Env *e;
+	uint32_t targets = 0;
+	int i;
+
+	// The PTE updates must be visible before we look at cpu_env:
+	// a CPU we don't pick here loads cr3 only after setting cpu_env,
+	// and so walks the updated page tables.
+	__sync_synchronize();
+	for (i = 0; i < ncpu; i++) {
+		e = cpus[i].cpu_env;
+		if (i != cpunum() && e && e->env_pgdir == pgdir)
+			targets |= 1 << i;
+	}
+	if (!targets)
+		return;
+
+	ts->ts_nva = nva;
+	if (nva <= TLB_BATCH)
+		memmove(ts->ts_va, va, nva * sizeof(uintptr_t));
+	__sync_fetch_and_or(&ts->ts_wait, targets);
+	for (i = 0; i < ncpu; i++)
+		if (targets & (1 << i))
+			lapic_ipi_cpu(cpus[i].cpu_id, T_TLBFLUSH);
+
+	while (ts->ts_wait) {
+		tlb_shootdown_poll();
+		asm volatile("pause");
+	}
+}
+
+//
+// Carry out the shootdowns other CPUs have asked this CPU for.
+// Called from the T_TLBFLUSH handler and while spinning on locks.
+//
+void
+tlb_shootdown_poll(void)
+{
+	struct TlbShootdown *ts;
+	uint32_t me = 1 << cpunum();
+	int i, j;
+
+	for (i = 0; i < ncpu; i++) {
+		ts = &tlb_shootdowns[i];
+		if (!(ts->ts_wait & me))
+			continue;
+		if (ts->ts_nva > TLB_BATCH)
+			lcr3(rcr3());
+		else
+			for (j = 0; j < ts->ts_nva; j++)
+				invlpg((void *) ts->ts_va[j]);
+		__sync_fetch_and_and(&ts->ts_wait, ~me);
+	}
 }
 
 //
-// Invalidate a TLB entry, but only if the page tables being
-// edited are the ones currently in use by the processor.
+// Start collecting the invalidations of pgdir on this CPU.
+//
+void
+tlb_batch_begin(pde_t *pgdir)
+{
+	struct TlbBatch *tb = &tlb_batches[cpunum()];
+
+	assert(!tb->tb_pgdir);
+	tb->tb_pgdir = pgdir;
+	tb->tb_nva = tb->tb_npp = 0;
+}
+
+//
+// Start a batch for pgdir unless this CPU already has one open.
+// Returns whether it did, and so whether to call tlb_batch_end.
+// Inside a batch for another pgdir, invalidations of pgdir are sent
+// one by one as usual.
+//
+static bool
+tlb_batch_join(pde_t *pgdir)
+{
+	if (tlb_batches[cpunum()].tb_pgdir)
+		return false;
+	tlb_batch_begin(pgdir);
+	return true;
+}
+
+static void
+tlb_batch_flush(struct TlbBatch *tb)
+{
+	int i;
+
+	if (tb->tb_nva)
+		tlb_shootdown(tb->tb_pgdir, tb->tb_va, tb->tb_nva);
+	for (i = 0; i < tb->tb_npp; i++)
+		page_decref(tb->tb_pp[i]);
+	tb->tb_nva = tb->tb_npp = 0;
+}
+
+//
+// Send the collected invalidations as one shootdown and release the
+// pages unmapped during the batch.
+//
+void
+tlb_batch_end(void)
+{
+	struct TlbBatch *tb = &tlb_batches[cpunum()];
+
+	assert(tb->tb_pgdir);
+	tlb_batch_flush(tb);
+	tb->tb_pgdir = NULL;
+}
+
+//
+// Drop the reference a just-removed mapping in pgdir held on pp.
+// Inside a batch for pgdir this waits for the batch's shootdown.
+//
+static void
+tlb_page_release(pde_t *pgdir, struct PageInfo *pp)
+{
+	struct TlbBatch *tb = &tlb_batches[cpunum()];
+
+	if (tb->tb_pgdir != pgdir) {
+		page_decref(pp);
+		return;
+	}
+	if (tb->tb_npp == TLB_BATCH)
+		tlb_batch_flush(tb);
+	tb->tb_pp[tb->tb_npp++] = pp;
+}
+
+//
+// Invalidate a TLB entry on this CPU, if the page tables being edited
+// are the ones in use here, and on any other CPU that has pgdir loaded.
 //
 void
 tlb_invalidate(pde_t *pgdir, void *va)
 {
+	struct TlbBatch *tb = &tlb_batches[cpunum()];
+	uintptr_t v = (uintptr_t) va;
+
 	// Flush the entry only if we're modifying the current address space.
 	if (!curenv || curenv->env_pgdir == pgdir)
 		invlpg(va);
+
+	if (tb->tb_pgdir != pgdir) {
+		tlb_shootdown(pgdir, &v, 1);
+		return;
+	}
+	if (tb->tb_nva < TLB_BATCH)
+		tb->tb_va[tb->tb_nva] = v;
+	if (tb->tb_nva <= TLB_BATCH)
+		tb->tb_nva++;
 }
 
 //
@@ -673,7 +1369,7 @@ mmio_map_region(physaddr_t pa, size_t size)
 	if (base + size_al >= MMIOLIM)
 		panic("mmio_map_region: Reservation overflows MMIOLIM\n");
 		
-	boot_map_region(kern_pgdir, base, size_al, pa, PTE_PCD | PTE_PWT | PTE_W);
+	boot_map_region(kern_pgdir, base, size_al, pa, PTE_PCD | PTE_PWT | PTE_W | PTE_G);
 	
 	uintptr_t r = base;
 	base += size_al;
@@ -742,63 +1438,106 @@ user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 // Checking functions.
 // --------------------------------------------------------------
 
+// Count the free pages held by the buddy allocator.
+static size_t
+check_nfree(void)
+{
+	size_t n = 0;
+	int o;
+
+	for (o = 0; o <= PAGE_MAX_ORDER; o++)
+		n += buddy_nfree[o] << o;
+	return n;
+}
+
+// Take every free block out of the buddy allocator, chained through
+// pp_link, so a check can run as if memory were exhausted.  Each
+// block's order stays in pp_order for check_return_free.
+static struct PageInfo *
+check_steal_free(void)
+{
+	struct PageInfo *pp, *fl = NULL;
+	int o;
+
+	for (o = 0; o <= PAGE_MAX_ORDER; o++)
+		while ((pp = buddy_free[o]) != NULL) {
+			buddy_remove(pp, o);
+			pp->pp_link = fl;
+			fl = pp;
+		}
+	return fl;
+}
+
+static void
+check_return_free(struct PageInfo *fl)
+{
+	struct PageInfo *pp;
+
+	while ((pp = fl) != NULL) {
+		fl = pp->pp_link;
+		pp->pp_link = NULL;
+		buddy_free_block(pp, pp->pp_order);
+	}
+}
+
 //
-// Check that the pages on the page_free_list are reasonable.
+// Check that the pages on the buddy free lists are reasonable.
 //
 static void
 check_page_free_list(bool only_low_memory)
 {
-	struct PageInfo *pp;
+	struct PageInfo *blk, *pp;
 	unsigned pdx_limit = only_low_memory ? 1 : NPDENTRIES;
 	int nfree_basemem = 0, nfree_extmem = 0;
 	char *first_free_page;
+	int o, i;
 
-	if (!page_free_list)
-		panic("'page_free_list' is a null pointer!");
-
-	if (only_low_memory) {
-		// Move pages with lower addresses first in the free
-		// list, since entry_pgdir does not map all pages.
-		struct PageInfo *pp1, *pp2;
-		struct PageInfo **tp[2] = { &pp1, &pp2 };
-		for (pp = page_free_list; pp; pp = pp->pp_link) {
-			int pagetype = PDX(page2pa(pp)) >= pdx_limit;
-			*tp[pagetype] = pp;
-			tp[pagetype] = &pp->pp_link;
-		}
-		*tp[1] = 0;
-		*tp[0] = pp2;
-		page_free_list = pp1;
-	}
+	if (!check_nfree())
+		panic("no free pages!");
 
 	// if there's a page that shouldn't be on the free list,
 	// try to make sure it eventually causes trouble.
-	for (pp = page_free_list; pp; pp = pp->pp_link) {
-		if (PDX(page2pa(pp)) < pdx_limit)
-			memset(page2kva(pp), 0x97, 128);
-	}
+	for (o = 0; o <= PAGE_MAX_ORDER; o++)
+		for (blk = buddy_free[o]; blk; blk = blk->pp_link)
+			for (i = 0; i < (1 << o); i++)
+				if (PDX(page2pa(blk + i)) < pdx_limit)
+					memset(page2kva(blk + i), 0x97, 128);
 	
 	first_free_page = (char *) boot_alloc(0);
-	for (pp = page_free_list; pp; pp = pp->pp_link) {
-		// check that we didn't corrupt the free list itself
-		assert(pp >= pages);
-		assert(pp < pages + npages);
-		assert(((char *) pp - (char *) pages) % sizeof(*pp) == 0);
-
-		// check a few pages that shouldn't be on the free list
-		assert(page2pa(pp) != 0);
-		assert(page2pa(pp) != IOPHYSMEM);
-		assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
-		assert(page2pa(pp) != EXTPHYSMEM);
-		assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
-		// (new test for lab 4)
-		assert(page2pa(pp) != MPENTRY_PADDR);
-
-		if (page2pa(pp) < EXTPHYSMEM)
-			++nfree_basemem;
-		else
-			++nfree_extmem;
+	for (o = 0; o <= PAGE_MAX_ORDER; o++) {
+		for (blk = buddy_free[o]; blk; blk = blk->pp_link) {
+			// check that we didn't corrupt the free lists
+			assert(blk >= pages);
+			assert(blk + (1 << o) <= pages + npages);
+			assert(((char *) blk - (char *) pages) % sizeof(*blk) == 0);
+			assert(blk->pp_free && blk->pp_order == o);
+			assert((blk - pages) % (1 << o) == 0);
+
+			for (i = 0; i < (1 << o); i++) {
+				pp = blk + i;
+				// check a few pages that shouldn't be on the free list
+				assert(pp->pp_ref == 0);
+				assert(page2pa(pp) != 0);
+				assert(page2pa(pp) != IOPHYSMEM);
+				assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
+				assert(page2pa(pp) != EXTPHYSMEM);
+				assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
+				// (new test for lab 4)
+				assert(page2pa(pp) != MPENTRY_PADDR);
+
+				if (page2pa(pp) < EXTPHYSMEM)
+					++nfree_basemem;
+				else
+					++nfree_extmem;
+			}
+		}
 	}
+
+	// Early allocations must come from memory entry_pgdir maps.
+	if (only_low_memory)
+		for (o = 0; o <= PAGE_MAX_ORDER; o++)
+			for (blk = buddy_free[o]; blk; blk = blk->pp_link)
+				assert(PDX(page2pa(blk)) < 1);
 	
 	assert(nfree_basemem > 0);
 	assert(nfree_extmem > 0);
@@ -823,8 +1562,7 @@ check_page_alloc(void)
 		panic("'pages' is a null pointer!");
 
 	// check number of free pages
-	for (pp = page_free_list, nfree = 0; pp; pp = pp->pp_link)
-		++nfree;
+	nfree = check_nfree();
 
 	// should be able to allocate three pages
 	pp0 = pp1 = pp2 = 0;
@@ -840,8 +1578,7 @@ check_page_alloc(void)
 	assert(page2pa(pp2) < npages*PGSIZE);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	fl = check_steal_free();
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -869,7 +1606,7 @@ check_page_alloc(void)
 		assert(c[i] == 0);
 
 	// give free list back
-	page_free_list = fl;
+	check_return_free(fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -877,13 +1614,106 @@ check_page_alloc(void)
 	page_free(pp2);
 
 	// number of free pages should be the same
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		--nfree;
-	assert(nfree == 0);
+	assert(check_nfree() == nfree);
 
 	cprintf("check_page_alloc() succeeded!\n");
 }
 
+//
+// Check the buddy allocator (page_alloc_order() and page_free_order()):
+// alignment, splitting and merging, behaviour when memory is
+// fragmented, and report how fast it is.
+//
+static void
+check_buddy_alloc(void)
+{
+	struct PageInfo *held[PAGE_MAX_ORDER + 1], *p[16];
+	struct PageInfo *pp, *blk, *fl;
+	size_t nfree;
+	uint64_t t;
+	char *c;
+	int o, i, j;
+
+	nfree = check_nfree();
+
+	// blocks are aligned to their size and never overlap
+	for (o = 0; o <= PAGE_MAX_ORDER; o++) {
+		// only memory below 4MB is free yet, so big orders may fail
+		if (!(held[o] = page_alloc_order(o, 0)))
+			continue;
+		assert((held[o] - pages) % (1 << o) == 0);
+		for (i = 0; i < o; i++)
+			assert(!held[i] || held[i] + (1 << i) <= held[o] ||
+			       held[o] + (1 << o) <= held[i]);
+	}
+	for (o = 0; o <= PAGE_MAX_ORDER; o++)
+		if (held[o])
+			page_free_order(held[o], o);
+	assert(check_nfree() == nfree);
+
+	// ALLOC_ZERO clears the whole block
+	assert((pp = page_alloc_order(2, 0)));
+	memset(page2kva(pp), 1, 4 * PGSIZE);
+	page_free_order(pp, 2);
+	assert((pp = page_alloc_order(2, ALLOC_ZERO)));
+	c = page2kva(pp);
+	for (i = 0; i < 4 * PGSIZE; i++)
+		assert(c[i] == 0);
+	page_free_order(pp, 2);
+
+	// leave a single 16-page block free
+	assert((blk = page_alloc_order(4, 0)));
+	fl = check_steal_free();
+	page_free_order(blk, 4);
+
+	// single pages are split off that block
+	for (i = 0; i < 16; i++) {
+		assert((p[i] = page_alloc(0)));
+		assert(p[i] >= blk && p[i] < blk + 16);
+	}
+	assert(!page_alloc(0));
+
+	// freeing every other page leaves nothing bigger than a page
+	for (i = 0; i < 16; i += 2)
+		page_free(p[i]);
+	assert(buddy_nfree[0] == 8);
+	assert(!page_alloc_order(1, 0));
+
+	// freeing the rest merges everything back into one block
+	for (i = 1; i < 16; i += 2)
+		page_free(p[i]);
+	assert(check_nfree() == 16 && buddy_free[4] == blk);
+	assert(page_alloc_order(4, 0) == blk);
+
+	check_return_free(fl);
+	page_free_order(blk, 4);
+	assert(check_nfree() == nfree);
+
+	// throughput
+	t = read_tsc();
+	for (j = 0; j < 64; j++) {
+		for (i = 0; i < 16; i++)
+			assert((p[i] = page_alloc_order(0, 0)));
+		for (i = 0; i < 16; i++)
+			page_free_order(p[i], 0);
+	}
+	t = read_tsc() - t;
+	cprintf("check_buddy_alloc: order-0 alloc+free %llu cycles\n", t / (64 * 16));
+
+	t = read_tsc();
+	for (j = 0; j < 64; j++) {
+		for (i = 0; i < 16; i++)
+			assert((p[i] = page_alloc_order(3, 0)));
+		for (i = 0; i < 16; i++)
+			page_free_order(p[i], 3);
+	}
+	t = read_tsc() - t;
+	cprintf("check_buddy_alloc: order-3 alloc+free %llu cycles\n", t / (64 * 16));
+	assert(check_nfree() == nfree);
+
+	cprintf("check_buddy_alloc() succeeded!\n");
+}
+
 //
 // Checks that the kernel part of virtual address space
 // has been setup roughly correctly (by mem_init()).
@@ -960,6 +1790,8 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
 	pgdir = &pgdir[PDX(va)];
 	if (!(*pgdir & PTE_P))
 		return ~0;
+	if (*pgdir & PTE_PS)
+		return PTE_ADDR(*pgdir) + PTX(va) * PGSIZE;
 	p = (pte_t*) KADDR(PTE_ADDR(*pgdir));
 	if (!(p[PTX(va)] & PTE_P))
 		return ~0;
@@ -990,8 +1822,7 @@ check_page(void)
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	fl = check_steal_free();
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -1111,7 +1942,7 @@ check_page(void)
 	pp0->pp_ref = 0;
 
 	// give free list back
-	page_free_list = fl;
+	check_return_free(fl);
 
 	// free the pages we took
 	page_free(pp0);
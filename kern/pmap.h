@@ -51,17 +51,50 @@ enum {
 	ALLOC_ZERO = 1<<0,
 };
 
+// Largest block page_alloc_order hands out: 2^10 pages, or 4MB.
+#define PAGE_MAX_ORDER	10
+// Order of the block behind a 4MB (PTE_PS) mapping.
+#define PAGE_LARGE_ORDER	(PTSHIFT - PGSHIFT)
+
+// Per-CPU cache of free pages in front of the buddy allocator.
+struct PageCache {
+	struct PageInfo *pc_free;	// Cached free pages, linked by pp_link
+	int pc_count;			// Number of pages on pc_free
+	uint32_t pc_hits;		// Allocations served from the cache
+	uint32_t pc_misses;		// Allocations that found it empty
+	uint32_t pc_refills;		// Batches taken from the buddy allocator
+	uint32_t pc_drains;		// Batches returned to the buddy allocator
+	uint32_t pc_zero_hits;		// ALLOC_ZERO served from the zeroed pool
+	uint32_t pc_zero_misses;	// ALLOC_ZERO that had to memset
+};
+
+extern struct PageCache page_caches[];
+extern int page_zero_count;
+
 void	mem_init(void);
 
 void	page_init(void);
 struct PageInfo *page_alloc(int alloc_flags);
 void	page_free(struct PageInfo *pp);
+struct PageInfo *page_alloc_order(int order, int alloc_flags);
+void	page_free_order(struct PageInfo *pp, int order);
 int	page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
+void	page_insert_large(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
+int	page_dir_cow(pde_t *dstpgdir, pde_t *srcpgdir, uintptr_t skipva);
+int	page_cow(pde_t *pgdir, void *va);
 void	page_remove(pde_t *pgdir, void *va);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
+void	page_incref(struct PageInfo *pp);
 void	page_decref(struct PageInfo *pp);
+void	page_zero_idle(void);
+
+// Most invalidations one TLB shootdown carries; more flush everything.
+#define TLB_BATCH	16
 
 void	tlb_invalidate(pde_t *pgdir, void *va);
+void	tlb_batch_begin(pde_t *pgdir);
+void	tlb_batch_end(void);
+void	tlb_shootdown_poll(void);
 
 void *	mmio_map_region(physaddr_t pa, size_t size);
 
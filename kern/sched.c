@@ -4,49 +4,286 @@
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/futex.h>
 
 void sched_halt(void);
 
+// Multi-level feedback queue.
+// Level 0 is the highest priority.  An env starts at the top level its
+// env_prio allows and is demoted one level each time it uses up the
+// quantum of its current level, so CPU hogs sink while envs that block
+// early stay near the top.  Envs that block in sys_ipc_recv are boosted
+// back to their top level, and every SCHED_BOOST_TICKS timer ticks all
+// envs are boosted so nothing starves at the bottom.
+#define NSCHEDLEVELS		4
+#define SCHED_BOOST_TICKS	100
+
+// Quantum of each level, in timer ticks.
+static const int sched_quantum[NSCHEDLEVELS] = { 1, 2, 4, 8 };
+
+// Timer ticks seen by CPU 0, used to pace the periodic boost.
+static unsigned sched_ticks;
+
+// Per-CPU queue of runnable environments, one FIFO per level.
+// Envs are linked through env_sched_link.  An env whose status changed
+// after it was queued is dropped lazily when it reaches the head, so
+// sched_enqueue and the pick-next path are both O(1).
+// Each queue has its own lock; rq_len and the heads may be read without
+// it as a hint.
+struct RunQueue {
+	struct spinlock rq_lock;
+	struct Env *rq_head[NSCHEDLEVELS];
+	struct Env *rq_tail[NSCHEDLEVELS];
+	unsigned rq_len;
+};
+
+static struct RunQueue runqueues[NCPU];
+
+void
+sched_init(void)
+{
+	int i;
+
+	for (i = 0; i < NCPU; i++)
+		spin_initlock(&runqueues[i].rq_lock);
+}
+
+// Append e to the tail of its level's queue on CPU cpu.
+// The caller holds the queue's lock.
+static void
+rq_push(int cpu, struct Env *e)
+{
+	struct RunQueue *rq = &runqueues[cpu];
+	int l = e->env_sched_level;
+
+	e->env_sched_link = NULL;
+	e->env_sched_cpu = cpu;
+	if (rq->rq_tail[l])
+		rq->rq_tail[l]->env_sched_link = e;
+	else
+		rq->rq_head[l] = e;
+	rq->rq_tail[l] = e;
+	rq->rq_len++;
+}
+
+// Pop the first ENV_RUNNABLE env off CPU cpu's run queue, highest
+// level first, discarding stale entries on the way.  Returns NULL if none.
+static struct Env *
+rq_pop(int cpu)
+{
+	struct RunQueue *rq = &runqueues[cpu];
+	struct Env *e;
+	int l;
+
+	spin_lock(&rq->rq_lock);
+	for (l = 0; l < NSCHEDLEVELS; l++) {
+		while ((e = rq->rq_head[l]) != NULL) {
+			rq->rq_head[l] = e->env_sched_link;
+			if (!rq->rq_head[l])
+				rq->rq_tail[l] = NULL;
+			rq->rq_len--;
+			e->env_sched_link = NULL;
+			e->env_sched_cpu = -1;
+			if (e->env_status == ENV_RUNNABLE) {
+				spin_unlock(&rq->rq_lock);
+				return e;
+			}
+		}
+	}
+	spin_unlock(&rq->rq_lock);
+	return NULL;
+}
+
+// Return the highest level with a queued env on CPU cpu,
+// or NSCHEDLEVELS if its queue is empty.
+static int
+rq_top_level(int cpu)
+{
+	int l;
+
+	for (l = 0; l < NSCHEDLEVELS; l++)
+		if (runqueues[cpu].rq_head[l])
+			break;
+	return l;
+}
+
+// Move e to level l with a fresh quantum.
+static void
+sched_set_level(struct Env *e, int l)
+{
+	e->env_sched_level = l;
+	e->env_sched_ticks = sched_quantum[l];
+}
+
+// Raise e to the highest level its priority allows.
+// Low priority envs never run at level 0.
+void
+sched_boost(struct Env *e)
+{
+	sched_set_level(e, e->env_prio == ENV_PRIO_LOW ? 1 : 0);
+}
+
+// Give to, which is about to run in from's place on this CPU, the
+// rest of from's time slice: its level and remaining ticks.  An env
+// that is already at a higher level keeps its own.
+void
+sched_donate(struct Env *from, struct Env *to)
+{
+	if (from->env_sched_level <= to->env_sched_level) {
+		to->env_sched_level = from->env_sched_level;
+		to->env_sched_ticks = from->env_sched_ticks;
+	}
+}
+
+// Boost every env, and rebuild the run queues so that envs
+// already waiting at low levels move up as well.
+// The caller must not hold env_lock.
+static void
+sched_boost_all(void)
+{
+	struct Env *e, *next, *head, **tailp;
+	struct RunQueue *rq;
+	int i, l;
+
+	// Levels are set under env_lock everywhere else (sched_boost's
+	// and sched_donate's callers hold it).
+	spin_lock(&env_lock);
+	for (i = 0; i < NENV; i++)
+		if (envs[i].env_status != ENV_FREE)
+			sched_boost(&envs[i]);
+	spin_unlock(&env_lock);
+
+	for (i = 0; i < ncpu; i++) {
+		rq = &runqueues[i];
+		spin_lock(&rq->rq_lock);
+		head = NULL;
+		tailp = &head;
+		for (l = 0; l < NSCHEDLEVELS; l++) {
+			*tailp = rq->rq_head[l];
+			if (rq->rq_tail[l])
+				tailp = &rq->rq_tail[l]->env_sched_link;
+			rq->rq_head[l] = rq->rq_tail[l] = NULL;
+		}
+		rq->rq_len = 0;
+		for (e = head; e; e = next) {
+			next = e->env_sched_link;
+			rq_push(i, e);
+		}
+		spin_unlock(&rq->rq_lock);
+	}
+}
+
+// Make e, which must be ENV_RUNNABLE, eligible to be picked by the
+// scheduler.  The env goes back on the queue of the CPU it last ran on
+// to keep its cache state warm; idle CPUs steal it from there if needed.
+// Queuing an env that is already queued is a no-op.
+// The caller holds env_lock.
+//
+// rq_pop clears env_sched_cpu and then checks env_status holding only
+// the queue's lock, so whether e is still queued is only decided under
+// that lock: if it is, rq_pop has yet to look at e and will see it
+// runnable.
+void
+sched_enqueue(struct Env *e)
+{
+	int cpu;
+
+	assert(e->env_status == ENV_RUNNABLE);
+	while ((cpu = e->env_sched_cpu) >= 0) {
+		spin_lock(&runqueues[cpu].rq_lock);
+		if (e->env_sched_cpu == cpu) {
+			spin_unlock(&runqueues[cpu].rq_lock);
+			return;
+		}
+		spin_unlock(&runqueues[cpu].rq_lock);
+	}
+
+	// Only callers holding env_lock queue e, so it stays off every
+	// queue until we push it.
+	cpu = e->env_cpunum;
+	if (cpu < 0 || cpu >= ncpu)
+		cpu = cpunum();
+	spin_lock(&runqueues[cpu].rq_lock);
+	rq_push(cpu, e);
+	spin_unlock(&runqueues[cpu].rq_lock);
+}
+
+// Try to take e, just popped off a run queue, for this CPU.
+// Fails if e stopped being runnable after it was queued, or if another
+// CPU got to it first through a second queue entry.
+static bool
+sched_claim(struct Env *e)
+{
+	bool ok;
+
+	spin_lock(&env_lock);
+	ok = (e->env_status == ENV_RUNNABLE);
+	if (ok) {
+		e->env_status = ENV_RUNNING;
+		e->env_cpunum = cpunum();
+	}
+	spin_unlock(&env_lock);
+	return ok;
+}
+
+// Take a runnable env from the busiest other CPU's queue.
+static struct Env *
+sched_steal(void)
+{
+	int self = cpunum();
+	int i, victim;
+	unsigned maxlen;
+	struct Env *e;
+
+	while (1) {
+		victim = -1;
+		maxlen = 0;
+		for (i = 1; i < ncpu; i++) {
+			int cpu = (self + i) % ncpu;
+			if (runqueues[cpu].rq_len > maxlen) {
+				maxlen = runqueues[cpu].rq_len;
+				victim = cpu;
+			}
+		}
+		if (victim < 0)
+			return NULL;
+		if ((e = rq_pop(victim)) != NULL)
+			return e;
+		// That queue held only stale entries; try the next busiest.
+	}
+}
+
 // Choose a user environment to run and run it.
 void
 sched_yield(void)
 {
-	struct Env *idle;
+	struct Env *e;
 
-	// Implement simple round-robin scheduling.
-	//
-	// Search through 'envs' for an ENV_RUNNABLE environment in
-	// circular fashion starting just after the env this CPU was
-	// last running.  Switch to the first such environment found.
+	// Take the highest level env from this CPU's run queue, falling
+	// back to stealing from another CPU.  Envs that get preempted are
+	// pushed back on the tail of their level by env_run, which gives us
+	// round-robin order within a level.
 	//
 	// If no envs are runnable, but the environment previously
 	// running on this CPU is still ENV_RUNNING, it's okay to
-	// choose that environment.
-	//
-	// Never choose an environment that's currently running on
-	// another CPU (env_status == ENV_RUNNING). If there are
-	// no runnable environments, simply drop through to the code
-	// below to halt the cpu.
+	// choose that environment.  Envs running on other CPUs are
+	// never on a run queue, so we cannot pick them by accident,
+	// but curenv itself may have been woken and claimed by another
+	// CPU after it blocked, so check that it is still ours.
+
+	while ((e = rq_pop(cpunum())) != NULL || (e = sched_steal()) != NULL)
+		if (sched_claim(e))
+			env_run(e);
 
-	// LAB 4: Your code here.
-	
-	int curenv_idx = curenv ? ENVX(curenv->env_id) + 1: 0;
-	//float curenv_prio = curenv ? (double)(1/(curenv->env_prio))*curenv->env_runs : (unsigned)(-1); 
-	int i;
-	for (i = 0; i < NENV; i++) {
-		int id = (curenv_idx + i) % NENV;
-		if (envs[id].env_status == ENV_RUNNABLE) {
-			//float prio = (double)(1/(envs[id].env_prio))*envs[id].env_runs;
-			//if (prio <= curenv_prio)
-				env_run(&envs[id]); //doesn't return
-		}
-	}
-	
 	//if we're here there's no runnable env available
 	//so try to rerun peviously running on this CPU
-	if (curenv && curenv->env_status == ENV_RUNNING) {
+	spin_lock(&env_lock);
+	if (curenv && curenv->env_status == ENV_RUNNING &&
+	    curenv->env_cpunum == cpunum()) {
+		spin_unlock(&env_lock);
 		env_run(curenv);
 	}
+	spin_unlock(&env_lock);
 	
 	//if we're here, there's no available env to run,
 	//so halt the CPU
@@ -54,6 +291,37 @@ sched_yield(void)
 	sched_halt();
 }
 
+// Called on every timer interrupt.  Charges the running env one tick
+// and preempts it if it used up its quantum or a higher level env is
+// waiting; otherwise returns so the trap path resumes it.
+void
+sched_tick(void)
+{
+	struct Env *e = curenv;
+	int top;
+	bool expired = false;
+
+	if (cpunum() == 0) {
+		if (++sched_ticks % SCHED_BOOST_TICKS == 0)
+			sched_boost_all();
+		futex_tick();
+	}
+
+	if (!e || e->env_status != ENV_RUNNING)
+		sched_yield();
+
+	if (--e->env_sched_ticks <= 0) {
+		// Used up its allotment at this level: demote it.
+		expired = true;
+		sched_set_level(e, MIN(e->env_sched_level + 1,
+				       NSCHEDLEVELS - 1));
+	}
+
+	top = rq_top_level(cpunum());
+	if (top < e->env_sched_level || (expired && top == e->env_sched_level))
+		sched_yield();
+}
+
 // Halt this CPU when there is nothing to do. Wait until the
 // timer interrupt wakes it up. This function never returns.
 //
@@ -62,6 +330,12 @@ sched_halt(void)
 {
 	int i;
 
+	// Mark that no environment is running on this CPU.  Do this
+	// first: it frees curenv if it died while loaded here.
+	spin_lock(&env_lock);
+	env_switch(NULL);
+	spin_unlock(&env_lock);
+
 	// For debugging and testing purposes, if there are no runnable
 	// environments in the system, then drop into the kernel monitor.
 	for (i = 0; i < NENV; i++) {
@@ -76,18 +350,12 @@ sched_halt(void)
 			monitor(NULL);
 	}
 
-	// Mark that no environment is running on this CPU
-	curenv = NULL;
-	lcr3(PADDR(kern_pgdir));
+	// Use the idle time to pre-zero some free pages.
+	page_zero_idle();
 
-	// Mark that this CPU is in the HALT state, so that when
-	// timer interupts come in, we know we should re-acquire the
-	// big kernel lock
+	// Mark that this CPU is in the HALT state
 	xchg(&thiscpu->cpu_status, CPU_HALTED);
 
-	// Release the big kernel lock as if we were "leaving" the kernel
-	unlock_kernel();
-
 	// Reset stack pointer, enable interrupts and then halt.
 	asm volatile (
 		"movl $0, %%ebp\n"
@@ -100,4 +368,3 @@ sched_halt(void)
 		"jmp 1b\n"
 	: : "a" (thiscpu->cpu_ts.ts_esp0));
 }
-
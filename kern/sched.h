@@ -6,7 +6,14 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+struct Env;
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
+void sched_init(void);
+void sched_enqueue(struct Env *e);
+void sched_boost(struct Env *e);
+void sched_donate(struct Env *from, struct Env *to);
+void sched_tick(void);
 
 #endif	// !JOS_KERN_SCHED_H
@@ -8,13 +8,7 @@
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/kdebug.h>
-
-// The big kernel lock
-struct spinlock kernel_lock = {
-#ifdef DEBUG_SPINLOCK
-	.name = "kernel_lock"
-#endif
-};
+#include <kern/pmap.h>
 
 #ifdef DEBUG_SPINLOCK
 // Record the current call stack in pcs[] by following the %ebp chain.
@@ -68,8 +62,12 @@ spin_lock(struct spinlock *lk)
 	// The xchg is atomic.
 	// It also serializes, so that reads after acquire are not
 	// reordered before it. 
-	while (xchg(&lk->locked, 1) != 0)
+	// While we wait, the holder may be waiting on a TLB shootdown
+	// from us, which can't arrive as an interrupt in the kernel.
+	while (xchg(&lk->locked, 1) != 0) {
+		tlb_shootdown_poll();
 		asm volatile ("pause");
+	}
 
 	// Record info about lock acquisition for debugging.
 #ifdef DEBUG_SPINLOCK
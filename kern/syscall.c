@@ -11,6 +11,7 @@
 #include <kern/syscall.h>
 #include <kern/console.h>
 #include <kern/sched.h>
+#include <kern/futex.h>
 
 #define debug 0
 
@@ -57,8 +58,13 @@ sys_env_destroy(envid_t envid)
 	int r;
 	struct Env *e;
 
-	if ((r = envid2env(envid, &e, 1)) < 0)
+	// Hold env_lock across the lookup so e cannot be freed and
+	// reused before we get to it.
+	spin_lock(&env_lock);
+	if ((r = envid2env(envid, &e, 1)) < 0) {
+		spin_unlock(&env_lock);
 		return r;
+	}
 	
 	//debug
 	if (e == curenv)
@@ -66,7 +72,7 @@ sys_env_destroy(envid_t envid)
 	else
 		cprintf("[%08x] destroying %08x\n", curenv->env_id, e->env_id);
 		
-	env_destroy(e);
+	env_destroy_locked(e);
 	return 0;
 }
 
@@ -109,6 +115,53 @@ sys_exofork(void)
 	return newenv->env_id;
 }
 
+// Like sys_exofork, but the kernel also copies the caller's address
+// space into the child copy-on-write (see page_dir_cow), gives the
+// child a fresh exception stack and the caller's pgfault upcall, and
+// marks the child runnable.  From then on both envs have their
+// PTE_COW write faults resolved by the kernel (env_kcow).
+//
+// Returns envid of new environment, or < 0 on error.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_env_fork_cow(void)
+{
+	struct Env *e;
+	struct PageInfo *pp;
+	pte_t *pte;
+	int r;
+
+	if ((r = env_alloc(&e, curenv->env_id)) < 0)
+		return r;
+	memmove(&e->env_tf, &curenv->env_tf, sizeof(e->env_tf));
+	e->env_tf.tf_regs.reg_eax = 0;
+	e->env_pgfault_upcall = curenv->env_pgfault_upcall;
+	e->env_kcow = curenv->env_kcow = true;
+
+	env_vm_lock2(curenv, e);
+	r = page_dir_cow(e->env_pgdir, curenv->env_pgdir, UXSTACKTOP - PGSIZE);
+	pte = pgdir_walk(curenv->env_pgdir, (void *) (UXSTACKTOP - PGSIZE), false);
+	if (r == 0 && pte && (*pte & PTE_P)) {
+		if (!(pp = page_alloc(ALLOC_ZERO)))
+			r = -E_NO_MEM;
+		else if ((r = page_insert(e->env_pgdir, pp, 
+				(void *) (UXSTACKTOP - PGSIZE), PTE_P | PTE_U | PTE_W)) < 0)
+			page_free(pp);
+	}
+	env_vm_unlock2(curenv, e);
+	if (r < 0) {
+		env_destroy(e);
+		return r;
+	}
+
+	spin_lock(&env_lock);
+	e->env_status = ENV_RUNNABLE;
+	sched_enqueue(e);
+	spin_unlock(&env_lock);
+	return e->env_id;
+}
+
 // Set envid's env_status to status, which must be ENV_RUNNABLE
 // or ENV_NOT_RUNNABLE.
 //
@@ -131,11 +184,35 @@ sys_env_set_status(envid_t envid, int status)
 		return -E_INVAL;
 		
 	struct Env *e;
+	spin_lock(&env_lock);
 	int r = envid2env(envid, &e, 1);
-	if (r < 0)
+	if (r < 0) {
+		spin_unlock(&env_lock);
 		return r;
+	}
 	
-	e->env_status = status;
+	// A dying env stays dying, and an env that is already running
+	// must not be queued a second time.
+	if (e->env_status == ENV_DYING) {
+		spin_unlock(&env_lock);
+		return -E_BAD_ENV;
+	}
+	if (e->env_status != ENV_RUNNING || status != ENV_RUNNABLE) {
+		e->env_status = status;
+		if (status == ENV_RUNNABLE) {
+			// A runnable env is no longer blocked sending,
+			// sleeping on a futex or on its doorbell.  A send
+			// cut short this way fails.
+			if (e->env_ipc_sendto) {
+				env_ipc_waitq_remove(e);
+				e->env_tf.tf_regs.reg_eax = -E_IPC_NOT_RECV;
+			}
+			futex_unpark(e);
+			e->env_doorbell_waiting = false;
+			sched_enqueue(e);
+		}
+	}
+	spin_unlock(&env_lock);
 	
 	return 0;
 }
@@ -214,6 +291,29 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 	return 0;
 }
 
+// Look up envid like envid2env and lock its address space.
+// The env may be freed between the lookup and taking the lock,
+// so check that it is still the same live env once we hold it.
+static int
+envid2env_vm(envid_t envid, struct Env **env_store, bool checkperm)
+{
+	struct Env *e;
+	envid_t id;
+	int r;
+
+	if ((r = envid2env(envid, &e, checkperm)) < 0)
+		return r;
+	id = e->env_id;
+	env_vm_lock(e);
+	if (e->env_status == ENV_FREE || e->env_id != id) {
+		env_vm_unlock(e);
+		*env_store = 0;
+		return -E_BAD_ENV;
+	}
+	*env_store = e;
+	return 0;
+}
+
 // Allocate a page of memory and map it at 'va' with permission
 // 'perm' in the address space of 'envid'.
 // The page's contents are set to 0.
@@ -251,11 +351,7 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	if (perm & ~PTE_SYSCALL)
 		return -E_INVAL;
 		
-	struct Env *e;
-	int r = envid2env(envid, &e, 1);
-	if (r < 0) 
-		return r;
-		
+	// Zero the page before taking any locks.
 	struct PageInfo *pp = page_alloc(ALLOC_ZERO);
 	if (!pp) {
 		if (debug)
@@ -263,7 +359,15 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 		return -E_NO_MEM;
 	}
 	
+	struct Env *e;
+	int r = envid2env_vm(envid, &e, 1);
+	if (r < 0) {
+		page_free(pp);
+		return r;
+	}
+	
 	r = page_insert(e->env_pgdir, pp, va, perm);
+	env_vm_unlock(e);
 	if (r < 0) {
 		if (debug)
 			cprintf("[%08x] in sys_page_alloc, page_insert %e\n", sys_getenvid(), r);
@@ -274,6 +378,119 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	return 0;
 }
 
+// Allocate a zeroed 4MB page and map it at 'va' with permission
+// 'perm' in the address space of 'envid', using a single PTE_PS
+// page directory entry.  Anything mapped in [va, va+PTSIZE) is
+// unmapped as a side effect.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va >= UTOP, or va is not 4MB-aligned.
+//	-E_INVAL if perm is inappropriate (see sys_page_alloc).
+//	-E_NO_MEM if there are no 4MB of free contiguous memory.
+static int
+sys_page_alloc_large(envid_t envid, void *va, int perm)
+{
+	struct PageInfo *pp;
+	struct Env *e;
+	int r;
+
+	if ((uintptr_t)va >= UTOP || (uintptr_t)va % PTSIZE)
+		return -E_INVAL;
+
+	if ((perm & (PTE_U | PTE_P)) != (PTE_U | PTE_P))
+		return -E_INVAL;
+
+	if (perm & ~PTE_SYSCALL)
+		return -E_INVAL;
+
+	if (!(pp = page_alloc_order(PAGE_LARGE_ORDER, ALLOC_ZERO)))
+		return -E_NO_MEM;
+
+	if ((r = envid2env_vm(envid, &e, 1)) < 0) {
+		page_free_order(pp, PAGE_LARGE_ORDER);
+		return r;
+	}
+	page_insert_large(e->env_pgdir, pp, va, perm);
+	env_vm_unlock(e);
+	return 0;
+}
+
+// Look up two envs like envid2env (checking permissions) and lock
+// both address spaces, checking that they are still the envs we
+// looked up once we hold the locks.
+static int
+envid2env_vm2(envid_t srcenvid, struct Env **src_store,
+	      envid_t dstenvid, struct Env **dst_store)
+{
+	struct Env *srce, *dste;
+	envid_t srcid, dstid;
+	int r;
+
+	if ((r = envid2env(srcenvid, &srce, 1)) < 0)
+		return r;
+	if ((r = envid2env(dstenvid, &dste, 1)) < 0)
+		return r;
+
+	srcid = srce->env_id;
+	dstid = dste->env_id;
+	env_vm_lock2(srce, dste);
+	if (srce->env_status == ENV_FREE || srce->env_id != srcid ||
+	    dste->env_status == ENV_FREE || dste->env_id != dstid) {
+		env_vm_unlock2(srce, dste);
+		return -E_BAD_ENV;
+	}
+	*src_store = srce;
+	*dst_store = dste;
+	return 0;
+}
+
+// The body of sys_page_map, once both envs are looked up and their
+// address spaces locked.
+static int
+page_map_locked(struct Env *srce, uintptr_t srcva,
+		struct Env *dste, uintptr_t dstva, int perm)
+{
+	pte_t *srcpte;
+	struct PageInfo *pp;
+	int r;
+
+	if ((srcva >= UTOP || srcva % PGSIZE) ||
+		(dstva >= UTOP || dstva % PGSIZE))
+		return -E_INVAL;
+			
+	if ((perm & (PTE_U | PTE_P)) != (PTE_U | PTE_P))
+		return -E_INVAL;
+		
+	if (perm & ~PTE_SYSCALL)
+		return -E_INVAL;
+
+	if (!(pp = page_lookup(srce->env_pgdir, (void *)srcva, &srcpte)))
+		return -E_INVAL;
+
+	if ((perm & PTE_W) && !(*srcpte & PTE_W))
+		return -E_INVAL;
+
+	if (*srcpte & PTE_PS) {
+		if (srcva % PTSIZE || dstva % PTSIZE)
+			return -E_INVAL;
+		page_insert_large(dste->env_pgdir, pp, (void *)dstva, perm);
+		return 0;
+	}
+
+	if ((r = page_insert(dste->env_pgdir, pp, (void *)dstva, perm)) < 0) {
+		if (debug)
+			cprintf("[%08x] in sys_page_map, page_insert %e\n", sys_getenvid(), r);
+		return r;
+	}
+	// Copy-on-write pages handed to another env are resolved by the
+	// kernel there, since it may have no pgfault handler of its own.
+	if ((perm & PTE_COW) && dste != srce)
+		dste->env_kcow = true;
+	return 0;
+}
+
 // Map the page of memory at 'srcva' in srcenvid's address space
 // at 'dstva' in dstenvid's address space with permission 'perm'.
 // Perm has the same restrictions as in sys_page_alloc, except
@@ -289,6 +506,8 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 //	-E_INVAL if perm is inappropriate (see sys_page_alloc).
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in srcenvid's
 //		address space.
+//	-E_INVAL if srcva is inside a 4MB page and srcva or dstva is not
+//		4MB-aligned.  A 4MB page is mapped whole, as a 4MB page.
 //	-E_NO_MEM if there's no memory to allocate any necessary page tables.
 static int
 sys_page_map(envid_t srcenvid, void *srcva,
@@ -302,42 +521,71 @@ sys_page_map(envid_t srcenvid, void *srcva,
 	//   check the current permissions on the page.
 
 	// LAB 4: Your code here.
-	if (((uintptr_t)srcva >= UTOP || (uintptr_t)srcva % PGSIZE) ||
-		((uintptr_t)dstva >= UTOP || (uintptr_t)dstva % PGSIZE))
-		return -E_INVAL;
-			
-	if ((perm & (PTE_U | PTE_P)) != (PTE_U | PTE_P))
-		return -E_INVAL;
-		
-	if (perm & ~PTE_SYSCALL)
-		return -E_INVAL;
-
 	struct Env *srce;
 	struct Env *dste;
-	int r = envid2env(srcenvid, &srce, 1);
-	if (r < 0)
-		return r;
+	int r;
 
-	r = envid2env(dstenvid, &dste, 1);
-	if (r < 0)
+	if ((r = envid2env_vm2(srcenvid, &srce, dstenvid, &dste)) < 0)
 		return r;
+	r = page_map_locked(srce, (uintptr_t)srcva, dste, (uintptr_t)dstva, perm);
+	env_vm_unlock2(srce, dste);
+	return r;
+}
 
-	pte_t *srcpte;
-	struct PageInfo *pp = page_lookup(srce->env_pgdir, srcva, &srcpte);
-	if (!pp)
-		return -E_INVAL;
+// Apply n mapping ranges from srcenvid's address space to dstenvid's
+// in a single system call.  Range i maps ranges[i].pm_npages pages
+// starting at pm_srcva to consecutive pages starting at pm_dstva, with
+// permission pm_perm.  Every page is checked as in sys_page_map.  The
+// ranges are applied in order; on error the mappings made so far stay.
+// Both envs' VM locks are held throughout, so a call maps at most
+// PAGEMAP_MAXPAGES pages.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if n is negative or ranges is not readable by the caller.
+//	-E_INVAL if a range runs past UTOP.
+//	-E_INVAL if the ranges add up to more than PAGEMAP_MAXPAGES pages,
+//		for the first range that goes over.
+//	Any error of sys_page_map, for the first page it applies to.
+static int
+sys_page_map_batch(envid_t srcenvid, envid_t dstenvid,
+		   const struct PageMapRange *ranges, int n)
+{
+	struct PageMapRange pm;
+	struct Env *srce;
+	struct Env *dste;
+	size_t j, npages = 0;
+	int i, r;
 
-	if ((perm & PTE_W) && !(*srcpte & PTE_W))
+	if (n < 0 || n > PTSIZE / sizeof(*ranges))
+		return -E_INVAL;
+	if (user_mem_check(curenv, ranges, n * sizeof(*ranges), PTE_U) < 0)
 		return -E_INVAL;
 
-	r = page_insert(dste->env_pgdir, pp, dstva, perm);
-	if (r < 0) {
-		if (debug)
-			cprintf("[%08x] in sys_page_map, page_insert %e\n", sys_getenvid(), r);
+	if ((r = envid2env_vm2(srcenvid, &srce, dstenvid, &dste)) < 0)
 		return r;
+
+	// One TLB shootdown for all the mappings we replace.
+	tlb_batch_begin(dste->env_pgdir);
+	for (i = 0; i < n && r == 0; i++) {
+		// a copy, so the caller can't change it under us
+		pm = ranges[i];
+		if (pm.pm_srcva >= UTOP || pm.pm_dstva >= UTOP ||
+		    pm.pm_npages > (UTOP - pm.pm_srcva) / PGSIZE ||
+		    pm.pm_npages > (UTOP - pm.pm_dstva) / PGSIZE ||
+		    pm.pm_npages > PAGEMAP_MAXPAGES - npages) {
+			r = -E_INVAL;
+			break;
+		}
+		npages += pm.pm_npages;
+		for (j = 0; j < pm.pm_npages && r == 0; j++)
+			r = page_map_locked(srce, pm.pm_srcva + j * PGSIZE,
+					    dste, pm.pm_dstva + j * PGSIZE,
+					    pm.pm_perm);
 	}
-		
-	return 0;
+	tlb_batch_end();
+
+	env_vm_unlock2(srce, dste);
+	return r;
 }
 
 // Unmap the page of memory at 'va' in the address space of 'envid'.
@@ -358,11 +606,24 @@ sys_page_unmap(envid_t envid, void *va)
 		return -E_INVAL;
 	
 	struct Env *e;
-	int r = envid2env(envid, &e, 1);
+	pte_t *pte;
+	physaddr_t pa = 0;
+	int r = envid2env_vm(envid, &e, 1);
 	if (r < 0)
 		return r;
 	
+	if ((pte = pgdir_walk(e->env_pgdir, va, 0)) && (*pte & PTE_P) &&
+	    !(*pte & PTE_PS))
+		pa = PTE_ADDR(*pte);
 	page_remove(e->env_pgdir, va);
+	env_vm_unlock(e);
+
+	// Envs sleeping on the page may be waiting for it to go away.
+	if (pa) {
+		spin_lock(&env_lock);
+		futex_wake_page(pa);
+		spin_unlock(&env_lock);
+	}
 		
 	return 0;
 }
@@ -403,23 +664,108 @@ sys_page_unmap(envid_t envid, void *va)
 //		address space.
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in the
 //		current environment's address space.
+//	-E_INVAL if srcva is inside a 4MB page.
 //	-E_NO_MEM if there's not enough memory to map srcva in envid's
 //		address space.
+static int ipc_page(void *srcva, struct IpcRange *range);
+static int ipc_check_send(const struct IpcRange *ranges, int nranges,
+			  unsigned perm);
+static int ipc_send_recv(envid_t envid, uint32_t value, const uint32_t *words,
+			 const struct IpcRange *ranges, int nranges,
+			 unsigned perm, void *dstva, size_t dstnpages);
+static int ipc_deliver(struct Env *src, struct Env *dst, uint32_t value,
+		       const uint32_t *words, const struct IpcRange *ranges,
+		       int nranges, unsigned perm);
+static int ipc_block_send(struct Env *trgt, uint32_t value,
+			  const uint32_t *words, const struct IpcRange *ranges,
+			  int nranges, unsigned perm, bool recv);
+
 static int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 {
 	// LAB 4: Your code here.
 	struct Env *trgt_e;
-	int r = envid2env(envid, &trgt_e, 0);
-	if (r < 0)
+	struct IpcRange pg;
+	int n, r;
+
+	n = ipc_page(srcva, &pg);
+	if ((r = ipc_check_send(&pg, n, perm)) < 0)
 		return r;
-		
-	if (!trgt_e->env_ipc_recving)
-		return -E_IPC_NOT_RECV;
-	
-	trgt_e->env_ipc_perm = 0;
-	if ((uintptr_t)srcva < UTOP) {
-		if ((uintptr_t)srcva % PGSIZE != 0)
+
+	// env_lock keeps the receiver from being freed or woken by
+	// another sender while we deliver.
+	spin_lock(&env_lock);
+	if ((r = envid2env(envid, &trgt_e, 0)) == 0 &&
+	    (r = ipc_deliver(curenv, trgt_e, value, NULL, &pg, n, perm)) == 0) {
+		trgt_e->env_status = ENV_RUNNABLE;
+		sched_enqueue(trgt_e);
+	}
+	spin_unlock(&env_lock);
+	return r;
+}
+
+// Send to 'envid' like sys_ipc_try_send, but if the target is not
+// receiving, block until it is instead of failing with -E_IPC_NOT_RECV.
+// Blocked senders queue up on the target and are delivered in FIFO
+// order, one for each sys_ipc_recv the target makes.
+//
+// This function only returns on errors found before blocking.  Returns
+// 0 once the message is delivered, < 0 on error.  Errors are those of
+// sys_ipc_try_send, except that -E_IPC_NOT_RECV is only returned for a
+// send to oneself, and errors found when the target finally receives
+// (e.g. srcva was unmapped in the meantime) are returned then.
+// -E_BAD_ENV is also returned if the target exits before receiving,
+// and -E_IPC_NOT_RECV if sys_env_set_status wakes the sender first.
+static int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+{
+	struct Env *trgt_e;
+	struct IpcRange pg;
+	int n, r;
+
+	n = ipc_page(srcva, &pg);
+	if ((r = ipc_check_send(&pg, n, perm)) < 0)
+		return r;
+
+	spin_lock(&env_lock);
+	if ((r = envid2env(envid, &trgt_e, 0)) < 0)
+		goto out;
+	r = ipc_deliver(curenv, trgt_e, value, NULL, &pg, n, perm);
+	if (r == 0) {
+		trgt_e->env_status = ENV_RUNNABLE;
+		sched_enqueue(trgt_e);
+	} else if (r == -E_IPC_NOT_RECV) {
+		if ((r = ipc_block_send(trgt_e, value, NULL, &pg, n, perm, false)) == 0) {
+			spin_unlock(&env_lock);
+			sched_yield();
+		}
+	}
+out:
+	spin_unlock(&env_lock);
+	return r;
+}
+
+// Describe the single page of a classic IPC send at srcva as a run in
+// *range.  Returns the number of runs: 0 if srcva >= UTOP (no page).
+static int
+ipc_page(void *srcva, struct IpcRange *range)
+{
+	range->ir_va = (uintptr_t) srcva;
+	range->ir_npages = 1;
+	return (uintptr_t) srcva < UTOP;
+}
+
+// Check the page runs and perm arguments of an IPC send.
+static int
+ipc_check_send(const struct IpcRange *ranges, int nranges, unsigned perm)
+{
+	int i;
+
+	if (nranges < 0 || nranges > IPC_MAXRANGES)
+		return -E_INVAL;
+	for (i = 0; i < nranges; i++) {
+		if (ranges[i].ir_va >= UTOP || ranges[i].ir_va % PGSIZE != 0 ||
+		    ranges[i].ir_npages > (UTOP - ranges[i].ir_va) / PGSIZE)
 			return -E_INVAL;
 		
 		if ((perm & (PTE_U | PTE_P)) != (PTE_U | PTE_P))
@@ -427,69 +773,490 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 			
 		if (perm & ~PTE_SYSCALL)
 			return -E_INVAL;
-		
-		pte_t *pte;
-		struct PageInfo *pp = page_lookup(curenv->env_pgdir, srcva, &pte);
-		if (!pp) //srcva is not mapped
-			return -E_INVAL;
-		
-		unsigned cur_perm = PGOFF(*pte);
-		if ((perm & PTE_W) && !(cur_perm & PTE_W))
-			return -E_INVAL;
-		
-		if((uintptr_t)trgt_e->env_ipc_dstva < UTOP) {
-			//cprintf("%s %d: from %d to %d, with value %d, inserting srcva = %p to dstva = %p\n",__FILE__, __LINE__, ENVX(curenv->env_id), ENVX(trgt_e->env_id), value, srcva, trgt_e->env_ipc_dstva);
-			if ((r = page_insert(trgt_e->env_pgdir, pp, 
-					trgt_e->env_ipc_dstva, perm)) < 0) {
-					if (debug)
-						cprintf("[%08x] in sys_ipc_try_send, page_insert %e\n", sys_getenvid(), r);
-				return -E_NO_MEM;
+	}
+	return 0;
+}
+
+// Map the pages of the runs in src's address space at dst's receive
+// window, one after the other.  The runs must fit in the window, which
+// is checked first, and every page is checked before any is mapped.
+// If dst doesn't want pages, nothing is mapped, but the pages must
+// still be valid.  If mapping fails partway, the pages mapped so far
+// are unmapped again.  The caller holds both envs' VM locks.
+static int
+ipc_map_pages(struct Env *src, struct Env *dst, const struct IpcRange *ranges,
+	      int nranges, unsigned perm, size_t *npages_store)
+{
+	struct PageInfo *pp;
+	pte_t *pte;
+	uintptr_t va, dstva;
+	size_t j, npages = 0;
+	int i, r = 0;
+
+	// Each run is below UTOP, so this can't overflow.
+	for (i = 0; i < nranges; i++)
+		npages += ranges[i].ir_npages;
+	if ((uintptr_t)dst->env_ipc_dstva < UTOP &&
+	    npages > dst->env_ipc_dstnpages)
+		return -E_INVAL;
+
+	for (i = 0; i < nranges; i++)
+		for (j = 0; j < ranges[i].ir_npages; j++) {
+			va = ranges[i].ir_va + j * PGSIZE;
+			if (!(pp = page_lookup(src->env_pgdir, (void *) va, &pte)) ||
+			    !(*pte & PTE_P))
+				return -E_INVAL;	//va is not mapped
+			if (*pte & PTE_PS)
+				return -E_INVAL;	//4MB pages can't be sent
+			if ((perm & PTE_W) && !(PGOFF(*pte) & PTE_W))
+				return -E_INVAL;
+		}
+	*npages_store = 0;
+	if ((uintptr_t)dst->env_ipc_dstva >= UTOP || npages == 0)
+		return 0;
+
+	// One TLB shootdown for all the mappings we replace.
+	tlb_batch_begin(dst->env_pgdir);
+	dstva = (uintptr_t) dst->env_ipc_dstva;
+	for (i = 0; i < nranges && r == 0; i++)
+		for (j = 0; j < ranges[i].ir_npages && r == 0; j++) {
+			pp = page_lookup(src->env_pgdir,
+					 (void *) (ranges[i].ir_va + j * PGSIZE), NULL);
+			if ((r = page_insert(dst->env_pgdir, pp, (void *) dstva, perm)) < 0) {
+				if (debug)
+					cprintf("[%08x] in ipc_map_pages, page_insert %e\n", sys_getenvid(), r);
+				r = -E_NO_MEM;
+				break;
 			}
-			
-			trgt_e->env_ipc_perm = perm;
+			dstva += PGSIZE;
 		}
-	}
-	
+	if (r < 0)
+		for (va = (uintptr_t) dst->env_ipc_dstva; va < dstva; va += PGSIZE)
+			page_remove(dst->env_pgdir, (void *) va);
+	tlb_batch_end();
+	if (r < 0)
+		return r;
+	*npages_store = npages;
+	return 0;
+}
+
+// Deliver an IPC from src to dst, which must be receiving.  'words'
+// holds the IPC_NWORDS extra words of the message, or is NULL if they
+// are all zero.  The pages of the 'nranges' runs in 'ranges' are mapped
+// at dst's receive window with 'perm'.  dst is left ENV_NOT_RUNNABLE for
+// the caller to wake.  The caller holds env_lock.
+static int
+ipc_deliver(struct Env *src, struct Env *dst, uint32_t value,
+	    const uint32_t *words, const struct IpcRange *ranges, int nranges,
+	    unsigned perm)
+{
+	int r = 0;
+
+	if (!dst->env_ipc_recving || dst->env_status == ENV_DYING)
+		return -E_IPC_NOT_RECV;
 	
-	trgt_e->env_ipc_from = curenv->env_id;
-	trgt_e->env_ipc_value = value;
+	dst->env_ipc_perm = 0;
+	dst->env_ipc_npages = 0;
+	if (nranges > 0) {
+		env_vm_lock2(src, dst);
+		r = ipc_map_pages(src, dst, ranges, nranges, perm,
+				  &dst->env_ipc_npages);
+		env_vm_unlock2(src, dst);
+		if (r < 0)
+			return r;
+		if (dst->env_ipc_npages > 0) {
+			dst->env_ipc_perm = perm;
+			// as in page_map_locked
+			if (perm & PTE_COW)
+				dst->env_kcow = true;
+		}
+	}
 	
-	trgt_e->env_tf.tf_regs.reg_eax = 0;
-	trgt_e->env_ipc_recving = false;
-	trgt_e->env_status = ENV_RUNNABLE;
+	dst->env_ipc_from = src->env_id;
+	dst->env_ipc_value = value;
+	if (words)
+		memcpy(dst->env_ipc_words, words, sizeof(dst->env_ipc_words));
+	else
+		memset(dst->env_ipc_words, 0, sizeof(dst->env_ipc_words));
 	
+	dst->env_tf.tf_regs.reg_eax = 0;
+	dst->env_ipc_recving = false;
 	return 0;
 }
 
+// Block curenv sending to trgt, which is not receiving.  If 'recv',
+// curenv starts receiving at its env_ipc_dstva once the message is
+// delivered.  The caller holds env_lock, and must release it and call
+// sched_yield if this returns 0.
+static int
+ipc_block_send(struct Env *trgt, uint32_t value, const uint32_t *words,
+	       const struct IpcRange *ranges, int nranges, unsigned perm,
+	       bool recv)
+{
+	// Nobody would ever receive it.
+	if (trgt == curenv)
+		return -E_IPC_NOT_RECV;
+	if (trgt->env_status == ENV_DYING)
+		return -E_BAD_ENV;
+	// Don't let a concurrent env_destroy's ENV_DYING be overwritten.
+	if (curenv->env_status != ENV_RUNNING)
+		return 0;
+
+	curenv->env_ipc_send_value = value;
+	if (words)
+		memcpy(curenv->env_ipc_send_words, words,
+		       sizeof(curenv->env_ipc_send_words));
+	else
+		memset(curenv->env_ipc_send_words, 0,
+		       sizeof(curenv->env_ipc_send_words));
+	memcpy(curenv->env_ipc_send_ranges, ranges, nranges * sizeof(*ranges));
+	curenv->env_ipc_send_nranges = nranges;
+	curenv->env_ipc_send_perm = perm;
+	curenv->env_ipc_send_recv = recv;
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	env_ipc_waitq_push(trgt, curenv);
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	return 0;
+}
+
+// Give e, which has just started receiving, the message of the first
+// env blocked sending to it, and wake that sender.  Senders whose
+// message can no longer be delivered are woken with the error and
+// skipped.  Returns true if e got a message.
+// The caller holds env_lock.
+static bool
+ipc_recv_queued(struct Env *e)
+{
+	struct Env *s;
+	int r;
+
+	while ((s = env_ipc_waitq_pop(e)) != NULL) {
+		r = ipc_deliver(s, e, s->env_ipc_send_value,
+				s->env_ipc_send_words, s->env_ipc_send_ranges,
+				s->env_ipc_send_nranges, s->env_ipc_send_perm);
+		if (r == 0 && s->env_ipc_send_recv) {
+			// The sender now waits for the answer.
+			s->env_ipc_recving = true;
+			return true;
+		}
+		s->env_tf.tf_regs.reg_eax = r;
+		s->env_status = ENV_RUNNABLE;
+		sched_enqueue(s);
+		if (r == 0)
+			return true;
+	}
+	return false;
+}
+
+// Send to 'envid' as sys_ipc_send does and, in the same call, start
+// receiving at 'dstva' as sys_ipc_recv does.  This is both the call of
+// a client and the reply-and-wait of a server.
+//
+// If the target is receiving it is not queued: it is switched to
+// directly on this CPU and runs on the rest of the caller's time
+// slice, so a round trip costs no trips through the scheduler.
+// Otherwise the caller blocks until the target receives.
+//
+// This function only returns on error, without blocking; the system
+// call returns 0 once the caller has received a message.  Errors are
+// those of sys_ipc_send, and -E_INVAL if dstva < UTOP but is not
+// page-aligned.
+static int
+sys_ipc_send_recv(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+		  void *dstva)
+{
+	struct IpcRange pg;
+	int n;
+
+	n = ipc_page(srcva, &pg);
+	return ipc_send_recv(envid, value, NULL, &pg, n, perm, dstva, 1);
+}
+
+// Like sys_ipc_send_recv, but send IPC_NWORDS extra words, passed in
+// registers, instead of a page, and receive without a page.  The reply
+// comes with its own words in env_ipc_words, like any message.
+static int
+sys_ipc_call_words(envid_t envid, uint32_t value, uint32_t w0, uint32_t w1,
+		   uint32_t w2)
+{
+	uint32_t words[IPC_NWORDS] = { w0, w1, w2 };
+
+	static_assert(IPC_NWORDS == 3);
+	return ipc_send_recv(envid, value, words, NULL, 0, 0,
+			     (void *) UTOP, 0);
+}
+
+// Like sys_ipc_send_recv, but send the pages of up to IPC_MAXRANGES
+// runs, and receive up to sg->sg_dstnpages pages at sg->sg_dstva, as
+// described by *sg.  The runs' pages land one after the other in the
+// receiver's window, which must be large enough for all of them.
+// The number of pages received is left in env_ipc_npages.
+//
+// Errors are those of sys_ipc_send_recv, and -E_INVAL if sg is not
+// readable, has too many runs, a run is not page-aligned or runs past
+// UTOP, or the window runs past UTOP.  Delivery fails with -E_INVAL if
+// the pages don't fit the receiver's window.
+static int
+sys_ipc_send_recv_sg(envid_t envid, uint32_t value, const struct IpcSg *usg)
+{
+	struct IpcSg sg;
+
+	if (user_mem_check(curenv, usg, sizeof(*usg), PTE_U) < 0)
+		return -E_INVAL;
+	sg = *usg;
+	if (sg.sg_dstva < UTOP &&
+	    sg.sg_dstnpages > (UTOP - sg.sg_dstva) / PGSIZE)
+		return -E_INVAL;
+	return ipc_send_recv(envid, value, NULL, sg.sg_send, sg.sg_nsend,
+			     sg.sg_perm, (void *) sg.sg_dstva, sg.sg_dstnpages);
+}
+
+// The common part of sys_ipc_send_recv, sys_ipc_call_words and
+// sys_ipc_send_recv_sg.
+static int
+ipc_send_recv(envid_t envid, uint32_t value, const uint32_t *words,
+	      const struct IpcRange *ranges, int nranges, unsigned perm,
+	      void *dstva, size_t dstnpages)
+{
+	struct Env *trgt_e;
+	int r;
+
+	if ((uintptr_t)dstva < UTOP && (uintptr_t)dstva % PGSIZE != 0)
+		return -E_INVAL;
+	if ((r = ipc_check_send(ranges, nranges, perm)) < 0)
+		return r;
+
+	spin_lock(&env_lock);
+	if ((r = envid2env(envid, &trgt_e, 0)) < 0)
+		goto out;
+	curenv->env_ipc_dstva = dstva;
+	curenv->env_ipc_dstnpages = dstnpages;
+	r = ipc_deliver(curenv, trgt_e, value, words, ranges, nranges, perm);
+	if (r == -E_IPC_NOT_RECV) {
+		if ((r = ipc_block_send(trgt_e, value, words, ranges, nranges, perm, true)) == 0) {
+			spin_unlock(&env_lock);
+			sched_yield();
+		}
+	}
+	if (r < 0)
+		goto out;
+
+	// We are receiving before anyone can take env_lock to answer.
+	// If a message is already waiting we stay runnable, and env_run
+	// queues us again.
+	if (curenv->env_status == ENV_RUNNING) {
+		curenv->env_ipc_recving = true;
+		curenv->env_tf.tf_regs.reg_eax = 0;
+		if (!ipc_recv_queued(curenv))
+			curenv->env_status = ENV_NOT_RUNNABLE;
+	}
+
+	sched_donate(curenv, trgt_e);
+	trgt_e->env_status = ENV_RUNNING;
+	trgt_e->env_cpunum = cpunum();
+	spin_unlock(&env_lock);
+
+	env_run(trgt_e);
+
+out:
+	spin_unlock(&env_lock);
+	return r;
+}
+
 // Block until a value is ready.  Record that you want to receive
 // using the env_ipc_recving and env_ipc_dstva fields of struct Env,
 // mark yourself not runnable, and then give up the CPU.
 //
 // If 'dstva' is < UTOP, then you are willing to receive a page of data.
 // 'dstva' is the virtual address at which the sent page should be mapped.
+// 'dstnpages' is the number of pages there is room for at dstva, for
+// messages with more than one page (see sys_ipc_send_recv_sg).
 //
 // This function only returns on error, but the system call will eventually
 // return 0 on success.
 // Return < 0 on error.  Errors are:
-//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned, or
+//		the dstnpages pages at dstva run past UTOP.
 static int
-sys_ipc_recv(void *dstva)
+sys_ipc_recv(void *dstva, size_t dstnpages)
 {
 	// LAB 4: Your code here.
 	if (((uintptr_t)dstva < UTOP) && 
-		((uintptr_t)dstva % PGSIZE != 0))
+		((uintptr_t)dstva % PGSIZE != 0 ||
+		 dstnpages > (UTOP - (uintptr_t)dstva) / PGSIZE))
 		return -E_INVAL;
 	
-	curenv->env_status = ENV_NOT_RUNNABLE;
-	curenv->env_ipc_recving = true;
-	curenv->env_ipc_dstva = dstva; 
-	curenv->env_tf.tf_regs.reg_eax = 0;
+	spin_lock(&env_lock);
+	// Don't let a concurrent env_destroy's ENV_DYING be overwritten.
+	if (curenv->env_status == ENV_RUNNING) {
+		curenv->env_ipc_recving = true;
+		curenv->env_ipc_dstva = dstva; 
+		curenv->env_ipc_dstnpages = dstnpages;
+		curenv->env_tf.tf_regs.reg_eax = 0;
+		// Take the message of a blocked sender without blocking.
+		if (ipc_recv_queued(curenv)) {
+			spin_unlock(&env_lock);
+			return 0;
+		}
+		// Envs waiting for requests (servers, shells) should get
+		// the CPU back quickly once a message arrives.
+		sched_boost(curenv);
+		curenv->env_status = ENV_NOT_RUNNABLE;
+	}
+	spin_unlock(&env_lock);
 	
 	sched_yield();
 	
 	return 0;
 }
 
+// Sleep until another env calls sys_futex_wake on the word at 'addr',
+// provided that it still holds 'expected'.  Checking the word and going
+// to sleep are atomic with respect to sys_futex_wake, so a waker that
+// changes the word and then wakes cannot be missed.  The word is
+// identified by its physical address, so envs sharing a page can use
+// it at different virtual addresses.
+//
+// If 'timeout' is nonzero, wake up after that many timer ticks at most.
+// Waiters also wake up, spuriously, when any env unmaps the page.
+//
+// This function only returns on error or if '*addr' != 'expected';
+// the system call returns 0 after waking up.  Callers recheck their
+// condition in any case.
+// Errors are:
+//	-E_INVAL if addr is not word-aligned or not mapped user-readable.
+static int
+sys_futex_wait(uint32_t *addr, uint32_t expected, unsigned timeout)
+{
+	physaddr_t key;
+	int r;
+
+	spin_lock(&env_lock);
+	if ((r = futex_key(curenv, addr, &key)) < 0)
+		goto out;
+	if (*(uint32_t *) KADDR(key) != expected)
+		goto out;
+	// Don't let a concurrent env_destroy's ENV_DYING be overwritten.
+	if (curenv->env_status == ENV_RUNNING) {
+		curenv->env_tf.tf_regs.reg_eax = 0;
+		futex_park(curenv, key, timeout);
+		curenv->env_status = ENV_NOT_RUNNABLE;
+	}
+	spin_unlock(&env_lock);
+
+	sched_yield();
+
+out:
+	spin_unlock(&env_lock);
+	return r;
+}
+
+// Wake up to 'n' envs sleeping in sys_futex_wait on the word at
+// 'addr', oldest first.
+// Returns the number of envs woken, < 0 on error.  Errors are:
+//	-E_INVAL if addr is not word-aligned or not mapped user-readable.
+static int
+sys_futex_wake(uint32_t *addr, int n)
+{
+	physaddr_t key;
+	int r;
+
+	spin_lock(&env_lock);
+	if ((r = futex_key(curenv, addr, &key)) == 0)
+		r = futex_wake(key, n);
+	spin_unlock(&env_lock);
+	return r;
+}
+
+// Sleep until there is console input for sys_cgetc, or return at once
+// if there already is.  Returns 0.
+static int
+sys_cons_wait(void)
+{
+	spin_lock(&env_lock);
+	if (!cons_ready() && curenv->env_status == ENV_RUNNING) {
+		curenv->env_tf.tf_regs.reg_eax = 0;
+		futex_park(curenv, FUTEX_KEY_CONS, 0);
+		curenv->env_status = ENV_NOT_RUNNABLE;
+		spin_unlock(&env_lock);
+		sched_yield();
+	}
+	spin_unlock(&env_lock);
+	return 0;
+}
+
+// Ring the doorbell of env 'envid'.  If it is blocked in
+// sys_doorbell_wait, wake it up; otherwise the ring is remembered and
+// its next sys_doorbell_wait returns at once.  Rings are not counted.
+// This lets envs sharing memory sleep until there is work, without a
+// wake-up getting lost between checking for work and going to sleep.
+//
+// An env may ring its own doorbell, its parent's and its children's,
+// and that of any env that named it with sys_doorbell_peer.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller may not ring its doorbell.
+static int
+sys_doorbell_ring(envid_t envid)
+{
+	struct Env *e;
+	int r;
+
+	spin_lock(&env_lock);
+	if ((r = envid2env(envid, &e, 0)) < 0)
+		goto out;
+	if (e != curenv && e->env_parent_id != curenv->env_id &&
+	    e->env_id != curenv->env_parent_id &&
+	    e->env_doorbell_peer != curenv->env_id) {
+		r = -E_BAD_ENV;
+		goto out;
+	}
+	if (e->env_doorbell_waiting && e->env_status == ENV_NOT_RUNNABLE) {
+		e->env_doorbell_waiting = false;
+		e->env_status = ENV_RUNNABLE;
+		sched_enqueue(e);
+	} else
+		e->env_doorbell_pending = true;
+out:
+	spin_unlock(&env_lock);
+	return r;
+}
+
+// Block until our doorbell rings, or return at once if it rang since
+// the last call.  Returns 0.
+static int
+sys_doorbell_wait(void)
+{
+	spin_lock(&env_lock);
+	if (curenv->env_doorbell_pending) {
+		curenv->env_doorbell_pending = false;
+		spin_unlock(&env_lock);
+		return 0;
+	}
+	// Don't let a concurrent env_destroy's ENV_DYING be overwritten.
+	if (curenv->env_status == ENV_RUNNING) {
+		curenv->env_doorbell_waiting = true;
+		curenv->env_tf.tf_regs.reg_eax = 0;
+		sched_boost(curenv);
+		curenv->env_status = ENV_NOT_RUNNABLE;
+	}
+	spin_unlock(&env_lock);
+
+	sched_yield();
+}
+
+// Let env 'envid' ring our doorbell, in place of the env named by the
+// last call; 0 names none.  The env need not exist yet.  Returns 0.
+static int
+sys_doorbell_peer(envid_t envid)
+{
+	spin_lock(&env_lock);
+	curenv->env_doorbell_peer = envid;
+	spin_unlock(&env_lock);
+	return 0;
+}
+
 //lab 4 challenge
 static int
 sys_set_prio(envid_t envid, unsigned prio) {
@@ -503,6 +1270,7 @@ sys_set_prio(envid_t envid, unsigned prio) {
 		return r;
 	
 	e->env_prio = prio;
+	sched_boost(e);
 	return 0;
 }
 
@@ -533,9 +1301,19 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	case SYS_page_alloc:
 		return sys_page_alloc((envid_t)a1, (void*)a2, (int)a3);
 	
+	case SYS_page_alloc_large:
+		return sys_page_alloc_large((envid_t)a1, (void*)a2, (int)a3);
+	
 	case SYS_page_map:
 		return sys_page_map((envid_t)a1, (void*)a2, (envid_t)a3, (void*)a4, (int)a5);
 	
+	case SYS_env_fork_cow:
+		return sys_env_fork_cow();
+	
+	case SYS_page_map_batch:
+		return sys_page_map_batch((envid_t)a1, (envid_t)a2, 
+				(const struct PageMapRange *)a3, (int)a4);
+	
 	case SYS_page_unmap:
 		return sys_page_unmap((envid_t)a1, (void*)a2);
 	
@@ -555,8 +1333,41 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	case SYS_ipc_try_send:
 		return sys_ipc_try_send((envid_t)a1, (uint32_t)a2, (void*)a3, (unsigned)a4);
 	
+	case SYS_ipc_send:
+		return sys_ipc_send((envid_t)a1, (uint32_t)a2, (void*)a3, 
+				(unsigned)a4);
+	
+	case SYS_ipc_send_recv:
+		return sys_ipc_send_recv((envid_t)a1, (uint32_t)a2, (void*)a3, 
+				(unsigned)a4, (void*)a5);
+
+	case SYS_ipc_send_recv_sg:
+		return sys_ipc_send_recv_sg((envid_t)a1, (uint32_t)a2,
+				(const struct IpcSg *)a3);
+	
+	case SYS_ipc_call_words:
+		return sys_ipc_call_words((envid_t)a1, a2, a3, a4, a5);
+	
+	case SYS_futex_wait:
+		return sys_futex_wait((uint32_t*)a1, a2, a3);
+	
+	case SYS_futex_wake:
+		return sys_futex_wake((uint32_t*)a1, (int)a2);
+	
+	case SYS_cons_wait:
+		return sys_cons_wait();
+	
+	case SYS_doorbell_ring:
+		return sys_doorbell_ring((envid_t)a1);
+	
+	case SYS_doorbell_wait:
+		return sys_doorbell_wait();
+	
+	case SYS_doorbell_peer:
+		return sys_doorbell_peer((envid_t)a1);
+	
 	case SYS_ipc_recv:
-		return sys_ipc_recv((void*)a1);
+		return sys_ipc_recv((void*)a1, (size_t)a2);
 	
 	case SYS_set_prio:
 		return sys_set_prio((envid_t)a1, (unsigned)a2);
@@ -13,6 +13,7 @@
 #include <kern/picirq.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/futex.h>
 
 #define debug 0
 
@@ -60,6 +61,8 @@ static const char *trapname(int trapno)
 		return excnames[trapno];
 	if (trapno == T_SYSCALL)
 		return "System call";
+	if (trapno == T_TLBFLUSH)
+		return "TLB shootdown";
 	if (trapno >= IRQ_OFFSET && trapno < IRQ_OFFSET + 16)
 		return "Hardware Interrupt";
 	return "(unknown trap)";
@@ -92,6 +95,7 @@ trap_init(void)
 	SETGATE(idt[T_SIMDERR], false, GD_KT, t_simderr, 0); 
 	
 	SETGATE(idt[T_SYSCALL], false, GD_KT, t_syscall, 3); 
+	SETGATE(idt[T_TLBFLUSH], false, GD_KT, t_tlbflush, 0);
 	SETGATE(idt[T_DEFAULT], false, GD_KT, t_default, 0); 
 	
 	/* IRQ */
@@ -209,6 +213,15 @@ print_regs(struct PushRegs *regs)
 	cprintf("  eax  0x%08x\n", regs->reg_eax);
 }
 
+// Wake the envs waiting for console input in sys_cons_wait.
+static void
+cons_wake(void)
+{
+	spin_lock(&env_lock);
+	futex_wake(FUTEX_KEY_CONS, NENV);
+	spin_unlock(&env_lock);
+}
+
 static void
 trap_dispatch(struct Trapframe *tf)
 {
@@ -239,6 +252,14 @@ trap_dispatch(struct Trapframe *tf)
 		return;
 	}
 
+	// Another CPU changed the mappings of an address space we have
+	// loaded and is waiting for us to flush them.
+	if (tf->tf_trapno == T_TLBFLUSH) {
+		lapic_eoi();
+		tlb_shootdown_poll();
+		return;
+	}
+
 	// Handle spurious interrupts
 	// The hardware sometimes raises these because of noise on the
 	// IRQ line or other reasons. We don't care.
@@ -253,7 +274,7 @@ trap_dispatch(struct Trapframe *tf)
 	// LAB 4: Your code here.
 	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER) {
 		lapic_eoi();
-		sched_yield();
+		sched_tick();
 		return;
 	}
 
@@ -262,12 +283,14 @@ trap_dispatch(struct Trapframe *tf)
 	if (tf->tf_trapno == IRQ_OFFSET + IRQ_KBD) {
 		lapic_eoi();
 		kbd_intr();
+		cons_wake();
 		return;
 	}
 	
 	if (tf->tf_trapno == IRQ_OFFSET + IRQ_SERIAL) {
 		lapic_eoi();
 		serial_intr();
+		cons_wake();
 		return;
 	}
 	
@@ -295,10 +318,8 @@ trap(struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
-	// Re-acqurie the big kernel lock if we were halted in
-	// sched_yield()
-	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
-		lock_kernel();
+	// We may have been halted in sched_yield()
+	xchg(&thiscpu->cpu_status, CPU_STARTED);
 	// Check that interrupts are disabled.  If this assertion
 	// fails, DO NOT be tempted to fix it by inserting a "cli" in
 	// the interrupt path.
@@ -314,18 +335,15 @@ trap(struct Trapframe *tf)
 
 	if ((tf->tf_cs & 3) == 3) {
 		// Trapped from user mode.
-		// Acquire the big kernel lock before doing any
-		// serious kernel work.
-		// LAB 4: Your code here.
-		
-		lock_kernel();
-		
+		// There is no big kernel lock; each subsystem takes
+		// its own lock.
 		assert(curenv);
 
 		// Garbage collect if current enviroment is a zombie
 		if (curenv->env_status == ENV_DYING) {
-			env_free(curenv);
-			curenv = NULL;
+			spin_lock(&env_lock);
+			env_switch(NULL);
+			spin_unlock(&env_lock);
 			sched_yield();
 		}
 
@@ -374,6 +392,21 @@ page_fault_handler(struct Trapframe *tf)
 	// We've already handled kernel-mode exceptions, so if we get here,
 	// the page fault happened in user mode.
 
+	// Envs forked with sys_env_fork_cow have their copy-on-write
+	// faults resolved here, without a trip through the upcall.
+	// So are everyone's faults on 4MB pages, which user space has no
+	// way to copy.
+	if ((curenv->env_kcow || (curenv->env_pgdir[PDX(fault_va)] & PTE_PS)) &&
+	    (tf->tf_err & FEC_WR)) {
+		int r;
+
+		env_vm_lock(curenv);
+		r = page_cow(curenv->env_pgdir, (void *) fault_va);
+		env_vm_unlock(curenv);
+		if (r == 0)
+			env_run(curenv);
+	}
+
 	// Call the environment's page fault upcall, if one exists.  Set up a
 	// page fault stack frame on the user exception stack (below
 	// UXSTACKTOP), then branch to curenv->env_pgfault_upcall.
@@ -40,6 +40,7 @@ void t_mchk();
 void t_simderr();
 
 void t_syscall();
+void t_tlbflush();
 void t_default();
 
 void irq_timer();
@@ -75,16 +75,21 @@ opencons(void)
 	return fd2num(fd);
 }
 
+#define CONS_SPIN	10	// polls before sleeping for input
+
 static ssize_t
 devcons_read(struct Fd *fd, void *vbuf, size_t n)
 {
-	int c;
+	int c, i;
 
 	if (n == 0)
 		return 0;
 
-	while ((c = sys_cgetc()) == 0)
-		sys_yield();
+	// Poll a few times in case input is coming in fast, then sleep
+	// until the keyboard or serial interrupt.
+	for (i = 0; (c = sys_cgetc()) == 0; i++)
+		if (i >= CONS_SPIN)
+			sys_cons_wait();
 	if (c < 0)
 		return c;
 	if (c == 0x04)	// ctl-d is eof
@@ -6,14 +6,17 @@
 #define MAXFD		32
 // Bottom of file descriptor area
 #define FDTABLE		0xD0000000
-// Bottom of file data area.  We reserve one data page for each FD,
-// which devices can use if they choose.
-#define FILEDATA	(FDTABLE + MAXFD*PGSIZE)
+// Bottom of file data area.  We reserve a page table's worth of data
+// pages for each FD, which devices can use if they choose.
+#define FILEDATA	(FDTABLE + PTSIZE)
 
 // Return the 'struct Fd*' for file descriptor index i
 #define INDEX2FD(i)	((struct Fd*) (FDTABLE + (i)*PGSIZE))
-// Return the file data page for file descriptor index i
-#define INDEX2DATA(i)	((char*) (FILEDATA + (i)*PGSIZE))
+// Page that splice() moves data through, just below the fd table
+#define SPLICEVA	(FDTABLE - PGSIZE)
+
+// Return the file data area for file descriptor index i
+#define INDEX2DATA(i)	((char*) (FILEDATA + (i)*PTSIZE))
 
 
 // --------------------------------------------------------------
@@ -175,6 +178,7 @@ int
 dup(int oldfdnum, int newfdnum)
 {
 	int r;
+	size_t i;
 	char *ova, *nva;
 	pte_t pte;
 	struct Fd *oldfd, *newfd;
@@ -187,9 +191,11 @@ dup(int oldfdnum, int newfdnum)
 	ova = fd2data(oldfd);
 	nva = fd2data(newfd);
 
-	if ((uvpd[PDX(ova)] & PTE_P) && (uvpt[PGNUM(ova)] & PTE_P))
-		if ((r = sys_page_map(0, ova, 0, nva, uvpt[PGNUM(ova)] & PTE_SYSCALL)) < 0)
-			goto err;
+	// a device may keep several pages of data (a pipe's ring)
+	if (uvpd[PDX(ova)] & PTE_P)
+		for (i = 0; i < PTSIZE && (uvpt[PGNUM(ova + i)] & PTE_P); i += PGSIZE)
+			if ((r = sys_page_map(0, ova + i, 0, nva + i, uvpt[PGNUM(ova + i)] & PTE_SYSCALL)) < 0)
+				goto err;
 	if ((r = sys_page_map(0, oldfd, 0, newfd, uvpt[PGNUM(oldfd)] & PTE_SYSCALL)) < 0)
 		goto err;
 
@@ -197,7 +203,8 @@ dup(int oldfdnum, int newfdnum)
 
 err:
 	sys_page_unmap(0, newfd);
-	sys_page_unmap(0, nva);
+	for (i = 0; i < PTSIZE; i += PGSIZE)
+		sys_page_unmap(0, nva + i);
 	return r;
 }
 
@@ -239,6 +246,113 @@ readn(int fdnum, void *buf, size_t n)
 	return tot;
 }
 
+// Read up to n bytes, at most a page, from fdnum into a page of its own
+// mapped at the page-aligned address va.  Devices with dev_read_page
+// (files) map their data there copy-on-write when the seek position is
+// page-aligned, instead of copying it; otherwise a fresh page is read
+// into.  Returns the number of bytes read, or < 0 on error.  Nothing
+// new is mapped at va unless the result is positive.
+ssize_t
+read_page(int fdnum, void *va, size_t n)
+{
+	int r;
+	struct Dev *dev;
+	struct Fd *fd;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0
+	    || (r = dev_lookup(fd->fd_dev_id, &dev)) < 0)
+		return r;
+	if ((fd->fd_omode & O_ACCMODE) == O_WRONLY) {
+		cprintf("[%08x] read_page %d -- bad mode\n", thisenv->env_id, fdnum);
+		return -E_INVAL;
+	}
+	n = MIN(n, PGSIZE);
+	if (dev->dev_read_page && fd->fd_offset % PGSIZE == 0)
+		return (*dev->dev_read_page)(fd, va, n);
+	if (!dev->dev_read)
+		return -E_NOT_SUPP;
+	if ((r = sys_page_alloc(0, va, PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+	if ((r = (*dev->dev_read)(fd, va, n)) <= 0)
+		sys_page_unmap(0, va);
+	return r;
+}
+
+// Map the pages holding up to n bytes of fdnum from offset at the
+// page-aligned address va, without moving the seek position.  Devices
+// with dev_read_map (files) map their data there without copying it
+// when offset is page-aligned: read-only, so that every mapping of a
+// file page shares one physical page, or copy-on-write if perm has
+// PTE_COW.  Otherwise the data is read into fresh pages.  Maps at most
+// FSMAXPAGES pages, and may map fewer than asked for.  Returns the
+// number of bytes mapped, or < 0 on error.
+ssize_t
+read_map(int fdnum, off_t offset, void *va, size_t n, int perm)
+{
+	int r;
+	size_t tot, m;
+	off_t saved;
+	char *pg;
+	struct Dev *dev;
+	struct Fd *fd;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0
+	    || (r = dev_lookup(fd->fd_dev_id, &dev)) < 0)
+		return r;
+	if ((fd->fd_omode & O_ACCMODE) == O_WRONLY) {
+		cprintf("[%08x] read_map %d -- bad mode\n", thisenv->env_id, fdnum);
+		return -E_INVAL;
+	}
+	if (dev->dev_read_map && offset % PGSIZE == 0)
+		return (*dev->dev_read_map)(fd, offset, va, n, perm);
+	if (!dev->dev_read)
+		return -E_NOT_SUPP;
+
+	// copy it a page at a time
+	n = MIN(n, FSMAXPAGES * PGSIZE);
+	saved = fd->fd_offset;
+	fd->fd_offset = offset;
+	for (tot = 0; tot < n; tot += r) {
+		pg = (char *) va + tot;
+		m = MIN(PGSIZE, n - tot);
+		if ((r = sys_page_alloc(0, pg, PTE_P|PTE_U|PTE_W)) < 0)
+			break;
+		if ((r = readn(fdnum, pg, m)) <= 0) {
+			sys_page_unmap(0, pg);
+			break;
+		}
+		if (r < m) {
+			tot += r;
+			break;
+		}
+	}
+	fd->fd_offset = saved;
+	return (tot == 0 && r < 0) ? r : (ssize_t) tot;
+}
+
+// Move up to n bytes from fdin to fdout a page at a time through
+// read_page, so file data goes straight from the file server's block
+// cache to fdout.  Stops early at end of input or if fdout stops
+// taking data.  Returns the number of bytes moved, or < 0 on error.
+ssize_t
+splice(int fdin, int fdout, size_t n)
+{
+	ssize_t m, w, r;
+	size_t tot;
+
+	for (tot = 0; tot < n; tot += m) {
+		if ((m = read_page(fdin, (void *) SPLICEVA, n - tot)) <= 0)
+			return (m < 0) ? m : (ssize_t) tot;
+		for (w = 0; w < m; w += r)
+			if ((r = write(fdout, (char *) SPLICEVA + w, m - w)) <= 0)
+				break;
+		sys_page_unmap(0, (void *) SPLICEVA);
+		if (w < m)
+			return (r < 0) ? r : (ssize_t) (tot + w);
+	}
+	return tot;
+}
+
 ssize_t
 write(int fdnum, const void *buf, size_t n)
 {
@@ -4,7 +4,12 @@
 
 #define debug 0
 
-union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
+// PRIVATE, so that threads make requests independently
+union Fsipc fsipcbuf PRIVATE __attribute__((aligned(PGSIZE)));
+static envid_t fsenv;
+
+// Where the FSMAXPAGES pages of a read reply are received
+#define FILEWINDOW	0xCF000000
 
 // Send an inter-environment request to the file server, and wait for
 // a reply.  The request body should be in fsipcbuf, and parts of the
@@ -15,7 +20,6 @@ union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 static int
 fsipc(unsigned type, void *dstva)
 {
-	static envid_t fsenv;
 	if (fsenv == 0)
 		fsenv = ipc_find_env(ENV_TYPE_FS);
 	
@@ -24,8 +28,52 @@ fsipc(unsigned type, void *dstva)
 	if (debug)
 		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
 	
-	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(NULL, dstva, NULL);
+	return ipc_call(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U,
+			NULL, dstva, NULL);
+}
+
+// Like fsipc, but for requests whose body fits in the first IPC_NWORDS
+// words of fsipcbuf and whose reply is just the return value.  The body
+// is sent in registers, so no page is mapped into the file server.
+static int
+fsipc_words(unsigned type)
+{
+	uint32_t words[IPC_NWORDS];
+
+	if (fsenv == 0)
+		fsenv = ipc_find_env(ENV_TYPE_FS);
+
+	if (debug)
+		cprintf("[%08x] fsipc_words %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
+
+	memcpy(words, &fsipcbuf, sizeof(words));
+	return ipc_call_words(fsenv, type, words, NULL);
+}
+
+// Like fsipc, but the pages to send, including fsipcbuf's, and the
+// window for the reply's pages are described by 'sg'.  The number of
+// pages received is stored in *npages_store.
+static int
+fsipc_sg(unsigned type, struct IpcSg *sg, size_t *npages_store)
+{
+	if (fsenv == 0)
+		fsenv = ipc_find_env(ENV_TYPE_FS);
+
+	if (debug)
+		cprintf("[%08x] fsipc_sg %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
+
+	return ipc_call_sg(fsenv, type, sg, NULL, npages_store);
+}
+
+// Are the npages pages from va all mapped as normal 4K pages?
+static bool
+pages_mapped(uintptr_t va, size_t npages)
+{
+	for (; npages > 0; npages--, va += PGSIZE)
+		if (!(uvpd[PDX(va)] & PTE_P) || (uvpd[PDX(va)] & PTE_PS) ||
+		    !(uvpt[PGNUM(va)] & PTE_P))
+			return false;
+	return true;
 }
 
 static int devfile_flush(struct Fd *fd);
@@ -33,6 +81,9 @@ static ssize_t devfile_read(struct Fd *fd, void *buf, size_t n);
 static ssize_t devfile_write(struct Fd *fd, const void *buf, size_t n);
 static int devfile_stat(struct Fd *fd, struct Stat *stat);
 static int devfile_trunc(struct Fd *fd, off_t newsize);
+static ssize_t devfile_read_page(struct Fd *fd, void *va, size_t n);
+static ssize_t devfile_read_map(struct Fd *fd, off_t offset, void *va,
+				size_t n, int perm);
 
 struct Dev devfile =
 {
@@ -42,7 +93,9 @@ struct Dev devfile =
 	.dev_close =	devfile_flush,
 	.dev_stat =	devfile_stat,
 	.dev_write =	devfile_write,
-	.dev_trunc =	devfile_trunc
+	.dev_trunc =	devfile_trunc,
+	.dev_read_page = devfile_read_page,
+	.dev_read_map =	devfile_read_map
 };
 
 // Open a file (or directory).
@@ -103,7 +156,7 @@ static int
 devfile_flush(struct Fd *fd)
 {
 	fsipcbuf.flush.req_fileid = fd->fd_file.id;
-	return fsipc(FSREQ_FLUSH, NULL);
+	return fsipc_words(FSREQ_FLUSH);
 }
 
 // Read at most 'n' bytes from 'fd' at the current position into 'buf'.
@@ -115,21 +168,76 @@ static ssize_t
 devfile_read(struct Fd *fd, void *buf, size_t n)
 {
 	// Make an FSREQ_READ request to the file system server after
-	// filling fsipcbuf.read with the request arguments.  The
-	// bytes read will be written back to fsipcbuf by the file
-	// system server.
+	// filling fsipcbuf.read with the request arguments.  A small
+	// read comes back in fsipcbuf.readRet.  For a larger one the
+	// server maps the cached blocks holding the bytes read at
+	// FILEWINDOW, up to FSMAXPAGES of them, so one request serves
+	// a large read.
+	struct IpcSg sg;
+	size_t i, npages, pgoff;
 	int r;
 
+	pgoff = fd->fd_offset % PGSIZE;
 	fsipcbuf.read.req_fileid = fd->fd_file.id;
 	fsipcbuf.read.req_n = n;
-	if ((r = fsipc(FSREQ_READ, NULL)) < 0)
-		return r;
-	assert(r <= n);
-	assert(r <= PGSIZE);
-	memmove(buf, fsipcbuf.readRet.ret_buf, r);
+	sg.sg_send[0].ir_va = (uintptr_t) &fsipcbuf;
+	sg.sg_send[0].ir_npages = 1;
+	sg.sg_nsend = 1;
+	sg.sg_perm = PTE_P | PTE_W | PTE_U;
+	sg.sg_dstva = FILEWINDOW;
+	sg.sg_dstnpages = FSMAXPAGES;
+	if ((r = fsipc_sg(FSREQ_READ, &sg, &npages)) > 0 && npages == 0) {
+		assert(r <= n && r <= FSREADINLINE);
+		memmove(buf, fsipcbuf.readRet.ret_buf, r);
+	} else if (r > 0) {
+		assert(r <= n);
+		assert(pgoff + r <= npages * PGSIZE);
+		memmove(buf, (char *) FILEWINDOW + pgoff, r);
+	}
+	for (i = 0; i < npages; i++)
+		sys_page_unmap(0, (char *) FILEWINDOW + i * PGSIZE);
 	return r;
 }
 
+// Map the block at the current (page-aligned) position at 'va',
+// copy-on-write, and advance past at most 'n' bytes of it.
+//
+// Returns:
+// 	The number of bytes of the page that belong to the read.
+// 	< 0 on error.
+static ssize_t
+devfile_read_page(struct Fd *fd, void *va, size_t n)
+{
+	fsipcbuf.read.req_fileid = fd->fd_file.id;
+	fsipcbuf.read.req_n = n;
+	return fsipc(FSREQ_READ_PAGE, va);
+}
+
+// Map the file server's cached blocks holding up to 'n' bytes of the
+// file from the page-aligned 'offset' at 'va', up to FSMAXPAGES pages,
+// read-only or, if 'perm' has PTE_COW, copy-on-write.
+//
+// Returns:
+// 	The number of bytes mapped.
+// 	< 0 on error.
+static ssize_t
+devfile_read_map(struct Fd *fd, off_t offset, void *va, size_t n, int perm)
+{
+	struct IpcSg sg;
+	size_t npages;
+
+	fsipcbuf.map.req_fileid = fd->fd_file.id;
+	fsipcbuf.map.req_offset = offset;
+	fsipcbuf.map.req_n = n;
+	fsipcbuf.map.req_perm = perm;
+	sg.sg_send[0].ir_va = (uintptr_t) &fsipcbuf;
+	sg.sg_send[0].ir_npages = 1;
+	sg.sg_nsend = 1;
+	sg.sg_perm = PTE_P | PTE_W | PTE_U;
+	sg.sg_dstva = (uintptr_t) va;
+	sg.sg_dstnpages = MIN(ROUNDUP(n, PGSIZE) / PGSIZE, FSMAXPAGES);
+	return fsipc_sg(FSREQ_MAP, &sg, &npages);
+}
 
 // Write at most 'n' bytes from 'buf' to 'fd' at the current seek position.
 //
@@ -139,23 +247,41 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 static ssize_t
 devfile_write(struct Fd *fd, const void *buf, size_t n)
 {
+	struct IpcSg sg;
+	uintptr_t va = ROUNDDOWN((uintptr_t) buf, PGSIZE);
+	size_t npages;
 	int r;
 	
-	// Make an FSREQ_WRITE request to the file system server.  Be
-	// careful: fsipcbuf.write.req_buf is only so large, but
-	// remember that write is always allowed to write *fewer*
-	// bytes than requested.
-	// LAB 5: Your code here
+	// Make an FSREQ_WRITE request to the file system server.
+	// Small writes are copied into fsipcbuf.write.req_buf.  Larger
+	// ones send the pages holding 'buf' along with the request,
+	// read-only, up to FSMAXPAGES of them; the server copies
+	// straight out of them.  Remember that write is always allowed
+	// to write *fewer* bytes than requested.
 	
 	fsipcbuf.write.req_fileid = fd->fd_file.id;
-	fsipcbuf.write.req_n = n;
-	
-	assert(n <= PGSIZE -(sizeof(int) + sizeof(size_t)));
-	size_t buf_capacity = sizeof(fsipcbuf.write.req_buf);
-	size_t req_n = (n > buf_capacity)? buf_capacity : n;
-	memmove(fsipcbuf.write.req_buf, buf, req_n);
+	fsipcbuf.write.req_pgoff = PGOFF(buf);
+	n = MIN(n, FSMAXPAGES * PGSIZE - PGOFF(buf));
+	npages = (PGOFF(buf) + n + PGSIZE - 1) / PGSIZE;
 	
-	if ((r = fsipc(FSREQ_WRITE, NULL)) < 0) {
+	if (n <= sizeof(fsipcbuf.write.req_buf) || !pages_mapped(va, npages)) {
+		n = MIN(n, sizeof(fsipcbuf.write.req_buf));
+		fsipcbuf.write.req_n = n;
+		memmove(fsipcbuf.write.req_buf, buf, n);
+		r = fsipc(FSREQ_WRITE, NULL);
+	} else {
+		fsipcbuf.write.req_n = n;
+		sg.sg_send[0].ir_va = (uintptr_t) &fsipcbuf;
+		sg.sg_send[0].ir_npages = 1;
+		sg.sg_send[1].ir_va = va;
+		sg.sg_send[1].ir_npages = npages;
+		sg.sg_nsend = 2;
+		sg.sg_perm = PTE_P | PTE_U;
+		sg.sg_dstva = UTOP;
+		sg.sg_dstnpages = 0;
+		r = fsipc_sg(FSREQ_WRITE, &sg, NULL);
+	}
+	if (r < 0) {
 		if (debug)
 			cprintf("[%08x] in devfile_write, fsipc %e\n", sys_getenvid(), r);
 		return r;
@@ -185,7 +311,7 @@ devfile_trunc(struct Fd *fd, off_t newsize)
 {
 	fsipcbuf.set_size.req_fileid = fd->fd_file.id;
 	fsipcbuf.set_size.req_size = newsize;
-	return fsipc(FSREQ_SET_SIZE, NULL);
+	return fsipc_words(FSREQ_SET_SIZE);
 }
 
 
@@ -196,6 +322,22 @@ sync(void)
 	// Ask the file server to update the disk
 	// by writing any dirty blocks in the buffer cache.
 
-	return fsipc(FSREQ_SYNC, NULL);
+	return fsipc_words(FSREQ_SYNC);
 }
 
+
+// Fetch the file server's block cache counters into *st.
+int
+bcstat(struct BcStat *st)
+{
+	int r;
+
+	// Other requests write fsipcbuf first, which gets us our own copy
+	// if it is still copy-on-write after a fork; the page must be
+	// writable to lend it to the server.
+	*(volatile char *) &fsipcbuf = *(volatile char *) &fsipcbuf;
+	if ((r = fsipc(FSREQ_BCSTAT, NULL)) < 0)
+		return r;
+	*st = fsipcbuf.bcstatRet;
+	return 0;
+}
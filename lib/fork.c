@@ -3,10 +3,6 @@
 #include <inc/lib.h>
 #include <inc/string.h>
 
-// PTE_COW marks copy-on-write page table entries.
-// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW		0x800
-
 extern void _pgfault_upcall();
 //
 // Custom page fault handler - if faulting page is copy-on-write,
@@ -59,6 +55,75 @@ pgfault(struct UTrapframe *utf)
 	
 }
 
+// duppage queues its mappings here and fork sends them to the kernel
+// with one sys_page_map_batch per list.  Adjacent pages with the same
+// permissions share a range.  A list holds at most NBATCH ranges and
+// PAGEMAP_MAXPAGES pages.  The lists are PRIVATE so that threads,
+// which share the rest of our memory, can fork at the same time.
+#define NBATCH	64
+
+struct MapBatch {
+	int n;
+	size_t npages;
+	struct PageMapRange r[NBATCH];
+};
+
+static struct MapBatch child_maps PRIVATE;	// our pages, mapped into the child
+static struct MapBatch self_maps PRIVATE;	// our pages, remapped copy-on-write
+
+static void
+batch_reset(void)
+{
+	child_maps.n = self_maps.n = 0;
+	child_maps.npages = self_maps.npages = 0;
+}
+
+// Is there room in both lists for another page?
+static bool
+batch_room(void)
+{
+	return child_maps.n < NBATCH && self_maps.n < NBATCH &&
+		child_maps.npages < PAGEMAP_MAXPAGES &&
+		self_maps.npages < PAGEMAP_MAXPAGES;
+}
+
+static void
+batch_add(struct MapBatch *b, uintptr_t va, int perm)
+{
+	struct PageMapRange *last;
+
+	b->npages++;
+	if (b->n > 0) {
+		last = &b->r[b->n - 1];
+		if (last->pm_perm == perm &&
+		    last->pm_srcva + last->pm_npages * PGSIZE == va) {
+			last->pm_npages++;
+			return;
+		}
+	}
+	b->r[b->n].pm_srcva = b->r[b->n].pm_dstva = va;
+	b->r[b->n].pm_npages = 1;
+	b->r[b->n].pm_perm = perm;
+	b->n++;
+}
+
+//
+// Apply the queued mappings.  The child's must go first: once a page
+// is copy-on-write for us, our next write to it moves us to a copy,
+// and the child would get that copy instead of the original.
+//
+static void
+batch_flush(envid_t envid)
+{
+	int r;
+
+	if ((r = sys_page_map_batch(0, envid, child_maps.r, child_maps.n)) < 0)
+		panic("duppage: failed to map pages into the child %e\n", r);
+	if ((r = sys_page_map_batch(0, 0, self_maps.r, self_maps.n)) < 0)
+		panic("duppage: failed to remap pages copy-on-write %e\n", r);
+	batch_reset();
+}
+
 //
 // Map our virtual page pn (address pn*PGSIZE) into the target envid
 // at the same virtual address.  If the page is writable or copy-on-write,
@@ -67,51 +132,33 @@ pgfault(struct UTrapframe *utf)
 // copy-on-write again if it was already copy-on-write at the beginning of
 // this function?)
 //
+// The mappings are only queued; call batch_flush to apply them.
+//
 // Returns: 0 on success, < 0 on error.
 // It is also OK to panic on error.
 //
 static int
 duppage(envid_t envid, unsigned pn)
 {
-	int r;
-	void *va = (void *)(pn * PGSIZE);
-	envid_t parent_envid = sys_getenvid();
+	uintptr_t va = pn * PGSIZE;
 	
 	// LAB 4: Your code here.
 	int perm = PGOFF(uvpt[pn]);
 	perm &= PTE_SYSCALL;
-	if ((perm & PTE_SHARE)) { // || (!(perm & PTE_W) && !(perm & PTE_COW))) {
-		r = sys_page_map(parent_envid, va, envid, va, perm);
-		if (r < 0) {
-			panic("duppage: failed to map a new page %e\n", r);
-			return r;
-		}
-		return 0;
-	}
-	
-	//perm &= ~PTE_W;
-	//perm |= PTE_COW;
+
+	// Make room for this page in both lists.
+	if (!batch_room())
+		batch_flush(envid);
+
+	if ((perm & PTE_SHARE))
+		batch_add(&child_maps, va, perm);
 	else if ((perm & PTE_COW) || (perm & PTE_W)) {
-		r = sys_page_map(parent_envid, va, envid, va, PTE_COW | PTE_U | PTE_P);
-		if (r < 0) {
-			panic("duppage: failed to map a new page %e\n", r);
-			return r;
-		}
-		
+		batch_add(&child_maps, va, PTE_COW | PTE_U | PTE_P);
 		//remap our page in the current env to be COW
-		r = sys_page_map(parent_envid, va, parent_envid, va, PTE_COW | PTE_U | PTE_P);
-		if (r < 0) {
-			panic("duppage: failed to map a page %e\n", r);
-			return r;
-		}
-	}
-	else {
-		r = sys_page_map(parent_envid, va, envid, va, PTE_U | PTE_P);
-		if (r < 0) {
-			panic("duppage: failed to map a new page %e\n", r);
-			return r;
-		}
+		batch_add(&self_maps, va, PTE_COW | PTE_U | PTE_P);
 	}
+	else
+		batch_add(&child_maps, va, PTE_U | PTE_P);
 	
 	return 0;
 }
@@ -156,14 +203,35 @@ fork(void)
 		}
 	}*/
 	cprintf("%s %d: [%08x] env %08x is running\n", __FILE__, __LINE__, sys_getenvid(), envid);
+	int r;
 	uint32_t addr;
+	// A forked child inherits whatever was queued when its copy of
+	// these lists was taken.
+	batch_reset();
 	for (addr = 0; addr < USTACKTOP; addr += PGSIZE) { 
+		// 4MB pages are copy-on-write too, mapped whole; the
+		// kernel copies them on the first write, since we can't
+		if ((uvpd[PDX(addr)] & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS)) {
+			int perm = uvpd[PDX(addr)] & PTE_SYSCALL;
+
+			if (!(perm & PTE_SHARE) && (perm & (PTE_W | PTE_COW)))
+				perm = (perm & ~PTE_W) | PTE_COW;
+			r = sys_page_map(0, (void*)addr, envid, (void*)addr, perm);
+			if (r < 0)
+				panic("fork: failed to map a 4MB page %e\n", r);
+			if ((perm & PTE_COW) &&
+			    (r = sys_page_map(0, (void*)addr, 0, (void*)addr, perm)) < 0)
+				panic("fork: failed to remap a 4MB page %e\n", r);
+			addr += PTSIZE - PGSIZE;
+			continue;
+		}
 		if ((uvpd[PDX(addr)] & PTE_P) && (uvpt[PGNUM(addr)] & PTE_P) && (uvpt[PGNUM(addr)] & PTE_U)) {
 				duppage(envid, PGNUM(addr));
 		}
 	}
+	batch_flush(envid);
 	cprintf("%s %d: [%08x] env %08x is running\n", __FILE__, __LINE__, sys_getenvid(), envid);
-	int r = sys_page_alloc(envid, (void*)(UXSTACKTOP - PGSIZE), PTE_P | PTE_U | PTE_W);
+	r = sys_page_alloc(envid, (void*)(UXSTACKTOP - PGSIZE), PTE_P | PTE_U | PTE_W);
 	if (r < 0)
 		panic("fork: failed to allocate a new page %e\n", r);
 		
@@ -179,10 +247,96 @@ fork(void)
 	return envid;
 }
 
-// Challenge!
+//
+// fork, with the address space copied copy-on-write by the kernel in
+// a single system call.  The kernel also resolves the copy-on-write
+// faults of both envs from then on, without a pgfault upcall.
+//
+envid_t
+kfork(void)
+{
+	envid_t envid = sys_env_fork_cow();
+
+	if (envid == 0)
+		thisenv = &envs[ENVX(sys_getenvid())];
+	return envid;
+}
+
+//
+// Queue the sharing of our virtual page pn with envid: the child maps
+// the same page with the same permissions, so writes by either env are
+// seen by both.  A copy-on-write page is first replaced by a private
+// writable copy, or the first write would split it again.
+//
+static void
+sharepage(envid_t envid, unsigned pn)
+{
+	volatile char *va = (volatile char *) (pn * PGSIZE);
+
+	if (uvpt[pn] & PTE_COW)
+		*va = *va;	// the write fault gives us our own copy
+
+	if (!batch_room())
+		batch_flush(envid);
+	batch_add(&child_maps, (uintptr_t) va, PGOFF(uvpt[pn]) & PTE_SYSCALL);
+}
+
+//
+// fork, except that parent and child share all their memory but the
+// stack and PRIVATE variables, which are copy-on-write as in fork.
+// Only pages mapped at the time of the sfork are shared; later
+// sys_page_alloc's and sys_page_map's are seen by one env only.
+//
+// The stack is the 4MB region below USTACKTOP.  Pointers into it must
+// not be passed between the envs.
+//
+// Returns: child's envid to the parent, 0 to the child, < 0 on error.
+//
 int
 sfork(void)
 {
-	panic("sfork not implemented");
-	return -E_INVAL;
+	extern unsigned char private_start[], private_end[];
+	envid_t envid;
+	uint32_t addr;
+	int r;
+
+	set_pgfault_handler(pgfault);
+	if ((envid = sys_exofork()) < 0)
+		return envid;
+	if (envid == 0) {
+		thisenv = &envs[ENVX(sys_getenvid())];
+		return 0;
+	}
+
+	batch_reset();
+	for (addr = 0; addr < USTACKTOP; addr += PGSIZE) {
+		if ((uvpd[PDX(addr)] & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS)) {
+			// as in sharepage, get our own copy first
+			if (uvpd[PDX(addr)] & PTE_COW)
+				*(volatile char *) addr = *(volatile char *) addr;
+			r = sys_page_map(0, (void*)addr, envid, (void*)addr,
+					 uvpd[PDX(addr)] & PTE_SYSCALL);
+			if (r < 0)
+				panic("sfork: failed to share a 4MB page %e\n", r);
+			addr += PTSIZE - PGSIZE;
+			continue;
+		}
+		if (!(uvpd[PDX(addr)] & PTE_P) || !(uvpt[PGNUM(addr)] & PTE_P) ||
+		    !(uvpt[PGNUM(addr)] & PTE_U))
+			continue;
+		if (addr >= USTACKTOP - PTSIZE ||
+		    (addr >= (uint32_t) private_start && addr < (uint32_t) private_end))
+			duppage(envid, PGNUM(addr));
+		else
+			sharepage(envid, PGNUM(addr));
+	}
+	batch_flush(envid);
+
+	if ((r = sys_page_alloc(envid, (void*)(UXSTACKTOP - PGSIZE), PTE_P | PTE_U | PTE_W)) < 0)
+		panic("sfork: failed to allocate a new page %e\n", r);
+	if ((r = sys_env_set_pgfault_upcall(envid, _pgfault_upcall)) < 0)
+		panic("sfork: failed to set a pagfault handler %e\n", r);
+	if ((r = sys_env_set_status(envid, ENV_RUNNABLE)) < 0)
+		panic("sfork: failed to set a status %e\n", r);
+	return envid;
 }
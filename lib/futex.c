@@ -0,0 +1,42 @@
+// Adaptive waiting on a word of shared memory: spin while the change
+// is likely to come soon from another CPU, then sleep in the kernel
+// with sys_futex_wait until a waker calls futex_wake.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define FUTEX_SPIN	100	// polls before going to sleep
+
+// Wait until *addr != val.  If 'flag' is nonnull, it is set before
+// sleeping to tell the waker that a sys_futex_wake is needed; pass the
+// same flag to futex_wake.  If 'timeout' is nonzero, sleep at most that
+// many timer ticks.  May return before *addr changes, so callers
+// recheck their condition in a loop.
+void
+futex_wait(volatile uint32_t *addr, uint32_t val, volatile uint32_t *flag,
+	   unsigned timeout)
+{
+	int i;
+
+	for (i = 0; i < FUTEX_SPIN; i++) {
+		if (*addr != val)
+			return;
+		asm volatile("pause");
+	}
+	// Raise the flag before the kernel checks *addr, so that the
+	// waker either sees the flag or we see its change.
+	if (flag)
+		xchg(flag, 1);
+	sys_futex_wait(addr, val, timeout);
+}
+
+// Wake the envs in futex_wait on 'addr', after changing *addr.  If
+// 'flag' is nonnull, only enter the kernel if a waiter raised it.
+void
+futex_wake(volatile uint32_t *addr, volatile uint32_t *flag)
+{
+	// xchg also orders the caller's store to *addr before the load.
+	if (flag && !xchg(flag, 0))
+		return;
+	sys_futex_wake(addr, NENV);
+}
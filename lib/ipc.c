@@ -75,12 +75,12 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 }
 
 // Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv'.
-// This function keeps trying until it succeeds.
-// It should panic() on any error other than -E_IPC_NOT_RECV.
+// Blocks in the kernel until 'toenv' receives the message; senders to
+// the same env are served in FIFO order.
+// Panics on any error.
 //
 // Hint:
-//   Use sys_yield() to be CPU-friendly.
-//   If 'pg' is null, pass sys_ipc_try_send a value that it will understand
+//   If 'pg' is null, pass sys_ipc_send a value that it will understand
 //   as meaning "no page".  (Zero is not the right value.)
 void
 ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
@@ -91,23 +91,77 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 		pg = (void*)(-1);
 	}
 	
-	do {
-		r = sys_ipc_try_send(to_env, val, pg, perm);
-		if (r < 0 && r != -E_IPC_NOT_RECV) 
-			panic("ipc_send: %e\n", r);
-		
-		sys_yield();
-		//if (r == -E_IPC_NOT_RECV) {
-		//	sys_yield();
-		//} else if (r < 0)
-		//	panic("ipc_send: %e\n", r);
-	}
-	while (r != 0);
+	if ((r = sys_ipc_send(to_env, val, pg, perm)) < 0)
+		panic("ipc_send: %e\n", r);
 		
 	//if (debug)
 	//	cprintf("ipc_send: %08x sending to %08x success, page %08x\n", sys_getenvid(), to_env, pg);
 }
 
+// Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv' and
+// wait for the answer, which is returned as ipc_recv returns it.  The
+// target runs right away on this CPU if it is receiving; otherwise we
+// block until it is, like ipc_send.  A server uses this to send its
+// reply and wait for the next request in one system call.
+// Panics on any error.
+int32_t
+ipc_call(envid_t to_env, uint32_t val, void *pg, int perm,
+	 envid_t *from_env_store, void *rcv_pg, int *perm_store)
+{
+	int r;
+
+	if (!pg)
+		pg = (void*)(-1);
+	if (!rcv_pg)
+		rcv_pg = (void*)(-1);
+
+	if ((r = sys_ipc_send_recv(to_env, val, pg, perm, rcv_pg)) < 0)
+		panic("ipc_call: %e\n", r);
+
+	if (from_env_store)
+		*from_env_store = thisenv->env_ipc_from;
+	if (perm_store)
+		*perm_store = thisenv->env_ipc_perm;
+	return thisenv->env_ipc_value;
+}
+
+// Like ipc_call, but send the IPC_NWORDS words in 'words' instead of a
+// page.  They travel in registers, so small messages need no page
+// mapping.  The words of the answer are copied back into 'words'.
+int32_t
+ipc_call_words(envid_t to_env, uint32_t val, uint32_t *words,
+	       envid_t *from_env_store)
+{
+	int r;
+
+	if ((r = sys_ipc_call_words(to_env, val, words)) < 0)
+		panic("ipc_call_words: %e\n", r);
+
+	memcpy(words, (void *) thisenv->env_ipc_words, sizeof(thisenv->env_ipc_words));
+	if (from_env_store)
+		*from_env_store = thisenv->env_ipc_from;
+	return thisenv->env_ipc_value;
+}
+
+// Like ipc_call, but send and receive runs of pages as described by
+// 'sg' (see sys_ipc_send_recv_sg).  The number of pages received is
+// stored in *npages_store if it is nonnull.
+int32_t
+ipc_call_sg(envid_t to_env, uint32_t val, const struct IpcSg *sg,
+	    envid_t *from_env_store, size_t *npages_store)
+{
+	int r;
+
+	if ((r = sys_ipc_send_recv_sg(to_env, val, sg)) < 0)
+		panic("ipc_call_sg: %e\n", r);
+
+	if (from_env_store)
+		*from_env_store = thisenv->env_ipc_from;
+	if (npages_store)
+		*npages_store = thisenv->env_ipc_npages;
+	return thisenv->env_ipc_value;
+}
+
 // Find the first environment of the given type.  We'll use this to
 // find special environments.
 // Returns 0 if no such environment exists.
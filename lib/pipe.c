@@ -1,4 +1,5 @@
 #include <inc/lib.h>
+#include <inc/x86.h>
 
 #define debug 0
 
@@ -17,21 +18,53 @@ struct Dev devpipe =
 	.dev_stat =	devpipe_stat,
 };
 
-#define PIPEBUFSIZ 32		// small to provoke races
+// The ring lives in the pages after the Pipe header, in the fd's data
+// region, and holds a power-of-two number of pages so the free-running
+// positions wrap cleanly.  pipe() gets PIPEBUFPAGES of them.
+#define PIPEBUFPAGES	16
+#define PIPEMAXPAGES	512
 
+#define PIPE_SPIN	100	// polls before going to sleep
+
+// A reader sleeps on p_rwake and a writer on p_wwake.  Whoever moves
+// the other side's position, or closes an end, bumps the word if its
+// sleep flag is up, so a waiter that read the word before checking the
+// positions and pageref never misses the change it is waiting for.
 struct Pipe {
-	off_t p_rpos;		// read position
-	off_t p_wpos;		// write position
-	uint8_t p_buf[PIPEBUFSIZ];	// data buffer
+	volatile uint32_t p_rpos;	// read position
+	volatile uint32_t p_wpos;	// write position
+	volatile uint32_t p_rsleep;	// a reader sleeps on p_rwake
+	volatile uint32_t p_wsleep;	// a writer sleeps on p_wwake
+	volatile uint32_t p_rwake;	// bumped to wake readers
+	volatile uint32_t p_wwake;	// bumped to wake writers
+	uint32_t p_bufsiz;	// bytes in the ring
 };
 
+#define PIPEBUF(p)	((uint8_t *) (p) + PGSIZE)
+
 int
 pipe(int pfd[2])
+{
+	return pipe_sized(pfd, PIPEBUFPAGES * PGSIZE);
+}
+
+// Create a pipe whose ring holds at least 'bufsiz' bytes, rounded up to
+// a power-of-two number of pages.
+int
+pipe_sized(int pfd[2], size_t bufsiz)
 {
 	int r;
+	size_t i, npages;
 	struct Fd *fd0, *fd1;
+	struct Pipe *p;
+	struct PageMapRange pm;
 	void *va;
 
+	if (bufsiz > PIPEMAXPAGES * PGSIZE)
+		return -E_INVAL;
+	for (npages = 1; npages * PGSIZE < bufsiz; npages <<= 1)
+		;
+
 	// allocate the file descriptor table entries
 	if ((r = fd_alloc(&fd0)) < 0
 	    || (r = sys_page_alloc(0, fd0, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
@@ -41,12 +74,20 @@ pipe(int pfd[2])
 	    || (r = sys_page_alloc(0, fd1, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
 		goto err1;
 	
-	// allocate the pipe structure as first data page in both
+	// allocate the pipe structure as first data page in both,
+	// followed by the ring
 	va = fd2data(fd0);
-	if ((r = sys_page_alloc(0, va, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
-		goto err2;
-	if ((r = sys_page_map(0, va, 0, fd2data(fd1), PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
+	for (i = 0; i <= npages; i++)
+		if ((r = sys_page_alloc(0, va + i * PGSIZE, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
+			goto err3;
+	pm.pm_srcva = (uintptr_t) va;
+	pm.pm_dstva = (uintptr_t) fd2data(fd1);
+	pm.pm_npages = npages + 1;
+	pm.pm_perm = PTE_P|PTE_W|PTE_U|PTE_SHARE;
+	if ((r = sys_page_map_batch(0, 0, &pm, 1)) < 0)
 		goto err3;
+	p = (struct Pipe *) va;
+	p->p_bufsiz = npages * PGSIZE;
 	
 	// set up fd structures
 	fd0->fd_dev_id = devpipe.dev_id;
@@ -63,8 +104,10 @@ pipe(int pfd[2])
 	return 0;
 
     err3:
-	sys_page_unmap(0, va);
-    err2:
+	for (i = 0; i <= npages; i++) {
+		sys_page_unmap(0, va + i * PGSIZE);
+		sys_page_unmap(0, fd2data(fd1) + i * PGSIZE);
+	}
 	sys_page_unmap(0, fd1);
     err1:
 	sys_page_unmap(0, fd0);
@@ -72,6 +115,11 @@ pipe(int pfd[2])
 	return r;
 }
 
+// The other end is closed once only our end's fds map the pipe.  A
+// closing end unmaps its ring pages, wakes us and only then unmaps the
+// header, so the first ring page shows it first.  An env that exits
+// without closing unmaps the header first, and the kernel's wake-up on
+// unmap gets us to look then.
 static int
 _pipeisclosed(struct Fd *fd, struct Pipe *p)
 {
@@ -79,7 +127,8 @@ _pipeisclosed(struct Fd *fd, struct Pipe *p)
 
 	while (1) {
 		n = thisenv->env_runs;
-		ret = pageref(fd) == pageref(p);
+		ret = pageref(fd) == pageref(PIPEBUF(p)) ||
+			pageref(fd) == pageref(p);
 		nn = thisenv->env_runs;
 		if (n == nn)
 			return ret;
@@ -101,11 +150,61 @@ pipeisclosed(int fdnum)
 	return _pipeisclosed(fd, p);
 }
 
+// Wait until *pos is not 'val' or the other end of the pipe is closed,
+// or return right away if that is already so.  'sleeping' and 'wake'
+// are our side's flag and wake-up word.  May return early, so callers
+// recheck in a loop.
+static void
+pipe_wait(struct Fd *fd, struct Pipe *p, volatile uint32_t *pos,
+	  uint32_t val, volatile uint32_t *sleeping, volatile uint32_t *wake)
+{
+	uint32_t w;
+	int i;
+
+	for (i = 0; i < PIPE_SPIN && *pos == val; i++)
+		asm volatile("pause");
+	// Raise the flag before the last check, so that the peer either
+	// sees it and bumps *wake, or we see the peer's change.
+	w = *wake;
+	xchg(sleeping, 1);
+	if (*pos == val && !_pipeisclosed(fd, p))
+		sys_futex_wait(wake, w, 0);
+}
+
+// Wake the other side if it sleeps in pipe_wait, after changing its
+// position or closing our end.
+static void
+pipe_wake(volatile uint32_t *sleeping, volatile uint32_t *wake)
+{
+	// xchg also orders the caller's store before the load.
+	if (!xchg(sleeping, 0))
+		return;
+	__sync_fetch_and_add(wake, 1);
+	sys_futex_wake(wake, NENV);
+}
+
+// Copy 'n' bytes between 'buf' and the ring at position 'pos', in at
+// most two pieces if the range wraps.
+static void
+pipe_copy(struct Pipe *p, uint32_t pos, void *buf, size_t n, bool out)
+{
+	size_t off, m;
+
+	off = pos & (p->p_bufsiz - 1);
+	m = MIN(n, p->p_bufsiz - off);
+	if (out) {
+		memcpy(buf, PIPEBUF(p) + off, m);
+		memcpy((uint8_t *) buf + m, PIPEBUF(p), n - m);
+	} else {
+		memcpy(PIPEBUF(p) + off, buf, m);
+		memcpy(PIPEBUF(p), (uint8_t *) buf + m, n - m);
+	}
+}
+
 static ssize_t
 devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 {
-	uint8_t *buf;
-	size_t i;
+	size_t avail;
 	struct Pipe *p;
 
 	p = (struct Pipe*)fd2data(fd);
@@ -113,34 +212,34 @@ devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 		cprintf("[%08x] devpipe_read %08x %d rpos %d wpos %d\n",
 			thisenv->env_id, uvpt[PGNUM(p)], n, p->p_rpos, p->p_wpos);
 
-	buf = vbuf;
-	for (i = 0; i < n; i++) {
-		while (p->p_rpos == p->p_wpos) {
-			// pipe is empty
-			// if we got any data, return it
-			if (i > 0)
-				return i;
-			// if all the writers are gone, note eof
-			if (_pipeisclosed(fd, p))
-				return 0;
-			// yield and see what happens
-			if (debug)
-				cprintf("devpipe_read yield\n");
-			sys_yield();
-		}
-		// there's a byte.  take it.
-		// wait to increment rpos until the byte is taken!
-		buf[i] = p->p_buf[p->p_rpos % PIPEBUFSIZ];
-		p->p_rpos++;
+	if (n == 0)
+		return 0;
+	while ((avail = p->p_wpos - p->p_rpos) == 0) {
+		// pipe is empty
+		// if all the writers are gone, note eof
+		if (_pipeisclosed(fd, p))
+			return 0;
+		// wait for a writer to move wpos
+		if (debug)
+			cprintf("devpipe_read sleep\n");
+		pipe_wait(fd, p, &p->p_wpos, p->p_rpos, &p->p_rsleep,
+			  &p->p_rwake);
 	}
-	return i;
+	// take what is there, up to n bytes.
+	// wait to advance rpos until the bytes are taken!
+	n = MIN(n, avail);
+	pipe_copy(p, p->p_rpos, vbuf, n, true);
+	p->p_rpos += n;
+	// there's room now for a writer waiting on a full pipe
+	pipe_wake(&p->p_wsleep, &p->p_wwake);
+	return n;
 }
 
 static ssize_t
 devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 {
 	const uint8_t *buf;
-	size_t i;
+	size_t i, room;
 	struct Pipe *p;
 
 	p = (struct Pipe*) fd2data(fd);
@@ -149,25 +248,30 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 			thisenv->env_id, uvpt[PGNUM(p)], n, p->p_rpos, p->p_wpos);
 
 	buf = vbuf;
-	for (i = 0; i < n; i++) {
-		while (p->p_wpos >= p->p_rpos + sizeof(p->p_buf)) {
+	for (i = 0; i < n; i += room) {
+		while ((room = p->p_bufsiz - (p->p_wpos - p->p_rpos)) == 0) {
 			// pipe is full
 			// if all the readers are gone
 			// (it's only writers like us now),
 			// note eof
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
+			// let readers at what we wrote, then wait for
+			// one to move rpos
 			if (debug)
-				cprintf("devpipe_write yield\n");
-			sys_yield();
+				cprintf("devpipe_write sleep\n");
+			pipe_wake(&p->p_rsleep, &p->p_rwake);
+			pipe_wait(fd, p, &p->p_rpos, p->p_wpos - p->p_bufsiz,
+				  &p->p_wsleep, &p->p_wwake);
 		}
-		// there's room for a byte.  store it.
-		// wait to increment wpos until the byte is stored!
-		p->p_buf[p->p_wpos % PIPEBUFSIZ] = buf[i];
-		p->p_wpos++;
+		// store as much as fits.
+		// wait to advance wpos until the bytes are stored!
+		room = MIN(n - i, room);
+		pipe_copy(p, p->p_wpos, (void *) (buf + i), room, false);
+		p->p_wpos += room;
 	}
 
+	pipe_wake(&p->p_rsleep, &p->p_rwake);
 	return i;
 }
 
@@ -185,7 +289,16 @@ devpipe_stat(struct Fd *fd, struct Stat *stat)
 static int
 devpipe_close(struct Fd *fd)
 {
+	struct Pipe *p = (struct Pipe*) fd2data(fd);
+	size_t i, npages = p->p_bufsiz / PGSIZE;
+
 	(void) sys_page_unmap(0, fd);
-	return sys_page_unmap(0, fd2data(fd));
+	for (i = 1; i <= npages; i++)
+		(void) sys_page_unmap(0, (uint8_t *) p + i * PGSIZE);
+	// _pipeisclosed at the other end sees we are gone now, so wake
+	// it; the header goes last, as we still need it for that.
+	pipe_wake(&p->p_rsleep, &p->p_rwake);
+	pipe_wake(&p->p_wsleep, &p->p_wwake);
+	return sys_page_unmap(0, p);
 }
 
@@ -0,0 +1,108 @@
+// Single-producer, single-consumer message rings in a page of memory
+// shared between two envs.  Messages are passed without system calls;
+// a side only enters the kernel to sleep on its doorbell when the ring
+// is empty (consumer) or full (producer), and the other side rings the
+// doorbell only if it finds its peer asleep.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define RING_NSLOTS	512	// must be a power of two
+#define RING_SPIN	200	// polls before going to sleep
+
+struct Ring {
+	envid_t r_prod;			// env that sends
+	envid_t r_cons;			// env that receives
+	volatile uint32_t r_head;	// messages sent so far
+	volatile uint32_t r_tail;	// messages received so far
+	volatile uint32_t r_prod_sleeping;	// producer waits for room
+	volatile uint32_t r_cons_sleeping;	// consumer waits for messages
+	volatile uint32_t r_slots[RING_NSLOTS];
+};
+
+// Set up a ring at page-aligned address 'ring', with ourselves as the
+// producer and 'peer' as the consumer, and send it to 'peer', which
+// must call ring_accept.  Each side lets the other ring its doorbell,
+// so an env takes part in rings with one peer at a time.
+// Returns 0 on success, < 0 on error.
+int
+ring_create(struct Ring *ring, envid_t peer)
+{
+	int r;
+
+	static_assert(sizeof(struct Ring) <= PGSIZE);
+	if ((r = sys_page_alloc(0, ring, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
+		return r;
+	ring->r_prod = thisenv->env_id;
+	ring->r_cons = peer;
+	ring->r_head = ring->r_tail = 0;
+	ring->r_prod_sleeping = ring->r_cons_sleeping = 0;
+	sys_doorbell_peer(peer);
+	ipc_send(peer, 0, ring, PTE_P|PTE_W|PTE_U|PTE_SHARE);
+	return 0;
+}
+
+// Receive the ring a peer set up with ring_create, and map it at
+// page-aligned address 'ring'.  We are its consumer.
+// Returns 0 on success, < 0 on error.
+int
+ring_accept(struct Ring *ring)
+{
+	envid_t peer;
+	int perm;
+
+	ipc_recv(&peer, ring, &perm);
+	if (!(perm & PTE_P))
+		return -E_INVAL;
+	return sys_doorbell_peer(peer);
+}
+
+// Sleep until '*cnt - *base' is not 'full', or return right away if
+// it already isn't.  'sleeping' is our flag in the ring, which tells
+// the peer to ring our doorbell once it has moved its counter.
+static void
+ring_wait(volatile uint32_t *cnt, volatile uint32_t *base, uint32_t full,
+	  volatile uint32_t *sleeping)
+{
+	int i;
+
+	for (i = 0; i < RING_SPIN && *cnt - *base == full; i++)
+		asm volatile("pause");
+	while (*cnt - *base == full) {
+		// Raise the flag before the last check, so that the peer
+		// either sees it or we see the peer's update.
+		xchg(sleeping, 1);
+		if (*cnt - *base == full)
+			sys_doorbell_wait();
+		*sleeping = 0;
+	}
+}
+
+// Send 'value' on 'ring', waiting while it is full.
+void
+ring_send(struct Ring *ring, uint32_t value)
+{
+	ring_wait(&ring->r_head, &ring->r_tail, RING_NSLOTS,
+		  &ring->r_prod_sleeping);
+	ring->r_slots[ring->r_head % RING_NSLOTS] = value;
+	ring->r_head++;
+	// The consumer only sleeps on an empty ring, so this rings just
+	// when the ring goes from empty to non-empty under a sleeper.
+	// xchg also orders the r_head store before the flag load.
+	if (xchg(&ring->r_cons_sleeping, 0))
+		sys_doorbell_ring(ring->r_cons);
+}
+
+// Receive the next value from 'ring', waiting while it is empty.
+uint32_t
+ring_recv(struct Ring *ring)
+{
+	uint32_t value;
+
+	ring_wait(&ring->r_head, &ring->r_tail, 0, &ring->r_cons_sleeping);
+	value = ring->r_slots[ring->r_tail % RING_NSLOTS];
+	ring->r_tail++;
+	if (xchg(&ring->r_prod_sleeping, 0))
+		sys_doorbell_ring(ring->r_prod);
+	return value;
+}
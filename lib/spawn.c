@@ -4,6 +4,12 @@
 #define UTEMP2USTACK(addr)	((void*) (addr) + (USTACKTOP - PGSIZE) - UTEMP)
 #define UTEMP2			(UTEMP + PGSIZE)
 #define UTEMP3			(UTEMP2 + PGSIZE)
+// Past the FSMAXPAGES pages map_segment reads at UTEMP
+#define UTEMPTAIL		(UTEMP + FSMAXPAGES * PGSIZE)
+
+// Ranges copy_shared_pages collects per sys_page_map_batch; they
+// cover at most PAGEMAP_MAXPAGES pages.
+#define SHARE_BATCH		32
 
 #define debug 0
 
@@ -56,8 +62,9 @@ spawn(const char *prog, const char **argv)
 	//        so that multiple instances of the same program
 	//	  will share the same copy of the program text.
 	//        Be sure to map the program text read-only in the child.
-	//        Read_map is like read but returns a pointer to the data in
-	//        *blk rather than copying the data into another buffer.
+	//        Read_map is like read but maps the file server's pages
+	//        holding the data rather than copying the data into
+	//        another buffer.
 	//
 	//	* If the ELF segment flags DO include ELF_PROG_FLAG_WRITE,
 	//	  then the segment contains read/write data and bss.
@@ -267,7 +274,7 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 	int fd, size_t filesz, off_t fileoffset, int perm)
 {
 	int i, r;
-	void *blk;
+	void *last;
 
 	//cprintf("map_segment %x+%x\n", va, memsz);
 
@@ -278,25 +285,56 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 		fileoffset -= i;
 	}
 
-	for (i = 0; i < memsz; i += PGSIZE) {
-		if (i >= filesz) {
-			// allocate a blank page
-			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
-				return r;
-		} else {
-			// from file
-			if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
-				return r;
-			if ((r = seek(fd, fileoffset + i)) < 0)
-				return r;
-			if ((r = readn(fd, UTEMP, MIN(PGSIZE, filesz-i))) < 0)
-				return r;
-			if ((r = sys_page_map(0, UTEMP, child, (void*) (va + i), perm)) < 0)
-				panic("spawn: sys_page_map data: %e", r);
-			sys_page_unmap(0, UTEMP);
+	struct PageMapRange pm;
+	size_t npages, used = 0;
+
+	// Map the file-backed pages at UTEMP with read_map, up to
+	// FSMAXPAGES at a time, and hand each batch to the child with a
+	// single sys_page_map_batch.  Text pages are the file server's
+	// cached pages, mapped read-only, so every instance of a program
+	// shares them; data pages are copy-on-write.
+	for (i = 0; i < filesz; i += npages * PGSIZE) {
+		if ((r = read_map(fd, fileoffset + i, UTEMP, filesz - i,
+				  (perm & PTE_W) ? PTE_COW : 0)) <= 0) {
+			// the file ends before the segment does
+			if (r == 0)
+				r = -E_NOT_EXEC;
+			goto out;
 		}
+		npages = ROUNDUP(r, PGSIZE) / PGSIZE;
+		used = MAX(used, npages);
+		if (r % PGSIZE && i + r < filesz) {
+			r = -E_NOT_EXEC;
+			goto out;
+		}
+		// The rest of the last page is not from the segment, so
+		// the child gets a private copy with it zeroed instead.
+		if (i + r >= filesz && r % PGSIZE) {
+			last = UTEMP + (npages - 1) * PGSIZE;
+			if ((r = sys_page_alloc(0, UTEMPTAIL, PTE_P|PTE_U|PTE_W)) < 0)
+				goto out;
+			memmove(UTEMPTAIL, last, (filesz - i) % PGSIZE);
+			r = sys_page_map(0, UTEMPTAIL, 0, last, PTE_P|PTE_U|PTE_W);
+			sys_page_unmap(0, UTEMPTAIL);
+			if (r < 0)
+				goto out;
+		}
+		pm.pm_srcva = (uintptr_t) UTEMP;
+		pm.pm_dstva = va + i;
+		pm.pm_npages = npages;
+		pm.pm_perm = (perm & PTE_W) ? (perm & ~PTE_W) | PTE_COW : perm;
+		if ((r = sys_page_map_batch(0, child, &pm, 1)) < 0)
+			panic("spawn: sys_page_map_batch data: %e", r);
 	}
-	return 0;
+	// allocate blank pages for the rest
+	for (i = ROUNDUP(filesz, PGSIZE); i < memsz; i += PGSIZE)
+		if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
+			goto out;
+	r = 0;
+out:
+	for (i = 0; i < used; i++)
+		sys_page_unmap(0, UTEMP + i * PGSIZE);
+	return r;
 }
 
 // Copy the mappings for shared pages into the child address space.
@@ -308,6 +346,9 @@ copy_shared_pages(envid_t child)
 	envid_t parent_envid = sys_getenvid();
 	int perm;
 	uint32_t addr;
+	struct PageMapRange ranges[SHARE_BATCH];
+	int n = 0;
+	size_t npages = 0;
 	
 	/*unsigned ptx;
 	for (ptx = PGNUM(UTEXT); ptx < PGNUM(UXSTACKTOP - PGSIZE); ptx++) {
@@ -324,16 +365,45 @@ copy_shared_pages(envid_t child)
 	}*/
 	
 	for(addr = 0; addr < USTACKTOP; addr += PGSIZE) {
+		// a 4MB page has no page table; its PDE holds the perms
+		if ((uvpd[PDX(addr)] & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS)) {
+			perm = uvpd[PDX(addr)] & PTE_SYSCALL;
+			if ((perm & PTE_SHARE) &&
+			    (r = sys_page_map(parent_envid, (void *)addr,
+					child, (void *)addr, perm)) < 0)
+				return r;
+			addr += PTSIZE - PGSIZE;
+			continue;
+		}
 		if ((uvpd[PDX(addr)] & PTE_P) && (uvpt[PGNUM(addr)] & PTE_P)) {
 			perm = 	uvpt[PGNUM(addr)] & PTE_SYSCALL;
-			if (perm & PTE_SHARE) {
-				if ((r = sys_page_map(parent_envid, (void *)addr, 
-						child, (void *)addr, perm)) < 0)
+			if (!(perm & PTE_SHARE))
+				continue;
+			if (npages == PAGEMAP_MAXPAGES) {
+				if ((r = sys_page_map_batch(parent_envid, child, ranges, n)) < 0)
+					return r;
+				n = npages = 0;
+			}
+			npages++;
+			// extend the last range if this page continues it
+			if (n > 0 && ranges[n - 1].pm_perm == perm &&
+			    ranges[n - 1].pm_srcva + ranges[n - 1].pm_npages * PGSIZE == addr) {
+				ranges[n - 1].pm_npages++;
+				continue;
+			}
+			if (n == SHARE_BATCH) {
+				if ((r = sys_page_map_batch(parent_envid, child, ranges, n)) < 0)
 					return r;
-				}
+				n = 0;
+				npages = 1;
 			}
+			ranges[n].pm_srcva = ranges[n].pm_dstva = addr;
+			ranges[n].pm_npages = 1;
+			ranges[n].pm_perm = perm;
+			n++;
+		}
 	}
 	
-	return 0;
+	return sys_page_map_batch(parent_envid, child, ranges, n);
 }
 
@@ -73,12 +73,31 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	return syscall(SYS_page_alloc, 1, envid, (uint32_t) va, perm, 0, 0);
 }
 
+int
+sys_page_alloc_large(envid_t envid, void *va, int perm)
+{
+	return syscall(SYS_page_alloc_large, 1, envid, (uint32_t) va, perm, 0, 0);
+}
+
 int
 sys_page_map(envid_t srcenv, void *srcva, envid_t dstenv, void *dstva, int perm)
 {
 	return syscall(SYS_page_map, 1, srcenv, (uint32_t) srcva, dstenv, (uint32_t) dstva, perm);
 }
 
+int
+sys_page_map_batch(envid_t srcenv, envid_t dstenv,
+		   const struct PageMapRange *ranges, int n)
+{
+	return syscall(SYS_page_map_batch, 1, srcenv, dstenv, (uint32_t) ranges, n, 0);
+}
+
+envid_t
+sys_env_fork_cow(void)
+{
+	return syscall(SYS_env_fork_cow, 0, 0, 0, 0, 0, 0);
+}
+
 int
 sys_page_unmap(envid_t envid, void *va)
 {
@@ -111,15 +130,81 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, int perm)
 	return syscall(SYS_ipc_try_send, 0, envid, value, (uint32_t) srcva, perm, 0);
 }
 
+int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, int perm)
+{
+	return syscall(SYS_ipc_send, 0, envid, value, (uint32_t) srcva, perm, 0);
+}
+
+int
+sys_ipc_send_recv(envid_t envid, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_send_recv, 0, envid, value, (uint32_t) srcva, perm, (uint32_t) dstva);
+}
+
+int
+sys_ipc_send_recv_sg(envid_t envid, uint32_t value, const struct IpcSg *sg)
+{
+	return syscall(SYS_ipc_send_recv_sg, 0, envid, value, (uint32_t) sg, 0, 0);
+}
+
+int
+sys_ipc_call_words(envid_t envid, uint32_t value, const uint32_t *words)
+{
+	return syscall(SYS_ipc_call_words, 0, envid, value, words[0], words[1], words[2]);
+}
+
+int
+sys_futex_wait(volatile uint32_t *addr, uint32_t expected, unsigned timeout)
+{
+	return syscall(SYS_futex_wait, 0, (uint32_t) addr, expected, timeout, 0, 0);
+}
+
+int
+sys_futex_wake(volatile uint32_t *addr, int n)
+{
+	return syscall(SYS_futex_wake, 0, (uint32_t) addr, n, 0, 0, 0);
+}
+
+int
+sys_cons_wait(void)
+{
+	return syscall(SYS_cons_wait, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_doorbell_ring(envid_t envid)
+{
+	return syscall(SYS_doorbell_ring, 0, envid, 0, 0, 0, 0);
+}
+
+int
+sys_doorbell_wait(void)
+{
+	return syscall(SYS_doorbell_wait, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_doorbell_peer(envid_t envid)
+{
+	return syscall(SYS_doorbell_peer, 0, envid, 0, 0, 0, 0);
+}
+
 int
 sys_ipc_recv(void *dstva)
 {
-	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
+	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 1, 0, 0, 0);
+}
+
+int
+sys_ipc_recv_pages(void *dstva, size_t npages)
+{
+	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, npages, 0, 0, 0);
 }
 
 //lab 4 challenge
 int
 sys_set_prio(envid_t envid, unsigned prio) 
 {
-	return syscall(SYS_set_prio, envid, prio, 0, 0, 0, 0);
+	return syscall(SYS_set_prio, 1, envid, prio, 0, 0, 0);
 }
@@ -0,0 +1,180 @@
+// Threads on top of sfork: each thread is an env sharing our memory,
+// with its own stack.  Waiting threads sleep on futexes.  Thread
+// handles and synchronization objects must live in shared memory
+// (globals or the heap), never on a stack.
+//
+// File I/O from several threads at once is safe on different file
+// descriptors: each thread has its own fsipcbuf, which is PRIVATE, and
+// its own page table, so the pages a read maps at FILEWINDOW are its
+// own.  Threads sharing a descriptor share its offset, and must
+// serialize their use of it.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NTHREADS	32
+#define SPIN_LIMIT	100	// spins before sleeping
+
+enum {
+	THREAD_FREE = 0,
+	THREAD_RUNNING,
+	THREAD_DONE
+};
+
+struct Thread {
+	volatile uint32_t t_state;
+	envid_t t_env;
+	void *t_ret;
+};
+
+static struct Thread threads[NTHREADS];
+static struct mutex threads_lock;
+
+// Our slot in threads[], or -1 in the initial thread.
+static int thread_self PRIVATE = -1;
+
+// Start a thread running fn(arg), and store its handle in *tid.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_NO_FREE_ENV if all NTHREADS slots or all envs are in use.
+int
+thread_create(thread_t *tid, void *(*fn)(void *), void *arg)
+{
+	envid_t envid;
+	int i;
+
+	mutex_lock(&threads_lock);
+	for (i = 0; i < NTHREADS; i++)
+		if (threads[i].t_state == THREAD_FREE)
+			break;
+	if (i == NTHREADS) {
+		mutex_unlock(&threads_lock);
+		return -E_NO_FREE_ENV;
+	}
+	threads[i].t_state = THREAD_RUNNING;
+	mutex_unlock(&threads_lock);
+
+	if ((envid = sfork()) < 0) {
+		threads[i].t_state = THREAD_FREE;
+		return envid;
+	}
+	if (envid == 0) {
+		thread_self = i;
+		thread_exit(fn(arg));
+	}
+	threads[i].t_env = envid;
+	*tid = i;
+	return 0;
+}
+
+// End the calling thread, handing 'ret' to thread_join.  In the
+// initial thread this is exit.
+void
+thread_exit(void *ret)
+{
+	if (thread_self < 0)
+		exit();
+	threads[thread_self].t_ret = ret;
+	threads[thread_self].t_state = THREAD_DONE;
+	futex_wake(&threads[thread_self].t_state, NULL);
+	// Not exit(): the fds we share with the other threads stay open.
+	sys_env_destroy(0);
+	panic("thread_exit: still alive");
+}
+
+// Wait for thread tid to end and store what it passed to thread_exit
+// in *ret_store, if ret_store is nonnull.  Every thread must be joined
+// exactly once.
+// Returns 0 on success, -E_INVAL if tid is not a running thread.
+int
+thread_join(thread_t tid, void **ret_store)
+{
+	struct Thread *t;
+
+	if (tid < 0 || tid >= NTHREADS || threads[tid].t_state == THREAD_FREE)
+		return -E_INVAL;
+	t = &threads[tid];
+	while (t->t_state != THREAD_DONE)
+		futex_wait(&t->t_state, THREAD_RUNNING, NULL, 0);
+	wait(t->t_env);
+	if (ret_store)
+		*ret_store = t->t_ret;
+	t->t_state = THREAD_FREE;
+	return 0;
+}
+
+// m_locked is 0 when the mutex is free, 1 when it is held, and 2 when
+// it is held and other threads may be asleep waiting for it.
+void
+mutex_init(struct mutex *m)
+{
+	m->m_locked = 0;
+}
+
+// Spin for a while, as the holder is likely running on another CPU,
+// then sleep until the holder unlocks.
+void
+mutex_lock(struct mutex *m)
+{
+	int spins;
+
+	if (xchg(&m->m_locked, 1) == 0)
+		return;
+	for (spins = 0; spins < SPIN_LIMIT; spins++) {
+		asm volatile("pause");
+		if (m->m_locked == 0 && xchg(&m->m_locked, 1) == 0)
+			return;
+	}
+	// Taking the mutex in state 2 may cost a spurious wake-up in
+	// mutex_unlock, but never loses one: we may have overwritten a 2.
+	while (xchg(&m->m_locked, 2) != 0)
+		sys_futex_wait(&m->m_locked, 2, 0);
+}
+
+void
+mutex_unlock(struct mutex *m)
+{
+	if (xchg(&m->m_locked, 0) == 2)
+		sys_futex_wake(&m->m_locked, 1);
+}
+
+void
+cond_init(struct cond *c)
+{
+	c->c_seq = 0;
+	c->c_nwaiters = 0;
+}
+
+// Release m, wait for a cond_signal or cond_broadcast on c, and take m
+// again.  Like pthreads, wake-ups can be spurious, so callers recheck
+// their condition in a loop.
+void
+cond_wait(struct cond *c, struct mutex *m)
+{
+	uint32_t seq = c->c_seq;
+
+	c->c_nwaiters++;
+	mutex_unlock(m);
+	// A signal between the unlock and the sleep changes c_seq, and
+	// the kernel then refuses to put us to sleep.
+	futex_wait(&c->c_seq, seq, NULL, 0);
+	mutex_lock(m);
+	c->c_nwaiters--;
+}
+
+// Wake one thread waiting on c.  Call with the mutex held.
+void
+cond_signal(struct cond *c)
+{
+	c->c_seq++;
+	if (c->c_nwaiters)
+		sys_futex_wake(&c->c_seq, 1);
+}
+
+// Wake every thread waiting on c.  Call with the mutex held.
+void
+cond_broadcast(struct cond *c)
+{
+	c->c_seq++;
+	if (c->c_nwaiters)
+		sys_futex_wake(&c->c_seq, NENV);
+}
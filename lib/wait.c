@@ -1,13 +1,15 @@
 #include <inc/lib.h>
 
 // Waits until 'envid' exits.
+// The kernel wakes the waiters on env_status when it frees an env.
 void
 wait(envid_t envid)
 {
 	const volatile struct Env *e;
+	uint32_t status;
 
 	assert(envid != 0);
 	e = &envs[ENVX(envid)];
-	while (e->env_id == envid && e->env_status != ENV_FREE)
-		sys_yield();
+	while (e->env_id == envid && (status = e->env_status) != ENV_FREE)
+		futex_wait((volatile uint32_t *) &e->env_status, status, NULL, 0);
 }
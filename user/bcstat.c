@@ -0,0 +1,17 @@
+// Print the file server's block cache counters.
+
+#include <inc/lib.h>
+
+void
+umain(int argc, char **argv)
+{
+	struct BcStat st;
+	int r;
+
+	if ((r = bcstat(&st)) < 0)
+		panic("bcstat: %e", r);
+	printf("block cache: %d of %d blocks, %d dirty\n",
+	       st.bc_nblocks, st.bc_size, st.bc_ndirty);
+	printf("hits %d misses %d evictions %d writebacks %d\n",
+	       st.bc_hits, st.bc_misses, st.bc_evictions, st.bc_writebacks);
+}
@@ -1,18 +1,12 @@
 #include <inc/lib.h>
 
-char buf[8192];
-
 void
 cat(int f, char *s)
 {
 	long n;
-	int r;
 
-	while ((n = read(f, buf, (long)sizeof(buf))) > 0)
-		if ((r = write(1, buf, n)) != n)
-			panic("write error copying %s: %e", s, r);
-	if (n < 0)
-		panic("error reading %s: %e", s, n);
+	if ((n = splice(f, 1, ~(size_t) 0)) < 0)
+		panic("error copying %s: %e", s, n);
 }
 
 void
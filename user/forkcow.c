@@ -0,0 +1,71 @@
+// Test kfork (sys_env_fork_cow) and compare it with fork: the cost
+// of the fork itself and of the copy-on-write faults that follow.
+// fork's children resolve their faults in the pgfault upcall, kfork's
+// in the kernel.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NPAGES	64
+
+static char buf[NPAGES * PGSIZE];
+static int counter = 1;
+
+static uint64_t
+dirty(void)
+{
+	uint64_t start;
+	int i;
+
+	start = read_tsc();
+	for (i = 0; i < NPAGES; i++)
+		buf[i * PGSIZE]++;
+	return (read_tsc() - start) / NPAGES;
+}
+
+static void
+run(const char *name, envid_t (*forkfn)(void))
+{
+	uint64_t start, cycles;
+	envid_t child;
+	int local = 10;
+
+	start = read_tsc();
+	if ((child = forkfn()) < 0)
+		panic("%s: %e", name, child);
+	cycles = read_tsc() - start;
+
+	if (child == 0) {
+		cycles = dirty();
+		counter++;
+		local++;
+		if (counter != 3 || local != 11 || buf[0] != 2)
+			panic("%s: child sees counter %d local %d buf %d",
+			      name, counter, local, buf[0]);
+		cprintf("forkcow: %s child: %llu cycles per copy-on-write fault\n",
+			name, cycles);
+		exit();
+	}
+
+	wait(child);
+	if (counter != 2 || local != 10 || buf[0] != 1)
+		panic("%s: parent sees the child's writes", name);
+	cprintf("forkcow: %s took %llu cycles\n", name, cycles);
+}
+
+void
+umain(int argc, char **argv)
+{
+	// touch everything once so both forks copy the same pages
+	dirty();
+	counter++;
+
+	run("fork", fork);
+	run("kfork", kfork);
+
+	// the parent now takes its own copy-on-write faults in the kernel
+	dirty();
+	if (buf[0] != 2)
+		panic("parent lost its write");
+	cprintf("forkcow OK\n");
+}
@@ -1,6 +1,8 @@
-// Fork a binary tree of processes and display their structure.
+// Fork a binary tree of processes and display their structure,
+// and how many cycles each fork took in the parent.
 
 #include <inc/lib.h>
+#include <inc/x86.h>
 
 #if 0
 #define DEPTH 3
@@ -48,6 +50,7 @@ void
 forkchild(const char *cur, char branch)
 {	
 	char nxt[DEPTH+1];
+	uint64_t start;
 
 	if (strlen(cur) >= DEPTH)
 		return;
@@ -56,10 +59,13 @@ forkchild(const char *cur, char branch)
 	//	sys_set_prio(0, ENV_PRIO_LOW);
 	//}
 	snprintf(nxt, DEPTH+1, "%s%c", cur, branch);
+	start = read_tsc();
 	if (fork() == 0) {
 		forktree(nxt);
 		exit();
 	}
+	cprintf("%04x: fork of '%s' took %llu cycles\n", sys_getenvid(), nxt,
+		read_tsc() - start);
 }
 
 void
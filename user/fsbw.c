@@ -0,0 +1,80 @@
+// File bandwidth: write a file in one write() and read it back in one
+// read(), checking the data, then time reading it with small and large
+// requests.  A large request moves up to FSMAXPAGES pages in one round
+// trip to the file server.  As in pipebw, cycles become MB/s at the
+// TSC rate given in MHz as the first argument.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define FILESIZE	(1 << 20)
+#define ROUNDS		8
+#define DEFAULT_MHZ	2000
+
+static uint8_t buf[FILESIZE];
+
+static void
+check(int f)
+{
+	int i, r;
+
+	// start mid-page so the runs sent and received are not aligned
+	for (i = 0; i < FILESIZE; i++)
+		buf[i] = i % 251;
+	if ((r = write(f, buf, 100)) != 100)
+		panic("write returned %d", r);
+	for (i = 100; i < FILESIZE; i += r)
+		if ((r = write(f, buf + i, FILESIZE - i)) <= 0)
+			panic("write returned %d", r);
+
+	seek(f, 0);
+	memset(buf, 0, FILESIZE);
+	if ((r = read(f, buf, 7)) != 7)
+		panic("read returned %d", r);
+	for (i = 7; i < FILESIZE; i += r)
+		if ((r = read(f, buf + i, FILESIZE - i)) <= 0)
+			panic("read returned %d", r);
+	for (i = 0; i < FILESIZE; i++)
+		if (buf[i] != i % 251)
+			panic("byte %d is %d", i, buf[i]);
+	if ((r = read(f, buf, 1)) != 0)
+		panic("read past the end returned %d", r);
+}
+
+static void
+run(int f, size_t chunk, int mhz)
+{
+	uint64_t start, cycles;
+	int round, r, n;
+
+	start = read_tsc();
+	for (round = 0; round < ROUNDS; round++) {
+		seek(f, 0);
+		for (n = 0; (r = read(f, buf, chunk)) > 0; n += r)
+			;
+		if (r < 0 || n != FILESIZE)
+			panic("read %d bytes: %e", n, r);
+	}
+	cycles = read_tsc() - start;
+	cprintf("%7d-byte reads: %llu MB/s\n", chunk,
+		(uint64_t) FILESIZE * ROUNDS * mhz / cycles);
+}
+
+void
+umain(int argc, char **argv)
+{
+	int f, mhz = DEFAULT_MHZ;
+
+	if (argc > 1)
+		mhz = strtol(argv[1], 0, 10);
+	if ((f = open("/fsbw", O_RDWR|O_CREAT|O_TRUNC)) < 0)
+		panic("open /fsbw: %e", f);
+	check(f);
+	cprintf("bulk file read and write is good\n");
+	cprintf("file read bandwidth, %d KB file, at %d MHz:\n",
+		FILESIZE >> 10, mhz);
+	run(f, 512, mhz);
+	run(f, PGSIZE, mhz);
+	run(f, FILESIZE, mhz);
+	close(f);
+}
@@ -0,0 +1,67 @@
+// Futex wake-up latency: a child sleeps in sys_futex_wait on a word of
+// a shared page, and we measure the cycles from just before our
+// sys_futex_wake until the child runs again.  Then check that a
+// sleeping waiter does not run at all while nothing wakes it.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NROUNDS	200
+
+struct Shared {
+	volatile uint32_t seq;		// bumped by us to wake the child
+	volatile uint64_t stamp;	// TSC just before the wake
+	volatile uint64_t total;	// summed wake-up delay
+};
+
+static struct Shared *sh = (struct Shared *) 0xC0000000;
+
+// Yield until the child is asleep.
+static void
+wait_asleep(envid_t child)
+{
+	while (envs[ENVX(child)].env_status != ENV_NOT_RUNNABLE)
+		sys_yield();
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t child;
+	uint32_t i, runs;
+	int r;
+
+	if ((r = sys_page_alloc(0, sh, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		for (i = 0; i < NROUNDS + 1; i++) {
+			while (sh->seq == i)
+				sys_futex_wait(&sh->seq, i, 0);
+			if (i < NROUNDS)
+				sh->total += read_tsc() - sh->stamp;
+		}
+		return;
+	}
+
+	for (i = 0; i < NROUNDS; i++) {
+		wait_asleep(child);
+		sh->stamp = read_tsc();
+		sh->seq++;
+		sys_futex_wake(&sh->seq, 1);
+	}
+	wait_asleep(child);
+	cprintf("futex wake-up: %llu cycles\n", sh->total / NROUNDS);
+
+	runs = envs[ENVX(child)].env_runs;
+	for (i = 0; i < 1000; i++)
+		sys_yield();
+	cprintf("idle waiter ran %d times in 1000 yields\n",
+		envs[ENVX(child)].env_runs - runs);
+
+	sh->seq++;
+	sys_futex_wake(&sh->seq, 1);
+	wait(child);
+}
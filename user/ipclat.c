@@ -0,0 +1,90 @@
+// Measure IPC round-trip latency against an echo server, first with
+// ipc_send followed by ipc_recv, then with ipc_call, which sends and
+// receives in one system call and switches straight to the server.
+// Last, echo IPC_NWORDS extra words in registers with ipc_call_words.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NROUNDS	1000
+
+static void
+echo_send(void)
+{
+	envid_t who;
+	uint32_t v;
+
+	while (1) {
+		v = ipc_recv(&who, 0, 0);
+		ipc_send(who, v, 0, 0);
+	}
+}
+
+static void
+echo_call(void)
+{
+	envid_t who;
+	uint32_t v;
+
+	v = ipc_recv(&who, 0, 0);
+	while (1)
+		v = ipc_call(who, v, 0, 0, &who, 0, 0);
+}
+
+static void
+echo_words(void)
+{
+	envid_t who;
+	uint32_t v, words[IPC_NWORDS];
+
+	v = ipc_recv(&who, 0, 0);
+	while (1) {
+		memcpy(words, (void *) thisenv->env_ipc_words, sizeof(words));
+		v = ipc_call_words(who, v, words, &who);
+	}
+}
+
+static void
+run(const char *name, void (*echo)(void), int mode)
+{
+	uint32_t words[IPC_NWORDS];
+	envid_t child;
+	uint64_t start;
+	int i, j;
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		echo();
+		exit();
+	}
+
+	start = read_tsc();
+	for (i = 0; i < NROUNDS; i++) {
+		if (mode == 2) {
+			for (j = 0; j < IPC_NWORDS; j++)
+				words[j] = i;
+			if (ipc_call_words(child, i, words, 0) != i ||
+			    words[IPC_NWORDS - 1] != i)
+				panic("%s: bad echo", name);
+		} else if (mode == 1) {
+			if (ipc_call(child, i, 0, 0, 0, 0, 0) != i)
+				panic("%s: bad echo", name);
+		} else {
+			ipc_send(child, i, 0, 0);
+			if (ipc_recv(0, 0, 0) != i)
+				panic("%s: bad echo", name);
+		}
+	}
+	cprintf("%s: %llu cycles per round trip\n", name,
+		(read_tsc() - start) / NROUNDS);
+	sys_env_destroy(child);
+}
+
+void
+umain(int argc, char **argv)
+{
+	run("send/recv", echo_send, 0);
+	run("call", echo_call, 1);
+	run("call_words", echo_words, 2);
+}
@@ -0,0 +1,88 @@
+// IPC contention benchmark: NCLIENTS clients each make NREQS requests
+// to one server env, first sending with a sys_ipc_try_send/sys_yield
+// loop, then with the blocking sys_ipc_send, which parks each client
+// on the server's send queue until the server receives.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NCLIENTS	8
+#define NREQS		200
+
+static void
+server(void)
+{
+	envid_t who;
+	uint32_t v;
+
+	while (1) {
+		v = ipc_recv(&who, 0, 0);
+		ipc_send(who, v + 1, 0, 0);
+	}
+}
+
+static void
+send_yield(envid_t to, uint32_t v)
+{
+	int r;
+
+	while ((r = sys_ipc_try_send(to, v, (void *) -1, 0)) == -E_IPC_NOT_RECV)
+		sys_yield();
+	if (r < 0)
+		panic("sys_ipc_try_send: %e", r);
+}
+
+static void
+client(envid_t srv, bool block)
+{
+	uint32_t i;
+
+	for (i = 0; i < NREQS; i++) {
+		if (block)
+			ipc_send(srv, i, 0, 0);
+		else
+			send_yield(srv, i);
+		if (ipc_recv(0, 0, 0) != i + 1)
+			panic("bad reply");
+	}
+}
+
+static void
+run(const char *name, envid_t srv, bool block)
+{
+	envid_t clients[NCLIENTS];
+	uint64_t start, cycles;
+	int i;
+
+	start = read_tsc();
+	for (i = 0; i < NCLIENTS; i++) {
+		if ((clients[i] = fork()) < 0)
+			panic("fork: %e", clients[i]);
+		if (clients[i] == 0) {
+			client(srv, block);
+			exit();
+		}
+	}
+	for (i = 0; i < NCLIENTS; i++)
+		wait(clients[i]);
+	cycles = read_tsc() - start;
+	cprintf("%s: %d clients, %llu cycles per request\n", name, NCLIENTS,
+		cycles / (NCLIENTS * NREQS));
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t srv;
+
+	if ((srv = fork()) < 0)
+		panic("fork: %e", srv);
+	if (srv == 0) {
+		server();
+		exit();
+	}
+
+	run("try_send+yield", srv, false);
+	run("blocking send", srv, true);
+	sys_env_destroy(srv);
+}
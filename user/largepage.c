@@ -0,0 +1,87 @@
+// Test 4MB pages: sys_page_alloc_large, copy-on-write across fork,
+// and unmapping.  Also compares the cost of touching every 4KB of a 4MB
+// region backed by one 4MB page against 1024 ordinary pages.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define VA	((char *) 0xA0000000)
+
+static uint64_t
+touch(void)
+{
+	uint64_t start;
+	int i, j;
+
+	start = read_tsc();
+	for (j = 0; j < 16; j++)
+		for (i = 0; i < PTSIZE; i += PGSIZE)
+			VA[i] += 1;
+	return (read_tsc() - start) / 16;
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t large, small;
+	envid_t child;
+	int i, r;
+
+	if ((r = sys_page_alloc_large(0, VA + PGSIZE, PTE_P|PTE_U|PTE_W)) != -E_INVAL)
+		panic("sys_page_alloc_large at unaligned va: %e", r);
+	if ((r = sys_page_alloc_large(0, VA, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_alloc_large: %e", r);
+	if (!(uvpd[PDX(VA)] & PTE_PS))
+		panic("no 4MB PDE at %08x", VA);
+	for (i = 0; i < PTSIZE; i += PGSIZE)
+		if (VA[i] != 0)
+			panic("4MB page not zeroed at %08x", VA + i);
+
+	// fork maps 4MB pages copy-on-write: each side's writes stay its own
+	VA[PTSIZE - 1] = 'p';
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		if (VA[PTSIZE - 1] != 'p')
+			panic("child does not see the parent's 4MB page");
+		VA[PTSIZE - 1] = 'c';
+		if (VA[PTSIZE - 1] != 'c' || VA[0] != 0)
+			panic("child's copy of the 4MB page is wrong");
+		if (!(uvpd[PDX(VA)] & PTE_PS))
+			panic("child's copy is not a 4MB page");
+		ipc_send(thisenv->env_parent_id, 0, 0, 0);
+		ipc_recv(0, 0, 0);
+		if (VA[PTSIZE - 2] != 0)
+			panic("child sees the parent's write");
+		exit();
+	}
+	ipc_recv(0, 0, 0);
+	if (VA[PTSIZE - 1] != 'p')
+		panic("parent sees the child's write");
+	VA[PTSIZE - 2] = 'q';
+	ipc_send(child, 0, 0, 0);
+	wait(child);
+	if (VA[PTSIZE - 1] != 'p' || VA[PTSIZE - 2] != 'q')
+		panic("parent's 4MB page changed under it");
+	if (!(uvpd[PDX(VA)] & PTE_W))
+		panic("parent's 4MB page is still copy-on-write");
+
+	large = touch();
+
+	// unmapping any page of it removes the whole 4MB page
+	if ((r = sys_page_unmap(0, VA + 5 * PGSIZE)) < 0)
+		panic("sys_page_unmap: %e", r);
+	if (uvpd[PDX(VA)] & PTE_P)
+		panic("4MB page still mapped after unmap");
+
+	for (i = 0; i < PTSIZE; i += PGSIZE)
+		if ((r = sys_page_alloc(0, VA + i, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+	small = touch();
+	for (i = 0; i < PTSIZE; i += PGSIZE)
+		sys_page_unmap(0, VA + i);
+
+	cprintf("largepage: touching 4MB: %llu cycles with a 4MB page, "
+		"%llu with 4KB pages\n", large, small);
+	cprintf("largepage OK\n");
+}
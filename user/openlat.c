@@ -0,0 +1,80 @@
+// open() latency for deep paths: build /openlat/d1/.../dDEPTH with
+// NFILES files at the bottom, then time opening names there that
+// aren't in it, the first time (when the file server's path cache has
+// every component but the last) and once they are cached, and opening
+// the files.  Each is compared with the same opens under O_NOCACHE,
+// which look every component up in its directory as before the cache.
+// As in pipebw, cycles become microseconds at the TSC rate given in MHz
+// as the first argument.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define DEPTH		8
+#define NFILES		16
+#define ROUNDS		16
+#define DEFAULT_MHZ	2000
+
+static char dir[MAXPATHLEN];
+static char path[MAXPATHLEN];
+
+static uint64_t
+time_opens(const char *prefix, int rounds, bool exists, int omode)
+{
+	uint64_t start, cycles = 0;
+	int round, i, fd;
+
+	for (round = 0; round < rounds; round++)
+		for (i = 0; i < NFILES; i++) {
+			snprintf(path, sizeof(path), "%s/%s%d", dir, prefix, i);
+			start = read_tsc();
+			fd = open(path, O_RDONLY|omode);
+			cycles += read_tsc() - start;
+			if (exists && fd < 0)
+				panic("open %s: %e", path, fd);
+			if (!exists && fd != -E_NOT_FOUND)
+				panic("open %s returned %d", path, fd);
+			if (fd >= 0)
+				close(fd);
+		}
+	return cycles / (rounds * NFILES);
+}
+
+void
+umain(int argc, char **argv)
+{
+	int mhz = DEFAULT_MHZ, i, fd;
+	uint64_t uncached, cold, warm;
+
+	if (argc > 1)
+		mhz = strtol(argv[1], 0, 10);
+
+	strcpy(dir, "/openlat");
+	for (i = 0; i <= DEPTH; i++) {
+		if (i > 0)
+			snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir), "/d%d", i);
+		if ((fd = open(dir, O_RDONLY|O_CREAT|O_MKDIR)) < 0)
+			panic("mkdir %s: %e", dir, fd);
+		close(fd);
+	}
+	for (i = 0; i < NFILES; i++) {
+		snprintf(path, sizeof(path), "%s/f%d", dir, i);
+		if ((fd = open(path, O_RDONLY|O_CREAT)) < 0)
+			panic("create %s: %e", path, fd);
+		close(fd);
+	}
+
+	cprintf("open() of paths %d directories deep, at %d MHz:\n",
+		DEPTH + 1, mhz);
+	// Uncached opens don't fill the cache, so "first" is still first.
+	uncached = time_opens("missing", ROUNDS, false, O_NOCACHE);
+	cold = time_opens("missing", 1, false, 0);
+	warm = time_opens("missing", ROUNDS, false, 0);
+	cprintf("missing file: uncached %llu us, first %llu us, cached %llu us\n",
+		uncached / mhz, cold / mhz, warm / mhz);
+	// Creating the files cached their names too.
+	uncached = time_opens("f", ROUNDS, true, O_NOCACHE);
+	warm = time_opens("f", ROUNDS, true, 0);
+	cprintf("existing file: uncached %llu us, cached %llu us\n",
+		uncached / mhz, warm / mhz);
+}
@@ -0,0 +1,105 @@
+// Parallel compute demo for the thread library: count the primes
+// below LIMIT with 1, 2, 4 and 8 threads.  Workers take chunks of the
+// range from a shared counter under a mutex, and wait on a condition
+// variable for the go signal so that they all start together.
+// Run with CPUS=n to see the work spread over n CPUs.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define LIMIT	200000
+#define CHUNK	2000
+#define MAXTHREADS	8
+
+static struct mutex lock;
+static struct cond go_cond;
+static bool go;
+static uint32_t next;		// start of the next chunk to hand out
+static uint32_t nprimes;
+
+static bool
+isprime(uint32_t n)
+{
+	uint32_t d;
+
+	if (n < 2)
+		return false;
+	for (d = 2; d * d <= n; d++)
+		if (n % d == 0)
+			return false;
+	return true;
+}
+
+static void *
+worker(void *arg)
+{
+	uint32_t lo, n, count;
+
+	mutex_lock(&lock);
+	while (!go)
+		cond_wait(&go_cond, &lock);
+	mutex_unlock(&lock);
+
+	while (1) {
+		mutex_lock(&lock);
+		lo = next;
+		next += CHUNK;
+		mutex_unlock(&lock);
+		if (lo >= LIMIT)
+			return 0;
+
+		count = 0;
+		for (n = lo; n < lo + CHUNK && n < LIMIT; n++)
+			if (isprime(n))
+				count++;
+
+		mutex_lock(&lock);
+		nprimes += count;
+		mutex_unlock(&lock);
+	}
+}
+
+static uint64_t
+run(int nthreads)
+{
+	thread_t tids[MAXTHREADS];
+	uint64_t start, cycles;
+	int i, r;
+
+	mutex_init(&lock);
+	cond_init(&go_cond);
+	go = false;
+	next = 0;
+	nprimes = 0;
+
+	for (i = 0; i < nthreads; i++)
+		if ((r = thread_create(&tids[i], worker, 0)) < 0)
+			panic("thread_create: %e", r);
+
+	start = read_tsc();
+	mutex_lock(&lock);
+	go = true;
+	cond_broadcast(&go_cond);
+	mutex_unlock(&lock);
+	for (i = 0; i < nthreads; i++)
+		thread_join(tids[i], 0);
+	cycles = read_tsc() - start;
+
+	cprintf("%d threads: %d primes below %d, %llu cycles\n",
+		nthreads, nprimes, LIMIT, cycles);
+	return cycles;
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t base, cycles;
+	int n;
+
+	base = run(1);
+	for (n = 2; n <= MAXTHREADS; n *= 2) {
+		cycles = run(n);
+		cprintf("  speedup with %d threads: %llu.%02llu\n", n,
+			base / cycles, (base * 100 / cycles) % 100);
+	}
+}
@@ -1,29 +1,39 @@
 // Ping-pong a counter between two processes.
 // Only need to start one of these -- splits into two with fork.
+// Each side sends its answer and waits for the next one with ipc_call,
+// which switches straight to the other side.
 
 #include <inc/lib.h>
+#include <inc/x86.h>
 
 void
 umain(int argc, char **argv)
 {
 	envid_t who;
+	uint32_t i;
+	uint64_t start;
 
+	start = read_tsc();
 	if ((who = fork()) != 0) {
 		// get the ball rolling
 		cprintf("send 0 from %x to %x\n", sys_getenvid(), who);
-		ipc_send(who, 0, 0, 0);
-	}
+		start = read_tsc();
+		i = ipc_call(who, 0, 0, 0, &who, 0, 0);
+	} else
+		i = ipc_recv(&who, 0, 0);
 
 	while (1) {
-		uint32_t i = ipc_recv(&who, 0, 0);
 		cprintf("%x got %d from %x\n", sys_getenvid(), i, who);
 		if (i == 10)
 			return;
 		i++;
-		ipc_send(who, i, 0, 0);
-		if (i == 10)
+		if (i == 10) {
+			ipc_send(who, i, 0, 0);
+			cprintf("%x: %llu cycles per message\n", sys_getenvid(),
+				(read_tsc() - start) / 10);
 			return;
+		}
+		i = ipc_call(who, i, 0, 0, &who, 0, 0);
 	}
 
 }
-
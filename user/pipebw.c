@@ -0,0 +1,102 @@
+// Pipe bandwidth: a child writes TOTAL bytes into a pipe and we read
+// them back, for a few ring sizes.  JOS has no wall clock, so cycles
+// become MB/s at the TSC rate given in MHz as the first argument.
+// First check, with odd-sized reads and writes, that data survives the
+// ring wrapping around.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define TOTAL		(16 << 20)
+#define CHUNK		8192
+#define CHECK_BYTES	100000
+#define DEFAULT_MHZ	2000
+
+static uint8_t buf[CHUNK];
+
+static void
+check(void)
+{
+	int p[2], r;
+	envid_t child;
+	uint32_t pos, i, n;
+
+	if ((r = pipe_sized(p, PGSIZE)) < 0)
+		panic("pipe: %e", r);
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		close(p[0]);
+		for (pos = 0; pos < CHECK_BYTES; pos += n) {
+			n = MIN(1000, CHECK_BYTES - pos);
+			for (i = 0; i < n; i++)
+				buf[i] = (pos + i) % 251;
+			if ((r = write(p[1], buf, n)) != n)
+				panic("check: write returned %d", r);
+		}
+		exit();
+	}
+
+	close(p[1]);
+	for (pos = 0; (r = read(p[0], buf, 777)) > 0; pos += r)
+		for (i = 0; i < r; i++)
+			if (buf[i] != (pos + i) % 251)
+				panic("check: byte %d is %d", pos + i, buf[i]);
+	if (r < 0)
+		panic("check: read: %e", r);
+	if (pos != CHECK_BYTES)
+		panic("check: read %d bytes, wanted %d", pos, CHECK_BYTES);
+	close(p[0]);
+	wait(child);
+}
+
+static void
+run(int npages, int mhz)
+{
+	int p[2], r;
+	envid_t child;
+	uint32_t n;
+	uint64_t start, cycles;
+
+	if ((r = pipe_sized(p, npages * PGSIZE)) < 0)
+		panic("pipe: %e", r);
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		close(p[0]);
+		for (n = 0; n < TOTAL; n += CHUNK)
+			if ((r = write(p[1], buf, CHUNK)) != CHUNK)
+				panic("write returned %d", r);
+		exit();
+	}
+
+	close(p[1]);
+	start = read_tsc();
+	for (n = 0; (r = read(p[0], buf, CHUNK)) > 0; n += r)
+		;
+	cycles = read_tsc() - start;
+	if (r < 0)
+		panic("read: %e", r);
+	if (n != TOTAL)
+		panic("read %d bytes, wanted %d", n, TOTAL);
+	cprintf("%3d-page ring: %llu MB/s\n", npages,
+		(uint64_t) TOTAL * mhz / cycles);
+	close(p[0]);
+	wait(child);
+}
+
+void
+umain(int argc, char **argv)
+{
+	int mhz = DEFAULT_MHZ;
+
+	if (argc > 1)
+		mhz = strtol(argv[1], 0, 10);
+	check();
+	cprintf("pipe bandwidth, %d MB per run, at %d MHz:\n",
+		TOTAL >> 20, mhz);
+	run(1, mhz);
+	run(4, mhz);
+	run(16, mhz);
+	run(64, mhz);
+}
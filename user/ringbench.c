@@ -0,0 +1,52 @@
+// Message throughput of a shared-memory ring (lib/ring.c) against
+// ipc_send/ipc_recv: a producer sends NMSGS values to a consumer,
+// which checks them and acknowledges the last one with an IPC.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NMSGS	100000
+
+static struct Ring *ring = (struct Ring *) 0xC0000000;
+
+static void
+run(const char *name, bool use_ring)
+{
+	envid_t child;
+	uint64_t start;
+	uint32_t i;
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		if (use_ring && ring_accept(ring) < 0)
+			panic("ring_accept");
+		for (i = 0; i < NMSGS; i++)
+			if ((use_ring ? ring_recv(ring) : ipc_recv(0, 0, 0)) != i)
+				panic("%s: message %d out of order", name, i);
+		ipc_send(thisenv->env_parent_id, 0, 0, 0);
+		exit();
+	}
+
+	if (use_ring && ring_create(ring, child) < 0)
+		panic("ring_create");
+	start = read_tsc();
+	for (i = 0; i < NMSGS; i++) {
+		if (use_ring)
+			ring_send(ring, i);
+		else
+			ipc_send(child, i, 0, 0);
+	}
+	ipc_recv(0, 0, 0);
+	cprintf("%s: %llu cycles per message\n", name,
+		(read_tsc() - start) / NMSGS);
+	if (use_ring)
+		sys_page_unmap(0, ring);
+}
+
+void
+umain(int argc, char **argv)
+{
+	run("ipc", false);
+	run("ring", true);
+}
@@ -0,0 +1,51 @@
+// Scheduler throughput benchmark.
+// Forks a set of environments that do nothing but sys_yield and reports
+// how many context switches the kernel manages per million TSC cycles.
+// Run it with different CPU counts (make run-schedbench CPUS=n) to see
+// how the scheduler scales.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NCHILD	16
+#define NYIELD	1000
+
+void
+umain(int argc, char **argv)
+{
+	int i, j, ncpus;
+	uint32_t cpumask;
+	uint64_t start, cycles;
+	envid_t kids[NCHILD];
+
+	for (i = 0; i < NCHILD; i++) {
+		if ((kids[i] = fork()) < 0)
+			panic("fork: %e", kids[i]);
+		if (kids[i] == 0)
+			break;
+	}
+
+	if (i < NCHILD) {
+		cpumask = 0;
+		for (j = 0; j < NYIELD; j++) {
+			cpumask |= 1 << thisenv->env_cpunum;
+			sys_yield();
+		}
+		for (ncpus = 0; cpumask; cpumask &= cpumask - 1)
+			ncpus++;
+		cprintf("schedbench: child %d ran on %d CPU(s)\n", i, ncpus);
+		return;
+	}
+
+	start = read_tsc();
+	for (i = 0; i < NCHILD; i++)
+		while (envs[ENVX(kids[i])].env_id == kids[i] &&
+		       envs[ENVX(kids[i])].env_status != ENV_FREE)
+			sys_yield();
+	cycles = read_tsc() - start;
+
+	cprintf("schedbench: %d switches in %llu cycles\n",
+		NCHILD * NYIELD, cycles);
+	cprintf("schedbench: %llu switches per Mcycle\n",
+		(uint64_t) NCHILD * NYIELD * 1000000 / (cycles ? cycles : 1));
+}
@@ -0,0 +1,77 @@
+// Measure IPC round-trip latency while CPU hogs compete for the CPUs.
+// With a feedback scheduler the ping-pong pair keeps blocking in
+// ipc_recv and stays at a high level, so its tail latency should stay
+// well below a hog's quantum.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NHOG	4
+#define NROUND	200
+
+static uint64_t lat[NROUND];
+
+static void
+hog(void)
+{
+	while (1)
+		asm volatile("pause");
+}
+
+static void
+echo(void)
+{
+	envid_t who;
+	uint32_t v;
+
+	while (1) {
+		v = ipc_recv(&who, 0, 0);
+		ipc_send(who, v, 0, 0);
+	}
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t hogs[NHOG], peer;
+	uint64_t start, t;
+	int i, j;
+
+	if ((peer = fork()) < 0)
+		panic("fork: %e", peer);
+	if (peer == 0)
+		echo();
+
+	for (i = 0; i < NHOG; i++) {
+		if ((hogs[i] = fork()) < 0)
+			panic("fork: %e", hogs[i]);
+		if (hogs[i] == 0)
+			hog();
+	}
+
+	for (i = 0; i < NROUND; i++) {
+		start = read_tsc();
+		ipc_send(peer, i, 0, 0);
+		if (ipc_recv(0, 0, 0) != i)
+			panic("echo returned the wrong value");
+		lat[i] = read_tsc() - start;
+	}
+
+	for (i = 0; i < NHOG; i++)
+		sys_env_destroy(hogs[i]);
+	sys_env_destroy(peer);
+
+	// Insertion sort is plenty for NROUND samples.
+	for (i = 1; i < NROUND; i++) {
+		t = lat[i];
+		for (j = i; j > 0 && lat[j - 1] > t; j--)
+			lat[j] = lat[j - 1];
+		lat[j] = t;
+	}
+
+	cprintf("schedlat: %d round trips with %d hogs (cycles)\n",
+		NROUND, NHOG);
+	cprintf("schedlat: p50 %llu p90 %llu p99 %llu max %llu\n",
+		lat[NROUND / 2], lat[NROUND * 9 / 10],
+		lat[NROUND * 99 / 100], lat[NROUND - 1]);
+}
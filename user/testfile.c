@@ -4,10 +4,11 @@ const char *msg = "This is the NEW message of the day!\n\n";
 
 #define FVA ((struct Fd*)0xCCCCC000)
 
+extern union Fsipc fsipcbuf;
+
 static int
 xopen(const char *path, int mode)
 {
-	extern union Fsipc fsipcbuf;
 	envid_t fsenv;
 	
 	strcpy(fsipcbuf.open.req_path, path);
@@ -124,5 +125,19 @@ umain(int argc, char **argv)
 	}
 	close(f);
 	cprintf("large file is good\n");
+
+	// A read whose reply doesn't fit a one-page receive window fails,
+	// and the file server goes on serving
+	if ((r = xopen("/big", O_RDONLY)) < 0)
+		panic("serve_open /big: %e", r);
+	fsipcbuf.read.req_fileid = FVA->fd_file.id;
+	fsipcbuf.read.req_n = 4 * BLKSIZE;
+	ipc_send(ipc_find_env(ENV_TYPE_FS), FSREQ_READ, &fsipcbuf,
+		 PTE_P | PTE_W | PTE_U);
+	if ((r = ipc_recv(NULL, (void *) FVA + PGSIZE, NULL)) != -E_INVAL)
+		panic("oversized serve_read returned %e", r);
+	if ((r = devfile.dev_close(FVA)) < 0)
+		panic("file_close after oversized read: %e", r);
+	cprintf("oversized read is good\n");
 }
 
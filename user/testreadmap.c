@@ -0,0 +1,84 @@
+// Test read_map and text sharing: mapped file pages match the file,
+// read-only mappings of a block share one physical page, copy-on-write
+// ones can be written without touching the file, and two spawned
+// instances of a program share their text pages.
+
+#include <inc/lib.h>
+
+#define FILESIZE	(5 * PGSIZE + 300)
+
+static char *map = (char *) 0xC0000000;
+static char *map2 = (char *) 0xC0800000;
+static char buf[FILESIZE];
+
+static void
+child(void)
+{
+	// report where our text lives
+	ipc_send(thisenv->env_parent_id,
+		 PTE_ADDR(uvpt[PGNUM((uintptr_t) umain)]), 0, 0);
+}
+
+void
+umain(int argc, char **argv)
+{
+	int f, i, r;
+	uint32_t text[2];
+	envid_t who;
+
+	if (argc > 1) {
+		child();
+		return;
+	}
+
+	if ((f = open("/readmaptest", O_RDWR|O_CREAT|O_TRUNC)) < 0)
+		panic("open /readmaptest: %e", f);
+	for (i = 0; i < FILESIZE; i++)
+		buf[i] = 'a' + i % 19;
+	if ((r = write(f, buf, FILESIZE)) != FILESIZE)
+		panic("write /readmaptest: %e", r);
+
+	// read-only, shared
+	seek(f, 7);
+	if ((r = read_map(f, 0, map, FILESIZE, 0)) != FILESIZE)
+		panic("read_map returned %d", r);
+	if (memcmp(map, buf, FILESIZE) != 0)
+		panic("read_map data differs from the file");
+	if ((r = read_map(f, 2 * PGSIZE, map2, PGSIZE, 0)) != PGSIZE)
+		panic("second read_map returned %d", r);
+	if (uvpt[PGNUM(map2)] & PTE_W)
+		panic("read-only read_map page is writable");
+	if (PTE_ADDR(uvpt[PGNUM(map2)]) != PTE_ADDR(uvpt[PGNUM(map + 2 * PGSIZE)]))
+		panic("read_map pages of one block are not shared");
+	if ((r = read(f, buf, 3)) != 3 || memcmp(buf, "hij", 3) != 0)
+		panic("read_map moved the seek position");
+	cprintf("read-only read_map is good\n");
+
+	// copy-on-write, page-aligned: mapped
+	if ((r = read_map(f, PGSIZE, map2, PGSIZE, PTE_COW)) != PGSIZE)
+		panic("copy-on-write read_map returned %d", r);
+	map2[0] = 'X';
+	seek(f, PGSIZE);
+	if ((r = read(f, buf, 1)) != 1 || buf[0] == 'X')
+		panic("a write to a copy-on-write page showed through to the file");
+	cprintf("copy-on-write read_map is good\n");
+
+	// from an unaligned offset: falls back to copying
+	if ((r = read_map(f, 100, map2 + PGSIZE, 10, PTE_COW)) != 10)
+		panic("unaligned read_map returned %d", r);
+	if (memcmp(map2 + PGSIZE, map + 100, 10) != 0)
+		panic("unaligned read_map data differs from the file");
+	cprintf("unaligned read_map is good\n");
+	close(f);
+
+	// spawned instances share text
+	for (i = 0; i < 2; i++)
+		if ((r = spawnl("/testreadmap", "testreadmap", "child", 0)) < 0)
+			panic("spawn: %e", r);
+	for (i = 0; i < 2; i++)
+		text[i] = ipc_recv(&who, 0, 0);
+	if (text[0] != text[1])
+		panic("spawned instances have text at %08x and %08x",
+		      text[0], text[1]);
+	cprintf("spawned text sharing is good\n");
+}
@@ -0,0 +1,87 @@
+// Test read_page and splice: file data spliced into a pipe comes out
+// intact, a page mapped with read_page is a snapshot that neither later
+// writes to the file nor our own writes to the page disturb, and an
+// unaligned read_page falls back to copying.
+
+#include <inc/lib.h>
+
+#define FILESIZE	(3 * PGSIZE + 100)
+
+static char *pg = (char *) 0xC0000000;
+static char buf[PGSIZE];
+
+static char
+pattern(int i)
+{
+	return 'a' + i % 23;
+}
+
+static void
+check(const char *what, const char *p, int off, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (p[i] != pattern(off + i))
+			panic("%s: byte %d is %02x, wanted %02x", what, off + i,
+			      p[i], pattern(off + i));
+}
+
+void
+umain(int argc, char **argv)
+{
+	int f, f2, p[2], i, r;
+
+	if ((f = open("/splicetest", O_RDWR|O_CREAT|O_TRUNC)) < 0)
+		panic("open /splicetest: %e", f);
+	for (i = 0; i < FILESIZE; i++) {
+		buf[i % 512] = pattern(i);
+		if (i % 512 == 511 || i == FILESIZE - 1)
+			if ((r = write(f, buf, i % 512 + 1)) != i % 512 + 1)
+				panic("write /splicetest: %e", r);
+	}
+
+	// file to pipe; the pipe holds it all
+	if ((r = pipe(p)) < 0)
+		panic("pipe: %e", r);
+	seek(f, 0);
+	if ((r = splice(f, p[1], ~(size_t) 0)) != FILESIZE)
+		panic("splice returned %d, wanted %d", r, FILESIZE);
+	close(p[1]);
+	for (i = 0; (r = read(p[0], buf, sizeof(buf))) > 0; i += r)
+		check("splice", buf, i, r);
+	if (r < 0 || i != FILESIZE)
+		panic("read %d bytes back from the pipe: %e", i, r);
+	close(p[0]);
+	cprintf("splice file to pipe is good\n");
+
+	// a mapped page is a snapshot
+	seek(f, PGSIZE);
+	if ((r = read_page(f, pg, PGSIZE)) != PGSIZE)
+		panic("read_page returned %d", r);
+	check("read_page", pg, PGSIZE, PGSIZE);
+	if ((f2 = open("/splicetest", O_RDWR)) < 0)
+		panic("open /splicetest: %e", f2);
+	seek(f2, PGSIZE);
+	if ((r = write(f2, "XXXX", 4)) != 4)
+		panic("write /splicetest: %e", r);
+	check("read_page after write", pg, PGSIZE, PGSIZE);
+	pg[4] = 'Y';
+	seek(f2, PGSIZE);
+	if ((r = readn(f2, buf, 8)) != 8)
+		panic("read /splicetest: %e", r);
+	if (memcmp(buf, "XXXX", 4) != 0 || buf[4] != pattern(PGSIZE + 4))
+		panic("page writes showed through to the file");
+	close(f2);
+	sys_page_unmap(0, pg);
+	cprintf("read_page snapshot is good\n");
+
+	// the last, partial page, read unaligned
+	seek(f, 3 * PGSIZE + 10);
+	if ((r = read_page(f, pg, PGSIZE)) != 90)
+		panic("unaligned read_page returned %d", r);
+	check("unaligned read_page", pg, 3 * PGSIZE + 10, 90);
+	sys_page_unmap(0, pg);
+	close(f);
+	cprintf("unaligned read_page is good\n");
+}
@@ -0,0 +1,59 @@
+// Page allocation scaling benchmark.
+// Forks workers that each sys_page_alloc and sys_page_unmap a page in
+// their own address space in a tight loop.  These calls touch only the
+// caller's address space and the page allocator, so the aggregate rate
+// should grow with the number of CPUs (make run-vmbench CPUS=n).
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NWORKER	4
+#define NITER	2000
+#define VA	((void *) 0xA0000000)
+
+static void
+worker(int id)
+{
+	uint64_t start, cycles;
+	int i, r;
+
+	start = read_tsc();
+	for (i = 0; i < NITER; i++) {
+		if ((r = sys_page_alloc(0, VA, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		if ((r = sys_page_unmap(0, VA)) < 0)
+			panic("sys_page_unmap: %e", r);
+	}
+	cycles = read_tsc() - start;
+	cprintf("vmbench: worker %d on CPU %d: %llu cycles per alloc+unmap\n",
+		id, thisenv->env_cpunum, cycles / NITER);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t kids[NWORKER];
+	uint64_t start, cycles;
+	int i;
+
+	start = read_tsc();
+	for (i = 0; i < NWORKER; i++) {
+		if ((kids[i] = fork()) < 0)
+			panic("fork: %e", kids[i]);
+		if (kids[i] == 0) {
+			worker(i);
+			return;
+		}
+	}
+
+	for (i = 0; i < NWORKER; i++)
+		while (envs[ENVX(kids[i])].env_id == kids[i] &&
+		       envs[ENVX(kids[i])].env_status != ENV_FREE)
+			sys_yield();
+	cycles = read_tsc() - start;
+
+	cprintf("vmbench: %d alloc+unmap pairs in %llu cycles\n",
+		NWORKER * NITER, cycles);
+	cprintf("vmbench: %llu pairs per Mcycle\n",
+		(uint64_t) NWORKER * NITER * 1000000 / (cycles ? cycles : 1));
+}